@@ -0,0 +1,816 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "calc.h"
+#include "batch.h"
+
+// Output is written in blocks of this size, so the per-expression cost is
+// evaluation and formatting, not stdio calls.
+#define BATCH_BUFFER (1 << 20)
+
+// Input is taken in chunks of about this many bytes. In parallel mode they
+// are the unit of work: large enough that queueing costs vanish next to
+// evaluation, small enough that every core stays busy on modest files.
+#define BATCH_CHUNK (64 << 10)
+
+// Chunks allowed in flight per worker. Output is written in input order, so
+// one slow chunk holds back those after it; the window bounds how much
+// finished output can pile up behind it.
+#define BATCH_CHUNKS_PER_WORKER 4
+
+#define BATCH_MAX_THREADS 1024
+
+// Size given to a new --store file. It is sparse, so space on disk grows
+// only as it fills.
+#define BATCH_STORE_BYTES (64 << 20)
+
+// Buffered output, either to a file (flushed when full) or to memory (grown
+// when full, for chunks that are written later)
+typedef struct {
+    char *data;
+    size_t used;
+    size_t capacity;
+    FILE *file;
+    int failed;
+} Output;
+
+static void output_flush(Output *out) {
+    if (out->used > 0 && fwrite(out->data, 1, out->used, out->file) != out->used) {
+        out->failed = 1;
+    }
+    out->used = 0;
+}
+
+// Makes room for size more bytes; size must not exceed the capacity. A
+// memory output that cannot grow is marked failed and starts over, so the
+// caller always gets room.
+static char *output_reserve(Output *out, size_t size) {
+    if (out->capacity - out->used < size) {
+        if (out->file) {
+            output_flush(out);
+        } else {
+            char *grown = realloc(out->data, out->capacity * 2);
+            if (grown) {
+                out->data = grown;
+                out->capacity *= 2;
+            } else {
+                out->failed = 1;
+                out->used = 0;
+            }
+        }
+    }
+    return out->data + out->used;
+}
+
+static void output_write(Output *out, const char *text, size_t length) {
+    while (length > 0) {
+        size_t chunk = length < out->capacity ? length : out->capacity;
+        memcpy(output_reserve(out, chunk), text, chunk);
+        out->used += chunk;
+        text += chunk;
+        length -= chunk;
+    }
+}
+
+// Length of line without a trailing carriage return, or 0 if it is blank
+static size_t line_length(const char *line, size_t length) {
+    if (length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+    
+    size_t blank = 0;
+    while (blank < length && (line[blank] == ' ' || line[blank] == '\t' ||
+                              line[blank] == '\v' || line[blank] == '\f')) {
+        blank++;
+    }
+    return blank == length ? 0 : length;
+}
+
+// Appends the answer to one line. The line is not NUL-terminated, but the
+// byte after it is a newline or NUL, as calc_evaluate_length() requires.
+static void batch_line(CalcContext *ctx, const char *line, size_t length, Output *out) {
+    length = line_length(line, length);
+    if (length == 0) {
+        output_write(out, "\n", 1);
+        return;
+    }
+    
+    // Every line stands alone, so that the answers do not depend on how
+    // lines are split among threads
+    CalcError error;
+    double result = calc_evaluate_length(ctx, line, length, &error);
+    calc_clear_variables(ctx);
+    
+    const char *defined = calc_defined_function(ctx);
+    if (defined) {
+        output_write(out, "Defined ", 8);
+        output_write(out, defined, strlen(defined));
+        output_write(out, "\n", 1);
+        calc_restore_functions(ctx);
+        return;
+    }
+    
+    if (error.code != CALC_OK) {
+        char message[320];
+        size_t size = calc_error_format(&error, line, message, sizeof(message));
+        if (size >= sizeof(message)) {
+            size = sizeof(message) - 1;
+        }
+        output_write(out, "Error: ", 7);
+        output_write(out, message, size);
+        output_write(out, "\n", 1);
+        return;
+    }
+    
+    char *text = output_reserve(out, CALC_FORMAT_SHORTEST_SIZE + 1);
+    size_t size = calc_format(result, CALC_FORMAT_SHORTEST, 0, text, CALC_FORMAT_SHORTEST_SIZE);
+    text[size] = '\n';
+    out->used += size + 1;
+}
+
+// Evaluates the lines in text[0, size); only the last may lack a newline
+static void batch_lines(CalcContext *ctx, const char *text, size_t size, Output *out) {
+    const char *end = text + size;
+    
+    while (text < end) {
+        const char *newline = memchr(text, '\n', (size_t)(end - text));
+        if (!newline) {
+            newline = end;
+        }
+        batch_line(ctx, text, (size_t)(newline - text), out);
+        text = newline + 1;
+    }
+}
+
+// Defines each function of a library in ctx. Failures are reported on
+// standard error against path, unless it is NULL. Returns 1 if every
+// line was a valid definition.
+static int define_lines(CalcContext *ctx, const char *definitions, const char *path) {
+    size_t number = 0;
+    
+    for (const char *line = definitions; *line != '\0';) {
+        const char *newline = strchr(line, '\n');
+        size_t length = line_length(line, newline ? (size_t)(newline - line) : strlen(line));
+        number++;
+        
+        size_t start = 0;
+        while (start < length && (line[start] == ' ' || line[start] == '\t')) {
+            start++;
+        }
+        if (length > 0 && line[start] != '#') {
+            CalcError error;
+            calc_evaluate_length(ctx, line, length, &error);
+            if (error.code != CALC_OK || !calc_defined_function(ctx)) {
+                if (path) {
+                    char message[320];
+                    if (error.code != CALC_OK) {
+                        calc_error_format(&error, line, message, sizeof(message));
+                    } else {
+                        snprintf(message, sizeof(message), "Not a function definition");
+                    }
+                    fprintf(stderr, "%s:%zu: %s\n", path, number, message);
+                }
+                return 0;
+            }
+        }
+        
+        if (!newline) {
+            break;
+        }
+        line = newline + 1;
+    }
+    return 1;
+}
+
+char *batch_read_functions(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return NULL;
+    }
+    
+    char *text = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    int failed = 0;
+    for (;;) {
+        if (capacity - size < 2) {
+            capacity = capacity ? capacity * 2 : 4096;
+            char *grown = realloc(text, capacity);
+            if (!grown) {
+                fprintf(stderr, "Out of memory\n");
+                failed = 1;
+                break;
+            }
+            text = grown;
+        }
+        size_t count = fread(text + size, 1, capacity - size - 1, file);
+        size += count;
+        if (count == 0) {
+            if (ferror(file)) {
+                fprintf(stderr, "Error reading %s\n", path);
+                failed = 1;
+            }
+            break;
+        }
+    }
+    fclose(file);
+    if (failed) {
+        free(text);
+        return NULL;
+    }
+    text[size] = '\0';
+    
+    // Checked once here, so that loading the library later cannot fail on
+    // anything but memory
+    CalcContext *ctx = calc_context_new();
+    if (!ctx) {
+        fprintf(stderr, "Out of memory\n");
+        free(text);
+        return NULL;
+    }
+    int valid = define_lines(ctx, text, path);
+    calc_context_free(ctx);
+    if (!valid) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+int batch_define_functions(CalcContext *ctx, const char *definitions) {
+    return define_lines(ctx, definitions, NULL);
+}
+
+// Gives a batch context the library, which every line starts from
+static int batch_context_setup(CalcContext *ctx, const char *definitions) {
+    return (!definitions || batch_define_functions(ctx, definitions)) && calc_save_functions(ctx);
+}
+
+// Input is taken in chunks of whole lines. A regular file is mapped and
+// its chunks point straight into the mapping, so lines are never copied;
+// the kernel is told to read ahead and each chunk is prefetched as it is
+// handed out. Pipes and terminals are read into each chunk's own buffer.
+
+typedef struct {
+    const char *lines;      // Whole lines, in the mapping or in input
+    size_t size;
+    char *input;            // Storage for lines that had to be copied
+    size_t input_capacity;
+    Output out;             // Answers, in parallel mode
+    int done;
+} Chunk;
+
+typedef struct {
+    FILE *in;
+    const char *path;
+    const char *map;        // The whole file, if it could be mapped
+    size_t map_size;
+    size_t map_lines;       // Length of the part that ends in a newline
+    size_t offset;          // Start of the next chunk in the mapping
+    size_t page;
+    char *carry;            // Partial line read past the previous chunk
+    size_t carry_size;
+    size_t carry_capacity;
+    int at_end;
+    int failed;
+} Source;
+
+static void source_open(Source *source, FILE *in, const char *path) {
+    struct stat info;
+    
+    memset(source, 0, sizeof(*source));
+    source->in = in;
+    source->path = path;
+    
+    // Only a regular file that has not been read from yet can be mapped;
+    // anything else falls back to reading
+    int fd = fileno(in);
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0 ||
+        (uintmax_t)info.st_size > SIZE_MAX || lseek(fd, 0, SEEK_CUR) != 0) {
+        return;
+    }
+    
+    size_t size = (size_t)info.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    
+    source->map = map;
+    source->map_size = size;
+    source->map_lines = size;
+    while (source->map_lines > 0 && source->map[source->map_lines - 1] != '\n') {
+        source->map_lines--;
+    }
+    source->page = (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void source_close(Source *source) {
+    if (source->map) {
+        munmap((void *)source->map, source->map_size);
+    }
+    free(source->carry);
+}
+
+// Makes room for size bytes of input plus a terminator
+static int chunk_reserve(Chunk *chunk, size_t size, Source *source) {
+    if (chunk->input_capacity < size) {
+        char *grown = realloc(chunk->input, size + 1);
+        if (!grown) {
+            fprintf(stderr, "Out of memory\n");
+            source->failed = 1;
+            return 0;
+        }
+        chunk->input = grown;
+        chunk->input_capacity = size;
+    }
+    return 1;
+}
+
+// Points the chunk at the next BATCH_CHUNK or so bytes of the mapping,
+// extended to the end of a line. A last line without a newline is copied
+// out instead, since the byte after it may lie beyond the mapping.
+static int chunk_map(Chunk *chunk, Source *source) {
+    size_t start = source->offset;
+    
+    if (start >= source->map_lines) {
+        size_t rest = source->map_size - start;
+        source->offset = source->map_size;
+        source->at_end = 1;
+        if (rest == 0 || !chunk_reserve(chunk, rest, source)) {
+            return 0;
+        }
+        memcpy(chunk->input, source->map + start, rest);
+        chunk->input[rest] = '\0';
+        chunk->lines = chunk->input;
+        chunk->size = rest;
+        return 1;
+    }
+    
+    size_t end = source->map_lines;
+    if (end - start > BATCH_CHUNK) {
+        const char *from = source->map + start + BATCH_CHUNK - 1;
+        end = (size_t)((const char *)memchr(from, '\n', end - (start + BATCH_CHUNK - 1)) - source->map) + 1;
+    }
+    
+    // Have the pages read in while earlier chunks are evaluated
+    size_t aligned = start - start % source->page;
+    madvise((void *)(source->map + aligned), end - aligned, MADV_WILLNEED);
+    
+    chunk->lines = source->map + start;
+    chunk->size = end - start;
+    source->offset = end;
+    return 1;
+}
+
+// Fills the chunk with the next whole lines of the source. When reading,
+// that is the partial line left over from the previous chunk, then fresh
+// input up to its last newline, growing the chunk when a single line does
+// not fit. Returns 0 once the input is exhausted or on failure.
+static int chunk_fill(Chunk *chunk, Source *source) {
+    if (source->map) {
+        return chunk_map(chunk, source);
+    }
+    
+    if (!chunk_reserve(chunk, source->carry_size + BATCH_CHUNK, source)) {
+        return 0;
+    }
+    if (source->carry_size > 0) {
+        memcpy(chunk->input, source->carry, source->carry_size);
+    }
+    size_t size = source->carry_size;
+    size_t scanned = 0;
+    source->carry_size = 0;
+    
+    for (;;) {
+        if (!source->at_end) {
+            size_t count = fread(chunk->input + size, 1, chunk->input_capacity - size, source->in);
+            if (count == 0) {
+                if (ferror(source->in)) {
+                    fprintf(stderr, "Error reading %s\n", source->path);
+                    source->failed = 1;
+                }
+                source->at_end = 1;
+            }
+            size += count;
+        }
+        
+        size_t last = size;
+        while (last > scanned && chunk->input[last - 1] != '\n') {
+            last--;
+        }
+        
+        if (last > scanned || source->at_end) {
+            if (last == scanned) {
+                last = size;
+            }
+            size_t rest = size - last;
+            if (source->carry_capacity < rest) {
+                char *grown = realloc(source->carry, rest);
+                if (!grown) {
+                    fprintf(stderr, "Out of memory\n");
+                    source->failed = 1;
+                    return 0;
+                }
+                source->carry = grown;
+                source->carry_capacity = rest;
+            }
+            if (rest > 0) {
+                memcpy(source->carry, chunk->input + last, rest);
+            }
+            source->carry_size = rest;
+            chunk->input[last] = '\0';
+            chunk->lines = chunk->input;
+            chunk->size = last;
+            return last > 0;
+        }
+        
+        // No newline in the whole chunk: one line longer than it
+        scanned = size;
+        if (!chunk_reserve(chunk, chunk->input_capacity * 2, source)) {
+            return 0;
+        }
+    }
+}
+
+// Adds the counters of ctx's result cache to total
+static void cache_stats_add(CalcCacheStats *total, const CalcContext *ctx) {
+    CalcCacheStats stats;
+    calc_result_cache_stats(ctx, &stats);
+    total->hits += stats.hits;
+    total->misses += stats.misses;
+    total->evictions += stats.evictions;
+    total->entries += stats.entries;
+    total->bytes += stats.bytes;
+    total->max_bytes += stats.max_bytes;
+}
+
+static int batch_serial(Source *source, size_t cache_bytes, CalcStore *store, const char *definitions,
+                        CalcCacheStats *cache) {
+    CalcContext *ctx = calc_context_new();
+    Chunk chunk;
+    Output out = {malloc(BATCH_BUFFER), 0, BATCH_BUFFER, stdout, 0};
+    int failed = 0;
+    
+    memset(&chunk, 0, sizeof(chunk));
+    
+    if (!ctx || !out.data || !batch_context_setup(ctx, definitions)) {
+        fprintf(stderr, "Out of memory\n");
+        calc_context_free(ctx);
+        free(out.data);
+        return 1;
+    }
+    
+    calc_set_result_cache(ctx, cache_bytes);
+    calc_set_store(ctx, store);
+    while (!source->at_end && chunk_fill(&chunk, source)) {
+        batch_lines(ctx, chunk.lines, chunk.size, &out);
+    }
+    
+    output_flush(&out);
+    if (fflush(out.file) != 0 || out.failed) {
+        fprintf(stderr, "Error writing output\n");
+        failed = 1;
+    }
+    
+    cache_stats_add(cache, ctx);
+    calc_context_free(ctx);
+    free(chunk.input);
+    free(out.data);
+    return failed || source->failed;
+}
+
+// Parallel mode. The main thread cuts the input into numbered chunks and
+// deals them round-robin onto the workers' queues. Each worker evaluates
+// with its own CalcContext into the chunk's own output, taking the oldest
+// chunk from its queue and, when that is empty, stealing the newest from
+// another worker's. The main thread writes finished chunks in sequence
+// order, and chunk n reuses the slot of chunk n - window, so a chunk's
+// buffers are recycled rather than freed.
+
+typedef struct Pool Pool;
+
+typedef struct {
+    Pool *pool;
+    CalcContext *ctx;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    Chunk **queue;
+    size_t head, tail;
+    unsigned random;
+} Worker;
+
+struct Pool {
+    Worker *workers;
+    int count;
+    size_t window;
+    atomic_size_t queued;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t chunk_done;
+};
+
+static void worker_push(Worker *worker, Chunk *chunk) {
+    Pool *pool = worker->pool;
+    
+    pthread_mutex_lock(&worker->lock);
+    worker->queue[worker->tail++ % pool->window] = chunk;
+    pthread_mutex_unlock(&worker->lock);
+    
+    // Counted after the push, so a worker that sees queued > 0 finds it
+    atomic_fetch_add(&pool->queued, 1);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static Chunk *worker_take(Worker *self) {
+    Pool *pool = self->pool;
+    Chunk *chunk = NULL;
+    
+    pthread_mutex_lock(&self->lock);
+    if (self->head < self->tail) {
+        chunk = self->queue[self->head++ % pool->window];
+    }
+    pthread_mutex_unlock(&self->lock);
+    
+    // Steal, starting from a random victim so thieves spread out
+    self->random ^= self->random << 13;
+    self->random ^= self->random >> 17;
+    self->random ^= self->random << 5;
+    for (int i = 0; !chunk && i < pool->count; i++) {
+        Worker *victim = &pool->workers[(self->random + (unsigned)i) % (unsigned)pool->count];
+        if (victim == self) {
+            continue;
+        }
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            chunk = victim->queue[--victim->tail % pool->window];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    
+    if (chunk) {
+        atomic_fetch_sub(&pool->queued, 1);
+    }
+    return chunk;
+}
+
+static void chunk_evaluate(CalcContext *ctx, Chunk *chunk) {
+    chunk->out.used = 0;
+    batch_lines(ctx, chunk->lines, chunk->size, &chunk->out);
+}
+
+static void *worker_main(void *arg) {
+    Worker *self = arg;
+    Pool *pool = self->pool;
+    
+    for (;;) {
+        Chunk *chunk = worker_take(self);
+        
+        if (!chunk) {
+            pthread_mutex_lock(&pool->lock);
+            while (atomic_load(&pool->queued) == 0 && !pool->stopping) {
+                pthread_cond_wait(&pool->work_ready, &pool->lock);
+            }
+            int finished = atomic_load(&pool->queued) == 0;
+            pthread_mutex_unlock(&pool->lock);
+            if (finished) {
+                break;
+            }
+            continue;
+        }
+        
+        chunk_evaluate(self->ctx, chunk);
+        
+        pthread_mutex_lock(&pool->lock);
+        chunk->done = 1;
+        pthread_cond_signal(&pool->chunk_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static int batch_parallel(Source *source, int threads, size_t cache_bytes, CalcStore *store,
+                          const char *definitions, CalcCacheStats *cache) {
+    Pool pool = {0};
+    size_t window = (size_t)threads * BATCH_CHUNKS_PER_WORKER;
+    Chunk *chunks = calloc(window, sizeof(Chunk));
+    int started = 0;
+    int failed = 0;
+    
+    pool.workers = calloc((size_t)threads, sizeof(Worker));
+    pool.window = window;
+    atomic_init(&pool.queued, 0);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_ready, NULL);
+    pthread_cond_init(&pool.chunk_done, NULL);
+    
+    if (!chunks || !pool.workers) {
+        fprintf(stderr, "Out of memory\n");
+        failed = 1;
+        goto cleanup;
+    }
+    
+    // Every worker is set up before any thread starts, since thieves scan
+    // all of them
+    for (int i = 0; i < threads; i++) {
+        Worker *worker = &pool.workers[i];
+        worker->pool = &pool;
+        worker->ctx = calc_context_new();
+        worker->queue = malloc(window * sizeof(Chunk *));
+        worker->random = 2463534242u + (unsigned)i * 2654435761u;
+        pthread_mutex_init(&worker->lock, NULL);
+        pool.count++;
+        if (!worker->ctx || !worker->queue || !batch_context_setup(worker->ctx, definitions)) {
+            fprintf(stderr, "Out of memory\n");
+            failed = 1;
+            goto cleanup;
+        }
+        calc_set_result_cache(worker->ctx, cache_bytes);
+        calc_set_store(worker->ctx, store);
+    }
+    
+    // Chunks are dealt only to workers whose thread started; any others
+    // keep empty queues
+    while (started < threads
+           && pthread_create(&pool.workers[started].thread, NULL, worker_main, &pool.workers[started]) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Cannot start worker threads\n");
+        failed = 1;
+        goto cleanup;
+    }
+    
+    // Chunks [written, dealt) are in flight; chunk n lives in slot n % window
+    size_t dealt = 0, written = 0;
+    
+    for (;;) {
+        // Write out finished chunks in order, waiting on the oldest only
+        // when the window is full or there is no more input to deal
+        pthread_mutex_lock(&pool.lock);
+        while (written < dealt) {
+            Chunk *oldest = &chunks[written % window];
+            if (oldest->done) {
+                pthread_mutex_unlock(&pool.lock);
+                if (oldest->out.failed) {
+                    fprintf(stderr, "Out of memory\n");
+                    failed = 1;
+                } else if (fwrite(oldest->out.data, 1, oldest->out.used, stdout) != oldest->out.used) {
+                    fprintf(stderr, "Error writing output\n");
+                    failed = 1;
+                }
+                oldest->done = 0;
+                written++;
+                pthread_mutex_lock(&pool.lock);
+                if (failed) {
+                    break;
+                }
+            } else if (dealt - written == window || source->at_end || source->failed) {
+                pthread_cond_wait(&pool.chunk_done, &pool.lock);
+            } else {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&pool.lock);
+        
+        if (failed || source->failed || source->at_end) {
+            break;
+        }
+        
+        Chunk *chunk = &chunks[dealt % window];
+        if (!chunk->out.data) {
+            chunk->out.data = malloc(BATCH_CHUNK);
+            chunk->out.capacity = BATCH_CHUNK;
+            if (!chunk->out.data) {
+                fprintf(stderr, "Out of memory\n");
+                failed = 1;
+                break;
+            }
+        }
+        if (chunk_fill(chunk, source)) {
+            worker_push(&pool.workers[dealt % (size_t)started], chunk);
+            dealt++;
+        }
+    }
+    
+    if (fflush(stdout) != 0 && !failed) {
+        fprintf(stderr, "Error writing output\n");
+        failed = 1;
+    }
+    if (source->failed) {
+        failed = 1;
+    }
+
+cleanup:
+    // Workers drain whatever is still queued, then exit
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+    
+    for (int i = 0; i < started; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool.count; i++) {
+        if (pool.workers[i].ctx) {
+            cache_stats_add(cache, pool.workers[i].ctx);
+        }
+        calc_context_free(pool.workers[i].ctx);
+        free(pool.workers[i].queue);
+        pthread_mutex_destroy(&pool.workers[i].lock);
+    }
+    for (size_t i = 0; chunks && i < window; i++) {
+        free(chunks[i].input);
+        free(chunks[i].out.data);
+    }
+    pthread_cond_destroy(&pool.chunk_done);
+    pthread_cond_destroy(&pool.work_ready);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.workers);
+    free(chunks);
+    return failed;
+}
+
+int batch_run(const char *path, const BatchOptions *options) {
+    int threads = options->threads;
+    
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 1;
+    }
+    
+    if (threads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (int)(online < BATCH_MAX_THREADS ? online : BATCH_MAX_THREADS) : 1;
+    } else if (threads > BATCH_MAX_THREADS) {
+        threads = BATCH_MAX_THREADS;
+    }
+    
+    // Each thread gets its own share of the cache, so none of them lock
+    size_t cache_bytes = options->cache_bytes / (size_t)threads;
+    CalcCacheStats cache;
+    memset(&cache, 0, sizeof(cache));
+    
+    // The library is read once and defined in every thread's context
+    char *definitions = NULL;
+    if (options->functions_path) {
+        definitions = batch_read_functions(options->functions_path);
+        if (!definitions) {
+            if (in != stdin) {
+                fclose(in);
+            }
+            return 1;
+        }
+    }
+    
+    // One store serves every thread; lookups in it take no locks
+    CalcStore *store = NULL;
+    if (options->store_path) {
+        store = calc_store_open(options->store_path, BATCH_STORE_BYTES);
+        if (!store) {
+            fprintf(stderr, "Cannot open store %s\n", options->store_path);
+            free(definitions);
+            if (in != stdin) {
+                fclose(in);
+            }
+            return 1;
+        }
+    }
+    
+    Source source;
+    source_open(&source, in, path);
+    int failed = threads == 1 ? batch_serial(&source, cache_bytes, store, definitions, &cache)
+                              : batch_parallel(&source, threads, cache_bytes, store, definitions, &cache);
+    source_close(&source);
+    free(definitions);
+    
+    if (options->cache_bytes > 0) {
+        fprintf(stderr, "Result cache: %llu hits, %llu misses, %llu evictions, %zu entries in %zu of %zu bytes\n",
+                cache.hits, cache.misses, cache.evictions, cache.entries, cache.bytes, cache.max_bytes);
+    }
+    if (store) {
+        CalcCacheStats stats;
+        calc_store_stats(store, &stats);
+        fprintf(stderr, "Store: %llu hits, %llu misses, %zu entries in %zu of %zu bytes\n",
+                stats.hits, stats.misses, stats.entries, stats.bytes, stats.max_bytes);
+        calc_store_close(store);
+    }
+    
+    if (in != stdin) {
+        fclose(in);
+    }
+    return failed;
+}
@@ -0,0 +1,36 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+
+#include "calc.h"
+
+typedef struct {
+    int threads;            // 0 for one per online CPU, 1 to stay on the calling thread
+    size_t cache_bytes;     // Result cache split among the threads, 0 for none;
+                            // its counters are reported on standard error
+    const char *store_path; // Compiled-expression store shared with other
+                            // runs, or NULL for none
+    const char *functions_path; // Definitions every line may call, or NULL
+} BatchOptions;
+
+// Non-interactive evaluation for the CLI: reads newline-delimited
+// expressions from path ("-" for standard input) and writes one line per
+// expression to standard output, either the result or "Error: message".
+// Blank input lines produce blank output lines, so line N of the output
+// always answers line N of the input, whatever the options. Returns 0 on
+// success and 1 if the input could not be read or the output could not be
+// written.
+int batch_run(const char *path, const BatchOptions *options);
+
+// Reads a library of function definitions such as "f(x, y) = x^2 + sin(y)",
+// one per line, for batch_define_functions(). Blank lines and lines that
+// start with # are skipped. Returns NULL, after saying why on standard
+// error, if the file cannot be read or a line is not a valid definition.
+char *batch_read_functions(const char *path);
+
+// Defines the functions of a library read by batch_read_functions() in
+// ctx. Returns 0 when out of memory.
+int batch_define_functions(CalcContext *ctx, const char *definitions);
+
+#endif
@@ -0,0 +1,5335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "calc.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Every evaluation path must round a*b+c the same way, so the compiler
+// is not allowed to contract it into an FMA behind our back.
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define CALC_JIT 1
+#else
+#define CALC_JIT 0
+#endif
+
+typedef enum {
+    TOKEN_NUMBER,
+    TOKEN_PLUS,
+    TOKEN_MINUS,
+    TOKEN_MULTIPLY,
+    TOKEN_DIVIDE,
+    TOKEN_MODULO,
+    TOKEN_POWER,
+    TOKEN_LPAREN,
+    TOKEN_RPAREN,
+    TOKEN_COMMA,
+    TOKEN_ASSIGN,
+    TOKEN_FUNCTION,
+    TOKEN_PI,
+    TOKEN_E,
+    TOKEN_IDENTIFIER,
+    TOKEN_EOF,
+    TOKEN_ERROR
+} TokenType;
+
+// Tokens refer back into the input instead of carrying their own text,
+// so copying one is cheap. The text is only spelled out for errors.
+typedef struct {
+    TokenType type;
+    int length;
+    size_t start;       // Offset of the first character in the source
+    double value;       // Number or constant, or FunctionId for TOKEN_FUNCTION
+} Token;
+
+// Built-in functions are described once, in functions[], and everything
+// else works from the index: the lexer maps a name to it, nodes and
+// instructions carry it, and constant folding, the interpreter, the JIT
+// and the batch kernels call through it. Adding a function takes an id,
+// a registry entry and a keyword slot. Ids are stored in compiled code
+// on disk, so new ones go at the end.
+typedef enum {
+    FUNCTION_SIN,
+    FUNCTION_COS,
+    FUNCTION_TAN,
+    FUNCTION_SQRT,
+    FUNCTION_LOG,
+    FUNCTION_EXP,
+    FUNCTION_ABS,
+    FUNCTION_ATAN2,
+    FUNCTION_HYPOT,
+    FUNCTION_MIN,
+    FUNCTION_MAX,
+    FUNCTION_CLAMP,
+    FUNCTION_FMA,
+    FUNCTION_POW,
+    FUNCTION_LOGB,
+    FUNCTION_COUNT
+} FunctionId;
+
+// Arguments a function is defined for; it applies to every argument.
+// Any other argument is a math error, except NaN, which goes through.
+typedef enum {
+    DOMAIN_ALL,
+    DOMAIN_NON_NEGATIVE,
+    DOMAIN_POSITIVE
+} FunctionDomain;
+
+typedef union {
+    double (*unary)(double);
+    double (*binary)(double, double);
+    double (*ternary)(double, double, double);
+} FunctionScalar;
+
+typedef struct {
+    const char *name;
+    int arity;                          // Arguments taken, 1 to 3
+    FunctionScalar scalar;              // The member for arity
+    // Applies the function to blocks of BATCH_BLOCK values, one per
+    // argument, or returns 0 without writing to leave them to scalar
+    int (*vector)(double *result, const double *const x[]);
+    FunctionDomain domain;
+    CalcErrorCode error;                // Reported outside the domain
+    int node;                           // NODE_CALL, or an operator node
+    int op;                             // OP_CALL for arity, or inlined
+} Function;
+
+// Defined with the batch kernels, which it points to
+static const Function functions[FUNCTION_COUNT];
+
+static int function_accepts(const Function *function, double x) {
+    switch (function->domain) {
+        case DOMAIN_NON_NEGATIVE: return !(x < 0);
+        case DOMAIN_POSITIVE: return !(x <= 0);
+        default: return 1;
+    }
+}
+
+static double function_apply(const Function *function, const double *args) {
+    switch (function->arity) {
+        case 1: return function->scalar.unary(args[0]);
+        case 2: return function->scalar.binary(args[0], args[1]);
+        default: return function->scalar.ternary(args[0], args[1], args[2]);
+    }
+}
+
+// The lexer scans a window onto the source. A string is a single window
+// that is scanned in place, up to its NUL or, when its length was given,
+// up to fill. A stream is pulled in through reader: the
+// window slides forward as tokens are consumed and only grows when one
+// token does not fit, so memory is bounded by the longest token rather
+// than by the length of the source.
+typedef struct {
+    const char *input;      // The window, which ends at fill
+    size_t position;        // Next character, relative to the window
+    size_t base;            // Source offset of the window's first byte
+    Token current;
+    CalcReader reader;      // NULL when input holds the whole source
+    void *state;
+    char *buffer;           // Window storage for streams
+    size_t fill;            // SIZE_MAX for a NUL-terminated string
+    size_t capacity;
+    int at_end;             // The reader has nothing more to give
+    CalcErrorCode failure;  // Why reading stopped early, if it did
+    const Token *replay;    // Tokens already scanned, ending in TOKEN_EOF
+} Lexer;
+
+#define LEXER_WINDOW 65536
+#define LEXER_LOOKAHEAD 16  // Covers every peek past the end of a token
+
+static void lexer_init(Lexer *lexer, const char *input) {
+    memset(lexer, 0, sizeof(*lexer));
+    lexer->input = input;
+    lexer->fill = SIZE_MAX;
+    lexer->current.type = TOKEN_EOF;
+}
+
+// Scanning peeks one byte past a token that ends at fill, which the
+// caller guarantees is readable and ends any token (see calc.h)
+static void lexer_init_length(Lexer *lexer, const char *input, size_t length) {
+    memset(lexer, 0, sizeof(*lexer));
+    lexer->input = input;
+    lexer->fill = length;
+    lexer->current.type = TOKEN_EOF;
+}
+
+static void lexer_init_stream(Lexer *lexer, CalcReader reader, void *state) {
+    memset(lexer, 0, sizeof(*lexer));
+    lexer->input = "";
+    lexer->reader = reader;
+    lexer->state = state;
+    lexer->current.type = TOKEN_EOF;
+}
+
+// Drops the window up to position and reads until at least twice what
+// was kept (plus lookahead) is available, doubling the window if that
+// does not fit. A token cut off by the window edge is rescanned after
+// this, and the doubling keeps rescans linear overall.
+static void lexer_refill(Lexer *lexer) {
+    size_t keep = lexer->fill - lexer->position;
+    size_t wanted = keep * 2 + LEXER_LOOKAHEAD;
+    
+    if (lexer->buffer) {
+        memmove(lexer->buffer, lexer->buffer + lexer->position, keep);
+    }
+    lexer->base += lexer->position;
+    lexer->position = 0;
+    lexer->fill = keep;
+    
+    if (wanted >= lexer->capacity) {
+        size_t capacity = lexer->capacity ? lexer->capacity : LEXER_WINDOW;
+        while (wanted >= capacity) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(lexer->buffer, capacity);
+        if (!buffer) {
+            lexer->failure = CALC_ERROR_OUT_OF_MEMORY;
+            lexer->at_end = 1;
+            return;
+        }
+        lexer->buffer = buffer;
+        lexer->capacity = capacity;
+    }
+    
+    while (lexer->fill < wanted) {
+        long count = lexer->reader(lexer->state, lexer->buffer + lexer->fill,
+                                   lexer->capacity - 1 - lexer->fill);
+        if (count <= 0) {
+            if (count < 0) {
+                lexer->failure = CALC_ERROR_READ_FAILED;
+            }
+            lexer->at_end = 1;
+            break;
+        }
+        lexer->fill += (size_t)count;
+    }
+    
+    lexer->buffer[lexer->fill] = '\0';
+    lexer->input = lexer->buffer;
+}
+
+// A stream window needs refilling when fewer than LEXER_LOOKAHEAD bytes
+// remain past position
+static int lexer_needs_input(const Lexer *lexer) {
+    return lexer->reader && !lexer->at_end && lexer->fill - lexer->position < LEXER_LOOKAHEAD;
+}
+
+// Text of a token that is still current; it may move on the next advance
+static const char *lexer_text(const Lexer *lexer, const Token *token) {
+    return lexer->input + (token->start - lexer->base);
+}
+
+static void lexer_skip_whitespace(Lexer *lexer) {
+    while (lexer->position < lexer->fill && isspace(lexer->input[lexer->position])) {
+        lexer->position++;
+    }
+}
+
+// Number literals: decimal with an optional fraction and exponent
+// (1.5e-9), or hexadecimal with an optional binary exponent (0x1.8p3).
+// Underscores may separate digits (1_000_000). Parsing never looks at
+// the locale and never copies the input on the common path.
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int digit_value(char c, int hex) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (hex && c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (hex && c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Steps past the digit at *p and a separator that leads to another digit
+static const char *next_digit(const char *p, int hex) {
+    p++;
+    if (*p == '_' && digit_value(p[1], hex) >= 0) {
+        p++;
+    }
+    return p;
+}
+
+// Reads the exponent after e or p if one follows, saturating far beyond
+// the range of a double (and beyond what the digits of any literal that
+// fits in memory could offset). Returns the end of the literal.
+static const char *read_exponent(const char *p, char marker, int *exponent) {
+    *exponent = 0;
+    if ((*p | 0x20) != marker) {
+        return p;
+    }
+    
+    const char *q = p + 1;
+    int negative = *q == '-';
+    if (*q == '+' || *q == '-') {
+        q++;
+    }
+    if (digit_value(*q, 0) < 0) {
+        return p;   // Not an exponent: "3e" is 3 times e
+    }
+    
+    while (digit_value(*q, 0) >= 0) {
+        if (*exponent < 100000000) {
+            *exponent = *exponent * 10 + (*q - '0');
+        }
+        q = next_digit(q, 0);
+    }
+    if (negative) {
+        *exponent = -*exponent;
+    }
+    return q;
+}
+
+// Correctly rounded fallback for literals the fast path cannot handle
+// exactly: the digits are rewritten without separators or a radix point
+// (so the locale cannot matter) and handed to strtod().
+static double parse_number_slow(const char *start, const char *end, int hex, int exponent) {
+    char local[128];
+    size_t size = (size_t)(end - start) + 16;
+    char *text = size <= sizeof(local) ? local : malloc(size);
+    if (!text) {
+        return NAN;
+    }
+    
+    char *out = text;
+    int fraction_digits = 0;
+    int in_fraction = 0;
+    if (hex) {
+        *out++ = '0';
+        *out++ = 'x';
+        start += 2;
+    }
+    for (const char *p = start; p < end; p++) {
+        if (*p == '.') {
+            in_fraction = 1;
+        } else if (digit_value(*p, hex) >= 0) {
+            *out++ = *p;
+            fraction_digits += in_fraction;
+        } else if (*p != '_') {
+            break;  // Start of the exponent
+        }
+    }
+    
+    long scale = (long)exponent - (long)fraction_digits * (hex ? 4 : 1);
+    sprintf(out, "%c%ld", hex ? 'p' : 'e', scale);
+    
+    double value = strtod(text, NULL);
+    if (text != local) {
+        free(text);
+    }
+    return value;
+}
+
+// Parses the literal at s into *value and returns its end.
+static const char *parse_number(const char *s, double *value) {
+    int hex = s[0] == '0' && (s[1] | 0x20) == 'x' &&
+              (digit_value(s[2], 1) >= 0 || (s[2] == '.' && digit_value(s[3], 1) >= 0));
+    int base = hex ? 16 : 10;
+    const char *p = hex ? s + 2 : s;
+    
+    // Up to 64 bits of leading significant digits go into mantissa; the
+    // rest only matter to the slow path. scale counts the digits the
+    // radix point sits to the left of, net of dropped integer digits.
+    unsigned long long mantissa = 0;
+    int scale = 0;
+    int inexact = 0;
+    int limit = hex ? 16 : 19;
+    int kept = 0;
+    
+    for (int fraction = 0; fraction < 2; fraction++) {
+        if (fraction) {
+            if (*p != '.') {
+                break;
+            }
+            p++;
+        }
+        int digit;
+        while ((digit = digit_value(*p, hex)) >= 0) {
+            if (mantissa == 0 && digit == 0) {
+                scale -= fraction;
+            } else if (kept < limit) {
+                mantissa = mantissa * base + digit;
+                kept++;
+                scale -= fraction;
+            } else {
+                scale += !fraction;
+                inexact |= digit != 0;
+            }
+            p = next_digit(p, hex);
+        }
+    }
+    
+    int exponent;
+    const char *end = read_exponent(p, hex ? 'p' : 'e', &exponent);
+    
+    if (mantissa == 0) {
+        *value = 0;
+    } else if (hex && !inexact && mantissa < (1ULL << 53)) {
+        // Exact mantissa: ldexp() rounds at most once, even into subnormals
+        *value = ldexp((double)mantissa, exponent + scale * 4);
+    } else if (!hex && !inexact && mantissa < (1ULL << 53) &&
+               exponent + scale >= -22 && exponent + scale <= 22) {
+        // Both operands are exact doubles, so one IEEE operation rounds
+        // correctly (Clinger's fast path)
+        int power = exponent + scale;
+        *value = power < 0 ? (double)mantissa / powers_of_ten[-power]
+                           : (double)mantissa * powers_of_ten[power];
+    } else {
+        *value = parse_number_slow(s, end, hex, exponent);
+    }
+    return end;
+}
+
+static Token lexer_read_number(Lexer *lexer) {
+    Token token;
+    token.type = TOKEN_NUMBER;
+    token.start = lexer->position;
+    
+    const char *start = lexer->input + lexer->position;
+    token.length = (int)(parse_number(start, &token.value) - start);
+    lexer->position += token.length;
+    
+    return token;
+}
+
+// Built-in names are found with a perfect hash on the first and last
+// characters: each keyword lands in its own slot, so one comparison
+// decides. When adding a keyword, search for new multipliers that keep
+// all slots distinct and move the entries accordingly.
+#define KEYWORD_SLOTS 32
+#define KEYWORD_HASH(text, length) \
+    ((2 * (unsigned char)(text)[0] + 5 * (unsigned char)(text)[(length) - 1]) & (KEYWORD_SLOTS - 1))
+
+static const struct {
+    const char *name;
+    int length;
+    TokenType type;
+    double value;
+} lexer_keywords[KEYWORD_SLOTS] = {
+    [0] = {"min", 3, TOKEN_FUNCTION, FUNCTION_MIN},
+    [1] = {"abs", 3, TOKEN_FUNCTION, FUNCTION_ABS},
+    [2] = {"logb", 4, TOKEN_FUNCTION, FUNCTION_LOGB},
+    [3] = {"e", 1, TOKEN_E, M_E},
+    [5] = {"cos", 3, TOKEN_FUNCTION, FUNCTION_COS},
+    [10] = {"sqrt", 4, TOKEN_FUNCTION, FUNCTION_SQRT},
+    [12] = {"sin", 3, TOKEN_FUNCTION, FUNCTION_SIN},
+    [13] = {"pi", 2, TOKEN_PI, M_PI},
+    [14] = {"tan", 3, TOKEN_FUNCTION, FUNCTION_TAN},
+    [17] = {"fma", 3, TOKEN_FUNCTION, FUNCTION_FMA},
+    [18] = {"max", 3, TOKEN_FUNCTION, FUNCTION_MAX},
+    [19] = {"pow", 3, TOKEN_FUNCTION, FUNCTION_POW},
+    [20] = {"hypot", 5, TOKEN_FUNCTION, FUNCTION_HYPOT},
+    [22] = {"clamp", 5, TOKEN_FUNCTION, FUNCTION_CLAMP},
+    [26] = {"exp", 3, TOKEN_FUNCTION, FUNCTION_EXP},
+    [27] = {"log", 3, TOKEN_FUNCTION, FUNCTION_LOG},
+    [28] = {"atan2", 5, TOKEN_FUNCTION, FUNCTION_ATAN2}
+};
+
+// Slot of the keyword spelled by text, or -1
+static int lexer_keyword(const char *text, int length) {
+    int slot = KEYWORD_HASH(text, length);
+    if (lexer_keywords[slot].length == length && memcmp(lexer_keywords[slot].name, text, length) == 0) {
+        return slot;
+    }
+    return -1;
+}
+
+static Token lexer_read_identifier(Lexer *lexer) {
+    Token token;
+    size_t start = lexer->position;
+    
+    while (lexer->input[lexer->position] && isalpha(lexer->input[lexer->position])) {
+        lexer->position++;
+    }
+    
+    token.type = TOKEN_IDENTIFIER;
+    token.start = start;
+    token.length = (int)(lexer->position - start);
+    token.value = 0;
+    
+    // Names are letters only, so x2 is x times 2, but a keyword may end
+    // in digits, like atan2
+    const char *text = lexer->input + start;
+    size_t end = lexer->position;
+    while (isdigit(lexer->input[end])) {
+        end++;
+    }
+    int slot = -1;
+    if (end > lexer->position) {
+        slot = lexer_keyword(text, (int)(end - start));
+    }
+    if (slot >= 0) {
+        lexer->position = end;
+        token.length = (int)(end - start);
+    } else {
+        slot = lexer_keyword(text, token.length);
+    }
+    
+    if (slot >= 0) {
+        token.type = lexer_keywords[slot].type;
+        token.value = lexer_keywords[slot].value;
+    }
+    
+    return token;
+}
+
+// Scans the token at position. Its start is relative to the window.
+static Token lexer_scan(Lexer *lexer) {
+    Token token;
+    token.value = 0;
+    token.start = lexer->position;
+    token.length = 0;
+    
+    char c = lexer->input[lexer->position];
+    
+    // A NUL is only the end of a string of unknown length; elsewhere it
+    // is just a stray character
+    if (lexer->position == lexer->fill || (!c && lexer->fill == SIZE_MAX)) {
+        token.type = TOKEN_EOF;
+        return token;
+    }
+    
+    if (isdigit(c) || (c == '.' && isdigit(lexer->input[lexer->position + 1]))) {
+        return lexer_read_number(lexer);
+    }
+    
+    if (isalpha(c)) {
+        return lexer_read_identifier(lexer);
+    }
+    
+    lexer->position++;
+    token.length = 1;
+    
+    switch (c) {
+        case '+': token.type = TOKEN_PLUS; break;
+        case '-': token.type = TOKEN_MINUS; break;
+        case '*': token.type = TOKEN_MULTIPLY; break;
+        case '/': token.type = TOKEN_DIVIDE; break;
+        case '%': token.type = TOKEN_MODULO; break;
+        case '^': token.type = TOKEN_POWER; break;
+        case '(': token.type = TOKEN_LPAREN; break;
+        case ')': token.type = TOKEN_RPAREN; break;
+        case ',': token.type = TOKEN_COMMA; break;
+        case '=': token.type = TOKEN_ASSIGN; break;
+        default: token.type = TOKEN_ERROR; break;
+    }
+    
+    return token;
+}
+
+static Token lexer_next_token(Lexer *lexer) {
+    for (;;) {
+        lexer_skip_whitespace(lexer);
+        if (lexer_needs_input(lexer)) {
+            lexer_refill(lexer);
+            continue;
+        }
+        
+        size_t start = lexer->position;
+        Token token = lexer_scan(lexer);
+        if (lexer_needs_input(lexer)) {
+            // The token may run past the window: read more and rescan
+            lexer->position = start;
+            lexer_refill(lexer);
+            continue;
+        }
+        
+        token.start += lexer->base;
+        return token;
+    }
+}
+
+static void lexer_advance(Lexer *lexer) {
+    if (lexer->replay) {
+        lexer->current = *lexer->replay;
+        lexer->replay += lexer->current.type != TOKEN_EOF;
+        return;
+    }
+    lexer->current = lexer_next_token(lexer);
+}
+
+typedef enum {
+    NODE_NUMBER,
+    NODE_VARIABLE,
+    NODE_NEGATE,
+    NODE_ADD,
+    NODE_SUBTRACT,
+    NODE_MULTIPLY,
+    NODE_DIVIDE,
+    NODE_MODULO,
+    NODE_POWER,
+    NODE_CALL,      // Function whose FunctionId is in value, of the operands
+    NODE_INVOKE,    // Block of a user function, indexed by value, of the operands
+    NODE_POWI       // Operand raised to the integer in value
+} NodeType;
+
+typedef struct {
+    NodeType type;
+    int left;       // Operand node index, or variable slot for NODE_VARIABLE
+    int right;
+    int third;      // Third operand of a three-argument call, or -1
+    double value;
+} Node;
+
+typedef enum {
+    OP_HALT,
+    OP_CONST,
+    OP_LOAD,
+    OP_NEG,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_POW,
+    OP_CALL,        // dst = functions[function](a)
+    OP_CALL2,       // dst = functions[function](a, b)
+    OP_CALL3,       // dst = functions[function](a, b, c)
+    OP_INVOKE,      // dst = callees[function](a, b, c), taking as many as it
+                    // has variables; only in code a CalcContext evaluates
+    OP_SQRT,
+    OP_ABS,
+    // Superinstructions: one operand is a constant or a fused product
+    OP_ADD_K,
+    OP_SUB_K,
+    OP_RSUB_K,
+    OP_MUL_K,
+    OP_DIV_K,
+    OP_RDIV_K,
+    OP_MOD_K,
+    OP_POW_K,
+    OP_MUL_ADD,
+    OP_MUL_SUB,
+    OP_NMUL_ADD,
+    OP_POWI         // dst = a^c for a small integer c
+} OpCode;
+
+// Register instruction: dst = a <op> b. Constant-operand forms read k
+// instead of b, the fused multiply forms and OP_CALL3 use c as a third
+// register, and calls name their FunctionId in function.
+typedef struct {
+    int op;
+    int dst;
+    int a;
+    int b;
+    union {
+        double k;
+        struct {
+            int c;
+            int function;
+        };
+    };
+} Instruction;
+
+// A compiled expression ready to be evaluated any number of times.
+struct CompiledExpr {
+    Instruction *code;
+    int code_count;
+    int register_count;
+    char **variables;
+    int variable_count;
+    void *jit_code;     // Native code from calc_jit(), or NULL
+    size_t jit_size;
+    int nodes_eliminated;   // Parse nodes removed by optimize_nodes()
+    size_t variable_offset; // Where the first variable appears in the source
+    atomic_int references;  // Owners left to call calc_free()
+    CompiledExpr **callees; // Blocks OP_INVOKE runs, one reference each
+    int callee_count;
+};
+
+// Open-addressing hash set of node indices. Nodes are interned through it
+// so that identical subtrees share one node, turning the parse tree into
+// a DAG.
+typedef struct {
+    int *slots;         // Node index, or -1 for an empty slot
+    int capacity;       // Zero or a power of two
+} NodeTable;
+
+static unsigned int node_hash(const Node *node) {
+    unsigned long long bits;
+    memcpy(&bits, &node->value, sizeof(bits));
+    bits ^= (unsigned long long)node->type << 58;
+    bits ^= (unsigned long long)(unsigned int)node->left << 29;
+    bits ^= (unsigned int)node->right;
+    bits ^= (unsigned long long)(unsigned int)node->third << 17;
+    return (unsigned int)((bits * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static int node_equal(const Node *a, const Node *b) {
+    return a->type == b->type && a->left == b->left && a->right == b->right && a->third == b->third &&
+           memcmp(&a->value, &b->value, sizeof(double)) == 0;
+}
+
+static int node_table_grow(NodeTable *table, const Node *nodes, int count) {
+    int capacity = table->capacity ? table->capacity * 2 : 64;
+    int *slots = malloc(capacity * sizeof(int));
+    if (!slots) {
+        return 0;
+    }
+    
+    memset(slots, -1, capacity * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        unsigned int slot = node_hash(&nodes[i]) & (capacity - 1);
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = i;
+    }
+    
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+    return 1;
+}
+
+// Returns the index of the node equal to *node, appending it to nodes
+// (which must have room for one more) if there is none yet. Returns -1
+// if the table cannot grow.
+static int node_table_intern(NodeTable *table, Node *nodes, int *count, const Node *node) {
+    if ((*count + 1) * 2 > table->capacity && !node_table_grow(table, nodes, *count)) {
+        return -1;
+    }
+    
+    unsigned int slot = node_hash(node) & (table->capacity - 1);
+    while (table->slots[slot] >= 0) {
+        if (node_equal(&nodes[table->slots[slot]], node)) {
+            return table->slots[slot];
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    
+    table->slots[slot] = *count;
+    nodes[*count] = *node;
+    return (*count)++;
+}
+
+// Interned user identifiers, mapping a name to its variable slot with one
+// hash probe instead of a scan over every variable seen so far.
+typedef struct {
+    int *slots;         // Variable slot, or -1 for an empty slot
+    int capacity;       // Zero or a power of two
+} SymbolTable;
+
+// FNV-1a
+static unsigned int symbol_hash(const char *name, int length) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static int symbol_table_grow(SymbolTable *table, char **names, int count) {
+    int capacity = table->capacity ? table->capacity * 2 : 16;
+    int *slots = malloc(capacity * sizeof(int));
+    if (!slots) {
+        return 0;
+    }
+    
+    memset(slots, -1, capacity * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        unsigned int slot = symbol_hash(names[i], strlen(names[i])) & (capacity - 1);
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = i;
+    }
+    
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+    return 1;
+}
+
+// Index of name in names, or -1 if the table does not hold it
+static int symbol_table_find(const SymbolTable *table, char *const *names, const char *name, int length) {
+    if (table->capacity == 0) {
+        return -1;
+    }
+    
+    unsigned int slot = symbol_hash(name, length) & (table->capacity - 1);
+    while (table->slots[slot] >= 0) {
+        const char *known = names[table->slots[slot]];
+        if (strncmp(known, name, length) == 0 && known[length] == '\0') {
+            return table->slots[slot];
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return -1;
+}
+
+// Variables of a context. Slot 0 is ans, the last result. Names resolve
+// to slots while parsing, so evaluation reads values[slot] directly and
+// a slot never moves once a name has it.
+typedef struct {
+    char **names;
+    double *values;
+    int count;
+    int capacity;
+    SymbolTable symbols;
+} VariableTable;
+
+static int variables_find(const VariableTable *table, const char *name, int length) {
+    return symbol_table_find(&table->symbols, table->names, name, length);
+}
+
+// Returns the slot of name, adding it with the value 0 if it is new, or
+// -1 when out of memory
+static int variables_define(VariableTable *table, const char *name, int length) {
+    int known = variables_find(table, name, length);
+    if (known >= 0) {
+        return known;
+    }
+    
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 8;
+        char **names = realloc(table->names, capacity * sizeof(char *));
+        if (!names) {
+            return -1;
+        }
+        table->names = names;
+        double *values = realloc(table->values, capacity * sizeof(double));
+        if (!values) {
+            return -1;
+        }
+        table->values = values;
+        table->capacity = capacity;
+    }
+    if ((table->count + 1) * 2 > table->symbols.capacity &&
+        !symbol_table_grow(&table->symbols, table->names, table->count)) {
+        return -1;
+    }
+    
+    char *copy = malloc(length + 1);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    
+    unsigned int slot = symbol_hash(name, length) & (table->symbols.capacity - 1);
+    while (table->symbols.slots[slot] >= 0) {
+        slot = (slot + 1) & (table->symbols.capacity - 1);
+    }
+    table->symbols.slots[slot] = table->count;
+    table->names[table->count] = copy;
+    table->values[table->count] = 0;
+    return table->count++;
+}
+
+// Drops every variable but ans, which goes back to 0
+static void variables_clear(VariableTable *table) {
+    if (table->count > 1) {
+        for (int i = 1; i < table->count; i++) {
+            free(table->names[i]);
+        }
+        table->count = 1;
+        memset(table->symbols.slots, -1, table->symbols.capacity * sizeof(int));
+        table->symbols.slots[symbol_hash("ans", 3) & (table->symbols.capacity - 1)] = 0;
+    }
+    table->values[0] = 0;
+}
+
+static void variables_release(VariableTable *table) {
+    for (int i = 0; i < table->count; i++) {
+        free(table->names[i]);
+    }
+    free(table->names);
+    free(table->values);
+    free(table->symbols.slots);
+}
+
+// User functions of a context, such as f(x, y) = x^2 + sin(y). Calls are
+// expanded as they are parsed, so evaluation never looks a name up. A
+// body of up to FUNCTION_INLINE_NODES nodes is copied into the caller
+// with the arguments in place of the parameters, which leaves nothing to
+// call and lets the optimizer fold and share across the boundary. A
+// larger one is compiled once into a block that callers invoke, so that
+// functions built on functions do not multiply their size. A body is
+// bound when it is defined and only sees functions defined before it.
+#define FUNCTION_INLINE_NODES 32
+
+typedef struct {
+    int arity;          // Parameters, 1 to 3
+    Node *body;         // Optimized nodes to inline, or NULL; NODE_VARIABLE
+    int body_count;     // reads the parameter in left
+    int block;          // Index in blocks, or -1
+} UserFunction;
+
+typedef struct {
+    char **names;
+    UserFunction *items;
+    int count;
+    int capacity;
+    SymbolTable symbols;
+    CompiledExpr **blocks;  // Kept until the table is cleared, since the
+    int block_count;        // bodies of later functions may invoke one
+    int block_capacity;     // whose name has been redefined since
+    UserFunction *saved;    // items[0, saved_count) at functions_save()
+    int saved_count;
+    int saved_blocks;
+    int *changed;           // Saved items redefined since, each listed once;
+    int changed_count;      // their saved bodies are kept for the restore
+} FunctionTable;
+
+static int functions_find(const FunctionTable *table, const char *name, int length) {
+    return symbol_table_find(&table->symbols, table->names, name, length);
+}
+
+// Returns the index of name, adding it with no body if it is new, or -1
+// when out of memory
+static int functions_define(FunctionTable *table, const char *name, int length) {
+    int index = functions_find(table, name, length);
+    if (index >= 0) {
+        return index;
+    }
+    
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 8;
+        char **names = realloc(table->names, capacity * sizeof(char *));
+        if (!names) {
+            return -1;
+        }
+        table->names = names;
+        UserFunction *items = realloc(table->items, capacity * sizeof(UserFunction));
+        if (!items) {
+            return -1;
+        }
+        table->items = items;
+        table->capacity = capacity;
+    }
+    if ((table->count + 1) * 2 > table->symbols.capacity &&
+        !symbol_table_grow(&table->symbols, table->names, table->count)) {
+        return -1;
+    }
+    
+    char *copy = malloc(length + 1);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    
+    unsigned int slot = symbol_hash(name, length) & (table->symbols.capacity - 1);
+    while (table->symbols.slots[slot] >= 0) {
+        slot = (slot + 1) & (table->symbols.capacity - 1);
+    }
+    table->symbols.slots[slot] = table->count;
+    table->names[table->count] = copy;
+    memset(&table->items[table->count], 0, sizeof(UserFunction));
+    table->items[table->count].block = -1;
+    return table->count++;
+}
+
+// Takes over the caller's reference to block. Returns its index, or -1
+// when out of memory.
+static int functions_add_block(FunctionTable *table, CompiledExpr *block) {
+    if (table->block_count == table->block_capacity) {
+        int capacity = table->block_capacity ? table->block_capacity * 2 : 8;
+        CompiledExpr **blocks = realloc(table->blocks, capacity * sizeof(CompiledExpr *));
+        if (!blocks) {
+            return -1;
+        }
+        table->blocks = blocks;
+        table->block_capacity = capacity;
+    }
+    table->blocks[table->block_count] = block;
+    return table->block_count++;
+}
+
+// Makes function the definition at index, keeping a saved body
+static void functions_replace(FunctionTable *table, int index, UserFunction function) {
+    UserFunction *item = &table->items[index];
+    if (index < table->saved_count && item->body == table->saved[index].body &&
+        item->block == table->saved[index].block) {
+        table->changed[table->changed_count++] = index;
+    } else {
+        free(item->body);
+    }
+    *item = function;
+}
+
+static void functions_forget_saved(FunctionTable *table) {
+    for (int i = 0; i < table->changed_count; i++) {
+        free(table->saved[table->changed[i]].body);
+    }
+    free(table->saved);
+    free(table->changed);
+    table->saved = NULL;
+    table->changed = NULL;
+    table->saved_count = 0;
+    table->saved_blocks = 0;
+    table->changed_count = 0;
+}
+
+// Marks the current definitions as the ones functions_restore() returns
+// to. Returns 0 when out of memory.
+static int functions_save(FunctionTable *table) {
+    functions_forget_saved(table);
+    if (table->count > 0) {
+        table->saved = malloc(table->count * sizeof(UserFunction));
+        table->changed = malloc(table->count * sizeof(int));
+        if (!table->saved || !table->changed) {
+            functions_forget_saved(table);
+            return 0;
+        }
+        memcpy(table->saved, table->items, table->count * sizeof(UserFunction));
+    }
+    table->saved_count = table->count;
+    table->saved_blocks = table->block_count;
+    return 1;
+}
+
+// Undoes every definition since functions_save(), in time proportional
+// to their number rather than to the size of the table
+static void functions_restore(FunctionTable *table) {
+    for (int i = 0; i < table->changed_count; i++) {
+        int index = table->changed[i];
+        free(table->items[index].body);
+        table->items[index] = table->saved[index];
+    }
+    table->changed_count = 0;
+    
+    // New names were appended, and removing them newest first leaves
+    // the probe sequences of the others as they were
+    while (table->count > table->saved_count) {
+        int index = --table->count;
+        const char *name = table->names[index];
+        unsigned int slot = symbol_hash(name, strlen(name)) & (table->symbols.capacity - 1);
+        while (table->symbols.slots[slot] != index) {
+            slot = (slot + 1) & (table->symbols.capacity - 1);
+        }
+        table->symbols.slots[slot] = -1;
+        free(table->names[index]);
+        free(table->items[index].body);
+    }
+    while (table->block_count > table->saved_blocks) {
+        calc_free(table->blocks[--table->block_count]);
+    }
+}
+
+static void functions_clear(FunctionTable *table) {
+    functions_forget_saved(table);
+    for (int i = 0; i < table->count; i++) {
+        free(table->names[i]);
+        free(table->items[i].body);
+    }
+    for (int i = 0; i < table->block_count; i++) {
+        calc_free(table->blocks[i]);
+    }
+    table->count = 0;
+    table->block_count = 0;
+    if (table->symbols.slots) {
+        memset(table->symbols.slots, -1, table->symbols.capacity * sizeof(int));
+    }
+}
+
+static void functions_release(FunctionTable *table) {
+    functions_clear(table);
+    free(table->names);
+    free(table->items);
+    free(table->blocks);
+    free(table->symbols.slots);
+}
+
+// A parser owns every buffer compilation needs while it runs. They are
+// kept from one source to the next, so a CalcContext that evaluates one
+// small expression after another allocates nothing once it is warm.
+typedef struct {
+    Lexer *lexer;
+    CompiledExpr *expr;
+    Node *nodes;        // Post-order: every operand precedes its users
+    int node_count;
+    int node_capacity;
+    NodeTable table;
+    SymbolTable symbols;
+    int *operands;      // Parse stacks, see parse_expression()
+    int operand_count;
+    int operand_capacity;
+    int *operators;
+    int operator_count;
+    int operator_capacity;
+    void *scratch;      // Work arrays of optimize_nodes() and generate_code()
+    size_t scratch_size;
+    CalcError error;
+    int has_error;
+    const VariableTable *scope; // Variables identifiers must name, or NULL
+                                // to give each new name a slot of its own
+    const FunctionTable *user_functions;    // Callable by name, or NULL
+    int scope_hides_functions;  // Names in scope are parameters, which
+                                // take precedence over functions
+    int reads_scope;            // Some identifier named one of them, or a
+                                // user function
+    Token unknown;              // The first that did not, if length > 0;
+                                // syntax errors are reported before it
+} Parser;
+
+// A CalcContext frees its parser's buffers instead of keeping them once
+// they hold more than this many nodes or operators, so that one huge
+// expression neither pins its memory nor slows every later reset
+#define PARSER_KEEP_NODES 4096
+
+static void parser_init(Parser *parser) {
+    memset(parser, 0, sizeof(*parser));
+}
+
+static void parser_release(Parser *parser) {
+    free(parser->nodes);
+    free(parser->table.slots);
+    free(parser->symbols.slots);
+    free(parser->operands);
+    free(parser->operators);
+    free(parser->scratch);
+    parser_init(parser);
+}
+
+// Begins parsing a new source, reusing the buffers of earlier ones
+static void parser_start(Parser *parser, Lexer *lexer, CompiledExpr *expr) {
+    parser->lexer = lexer;
+    parser->expr = expr;
+    parser->node_count = 0;
+    parser->operand_count = 0;
+    parser->operator_count = 0;
+    if (parser->table.slots) {
+        memset(parser->table.slots, -1, parser->table.capacity * sizeof(int));
+    }
+    if (parser->symbols.slots) {
+        memset(parser->symbols.slots, -1, parser->symbols.capacity * sizeof(int));
+    }
+    parser->has_error = 0;
+    parser->reads_scope = 0;
+    parser->unknown.length = 0;
+    parser->error.code = CALC_OK;
+    parser->error.offset = 0;
+    parser->error.length = 0;
+    lexer_advance(lexer);
+}
+
+// Returns at least size bytes that stay valid until the next call
+static void *parser_scratch(Parser *parser, size_t size) {
+    if (size > parser->scratch_size) {
+        void *scratch = realloc(parser->scratch, size);
+        if (!scratch) {
+            return NULL;
+        }
+        parser->scratch = scratch;
+        parser->scratch_size = size;
+    }
+    return parser->scratch;
+}
+
+// token is the offending text, or NULL for errors that have no position
+static void parser_error(Parser *parser, CalcErrorCode code, const Token *token) {
+    parser->has_error = 1;
+    parser->error.code = code;
+    parser->error.offset = token ? token->start : 0;
+    parser->error.length = token ? (size_t)token->length : 0;
+}
+
+// Adds a node, or returns the index of an identical existing one
+static int parser_intern(Parser *parser, const Node *node) {
+    if (parser->has_error) {
+        return -1;
+    }
+    
+    if (parser->node_count == parser->node_capacity) {
+        int capacity = parser->node_capacity ? parser->node_capacity * 2 : 16;
+        Node *nodes = realloc(parser->nodes, capacity * sizeof(Node));
+        if (!nodes) {
+            parser_error(parser, CALC_ERROR_OUT_OF_MEMORY, NULL);
+            return -1;
+        }
+        parser->nodes = nodes;
+        parser->node_capacity = capacity;
+    }
+    
+    int index = node_table_intern(&parser->table, parser->nodes, &parser->node_count, node);
+    if (index < 0) {
+        parser_error(parser, CALC_ERROR_OUT_OF_MEMORY, NULL);
+    }
+    return index;
+}
+
+static int parser_add_node(Parser *parser, NodeType type, int left, int right, double value) {
+    Node node = {type, left, right, -1, value};
+    return parser_intern(parser, &node);
+}
+
+// A call of function id on args, or the operator node it stands for
+static int parser_add_call(Parser *parser, int id, const int *args) {
+    const Function *function = &functions[id];
+    if (function->node != NODE_CALL) {
+        return parser_add_node(parser, function->node, args[0], args[1], 0);
+    }
+    Node node = {NODE_CALL, args[0], -1, -1, id};
+    if (function->arity > 1) {
+        node.right = args[1];
+    }
+    if (function->arity > 2) {
+        node.third = args[2];
+    }
+    return parser_intern(parser, &node);
+}
+
+// A call of user function index on args: a copy of its body reading the
+// arguments instead of the parameters, or an invocation of its block
+static int parser_add_user_call(Parser *parser, int index, const int *args) {
+    const UserFunction *function = &parser->user_functions->items[index];
+    if (function->block >= 0) {
+        Node node = {NODE_INVOKE, args[0], -1, -1, function->block};
+        if (function->arity > 1) {
+            node.right = args[1];
+        }
+        if (function->arity > 2) {
+            node.third = args[2];
+        }
+        return parser_intern(parser, &node);
+    }
+    
+    // Nothing else uses the scratch space until the parse is complete
+    int *map = parser_scratch(parser, function->body_count * sizeof(int));
+    if (!map) {
+        parser_error(parser, CALC_ERROR_OUT_OF_MEMORY, NULL);
+        return -1;
+    }
+    for (int i = 0; i < function->body_count; i++) {
+        Node node = function->body[i];
+        if (node.type == NODE_VARIABLE) {
+            map[i] = args[node.left];
+            continue;
+        }
+        if (node.type != NODE_NUMBER) {
+            node.left = map[node.left];
+            if (node.right >= 0) {
+                node.right = map[node.right];
+            }
+            if (node.third >= 0) {
+                node.third = map[node.third];
+            }
+        }
+        map[i] = parser_intern(parser, &node);
+    }
+    return map[function->body_count - 1];
+}
+
+static int parser_variable_slot(Parser *parser, const char *name, int length, size_t offset) {
+    CompiledExpr *expr = parser->expr;
+    SymbolTable *symbols = &parser->symbols;
+    
+    if ((expr->variable_count + 1) * 2 > symbols->capacity &&
+        !symbol_table_grow(symbols, expr->variables, expr->variable_count)) {
+        parser_error(parser, CALC_ERROR_OUT_OF_MEMORY, NULL);
+        return -1;
+    }
+    
+    unsigned int slot = symbol_hash(name, length) & (symbols->capacity - 1);
+    while (symbols->slots[slot] >= 0) {
+        const char *known = expr->variables[symbols->slots[slot]];
+        if (strncmp(known, name, length) == 0 && known[length] == '\0') {
+            return symbols->slots[slot];
+        }
+        slot = (slot + 1) & (symbols->capacity - 1);
+    }
+    
+    char **variables = realloc(expr->variables, (expr->variable_count + 1) * sizeof(char *));
+    if (!variables) {
+        parser_error(parser, CALC_ERROR_OUT_OF_MEMORY, NULL);
+        return -1;
+    }
+    expr->variables = variables;
+    
+    char *copy = malloc(length + 1);
+    if (!copy) {
+        parser_error(parser, CALC_ERROR_OUT_OF_MEMORY, NULL);
+        return -1;
+    }
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    if (expr->variable_count == 0) {
+        expr->variable_offset = offset;
+    }
+    expr->variables[expr->variable_count] = copy;
+    symbols->slots[slot] = expr->variable_count;
+    return expr->variable_count++;
+}
+
+// Expressions are parsed by operator precedence over two explicit stacks
+// kept on the heap, so deep nesting (a million parentheses, a long chain
+// of ^ or unary minus) costs memory in proportion but never C stack. The
+// grammar is the same as the recursive descent this replaced:
+//
+//   expression = term (("+" | "-") term)*
+//   term       = factor (("*" | "/" | "%") factor)*
+//   factor     = power power*                  implicit multiplication
+//   power      = unary ("^" power)?
+//   unary      = ("-" | "+") unary | function primary
+//              | function "(" expression ("," expression)+ ")" | primary
+//   primary    = number | pi | e | identifier | "(" expression ")"
+//
+// Operands on the stack are node indices and operators are NodeTypes,
+// with PARSE_GROUP standing for an open parenthesis and PARSE_FUNCTION
+// plus a FunctionId for a function call; ids from FUNCTION_COUNT on are
+// user functions. The parenthesis of a function with more than one
+// argument is PARSE_ARGUMENTS minus the commas seen so far. Implicit
+// multiplication binds tighter than * and /, so it is an operator of its
+// own: 1/2pi is 1/(2*pi).
+#define PARSE_GROUP -1
+#define PARSE_ARGUMENTS -2
+#define PARSE_IMPLICIT (NODE_POWI + 1)
+#define PARSE_FUNCTION (PARSE_IMPLICIT + 1)
+
+static int parser_push(Parser *parser, int **stack, int *count, int *capacity, int value) {
+    if (*count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 64;
+        int *items = realloc(*stack, grown * sizeof(int));
+        if (!items) {
+            parser_error(parser, CALC_ERROR_OUT_OF_MEMORY, NULL);
+            return 0;
+        }
+        *stack = items;
+        *capacity = grown;
+    }
+    (*stack)[(*count)++] = value;
+    return 1;
+}
+
+// Arguments taken by the function whose call is the operator op
+static int parser_arity(const Parser *parser, int op) {
+    int id = op - PARSE_FUNCTION;
+    if (id < FUNCTION_COUNT) {
+        return functions[id].arity;
+    }
+    return parser->user_functions->items[id - FUNCTION_COUNT].arity;
+}
+
+static int push_operand(Parser *parser, int node) {
+    return parser_push(parser, &parser->operands, &parser->operand_count,
+                       &parser->operand_capacity, node);
+}
+
+static int push_operator(Parser *parser, int op) {
+    return parser_push(parser, &parser->operators, &parser->operator_count,
+                       &parser->operator_capacity, op);
+}
+
+// The operator that follows an operand, or -1 if token ends the
+// expression. A constant, function, variable, number or opening
+// parenthesis right after an operand multiplies implicitly: 2pi,
+// 2sin(x), 2(3+4), (2)(3), 2x.
+static int binary_operator(TokenType type) {
+    switch (type) {
+        case TOKEN_PLUS: return NODE_ADD;
+        case TOKEN_MINUS: return NODE_SUBTRACT;
+        case TOKEN_MULTIPLY: return NODE_MULTIPLY;
+        case TOKEN_DIVIDE: return NODE_DIVIDE;
+        case TOKEN_MODULO: return NODE_MODULO;
+        case TOKEN_POWER: return NODE_POWER;
+        case TOKEN_NUMBER:
+        case TOKEN_PI:
+        case TOKEN_E:
+        case TOKEN_IDENTIFIER:
+        case TOKEN_FUNCTION:
+        case TOKEN_LPAREN:
+            return PARSE_IMPLICIT;
+        default:
+            return -1;
+    }
+}
+
+static int precedence(int op) {
+    switch (op) {
+        case NODE_ADD: case NODE_SUBTRACT: return 1;
+        case NODE_MULTIPLY: case NODE_DIVIDE: case NODE_MODULO: return 2;
+        case PARSE_IMPLICIT: return 3;
+        case NODE_POWER: return 4;
+        default: return 0;      // Prefix operators and PARSE_GROUP
+    }
+}
+
+// Applies binary operators on top of the stack while they bind at least
+// as tightly as min_precedence
+static void reduce_binary(Parser *parser, int min_precedence) {
+    while (!parser->has_error && parser->operator_count > 0 &&
+           precedence(parser->operators[parser->operator_count - 1]) >= min_precedence) {
+        int op = parser->operators[--parser->operator_count];
+        int right = parser->operands[--parser->operand_count];
+        int left = parser->operands[parser->operand_count - 1];
+        NodeType type = op == PARSE_IMPLICIT ? NODE_MULTIPLY : (NodeType)op;
+        parser->operands[parser->operand_count - 1] = parser_add_node(parser, type, left, right, 0);
+    }
+}
+
+// Applies unary minus and functions waiting for the operand just pushed
+static void reduce_prefix(Parser *parser) {
+    while (!parser->has_error && parser->operator_count > 0) {
+        int op = parser->operators[parser->operator_count - 1];
+        if (op < 0 || precedence(op) > 0) {
+            break;
+        }
+        parser->operator_count--;
+        int operand;
+        if (op >= PARSE_FUNCTION) {
+            int id = op - PARSE_FUNCTION;
+            parser->operand_count -= parser_arity(parser, op) - 1;
+            const int *args = parser->operands + parser->operand_count - 1;
+            if (id < FUNCTION_COUNT) {
+                operand = parser_add_call(parser, id, args);
+            } else {
+                operand = parser_add_user_call(parser, id - FUNCTION_COUNT, args);
+            }
+        } else {
+            operand = parser->operands[parser->operand_count - 1];
+            operand = parser_add_node(parser, op, operand, -1, 0);
+        }
+        parser->operands[parser->operand_count - 1] = operand;
+    }
+}
+
+// Arguments the call whose parenthesis is on top still needs, or 0 for a
+// PARSE_GROUP
+static int missing_arguments(const Parser *parser) {
+    int top = parser->operators[parser->operator_count - 1];
+    if (top == PARSE_GROUP) {
+        return 0;
+    }
+    return parser_arity(parser, parser->operators[parser->operator_count - 2]) -
+           (PARSE_ARGUMENTS - top + 1);
+}
+
+// Reports token where something else had to come
+static void parser_unexpected(Parser *parser, const Token *token) {
+    if (token->type == TOKEN_EOF) {
+        parser_error(parser, CALC_ERROR_UNEXPECTED_END, token);
+    } else if (token->type == TOKEN_ERROR) {
+        parser_error(parser, CALC_ERROR_UNEXPECTED_CHARACTER, token);
+    } else {
+        parser_error(parser, CALC_ERROR_UNEXPECTED_TOKEN, token);
+    }
+}
+
+// Index of the user function an identifier calls, or -1 if it names none
+static int parser_user_function(const Parser *parser, const char *name, int length) {
+    if (!parser->user_functions ||
+        (parser->scope_hides_functions && variables_find(parser->scope, name, length) >= 0)) {
+        return -1;
+    }
+    return functions_find(parser->user_functions, name, length);
+}
+
+static int parse_primary(Parser *parser) {
+    Token token = parser->lexer->current;
+    
+    if (token.type == TOKEN_NUMBER || token.type == TOKEN_PI || token.type == TOKEN_E) {
+        lexer_advance(parser->lexer);
+        return parser_add_node(parser, NODE_NUMBER, -1, -1, token.value);
+    }
+    
+    if (token.type == TOKEN_IDENTIFIER) {
+        const char *name = lexer_text(parser->lexer, &token);
+        int slot;
+        // A user function where only a primary may come, as in sin f(x)
+        if (parser_user_function(parser, name, token.length) >= 0) {
+            parser_unexpected(parser, &token);
+            return -1;
+        }
+        if (parser->scope) {
+            slot = variables_find(parser->scope, name, token.length);
+            if (slot < 0) {
+                if (parser->unknown.length == 0) {
+                    parser->unknown = token;
+                }
+                slot = 0;
+            }
+            parser->reads_scope = 1;
+        } else {
+            slot = parser_variable_slot(parser, name, token.length, token.start);
+        }
+        lexer_advance(parser->lexer);
+        return parser_add_node(parser, NODE_VARIABLE, slot, -1, 0);
+    }
+    
+    parser_unexpected(parser, &token);
+    return -1;
+}
+
+static int parse_expression(Parser *parser) {
+    Lexer *lexer = parser->lexer;
+    int groups = 0;             // Parentheses still open
+    int expect_operand = 1;
+    int after_function = 0;     // Arity of the function just read, which
+                                // takes a primary, not a unary
+    
+    while (!parser->has_error) {
+        TokenType type = lexer->current.type;
+        
+        if (expect_operand) {
+            int function = type == TOKEN_FUNCTION;
+            int id = (int)lexer->current.value;
+            if (type == TOKEN_IDENTIFIER && !after_function) {
+                int index = parser_user_function(parser, lexer_text(lexer, &lexer->current),
+                                                 lexer->current.length);
+                if (index >= 0) {
+                    function = 1;
+                    id = FUNCTION_COUNT + index;
+                    parser->reads_scope = 1;
+                }
+            }
+            if (!after_function && (type == TOKEN_MINUS || function)) {
+                push_operator(parser, function ? PARSE_FUNCTION + id : NODE_NEGATE);
+                after_function = function ? parser_arity(parser, PARSE_FUNCTION + id) : 0;
+                lexer_advance(lexer);
+            } else if (!after_function && type == TOKEN_PLUS) {
+                lexer_advance(lexer);
+            } else if (type == TOKEN_LPAREN) {
+                push_operator(parser, after_function > 1 ? PARSE_ARGUMENTS : PARSE_GROUP);
+                groups++;
+                after_function = 0;
+                lexer_advance(lexer);
+            } else if (after_function > 1) {
+                parser_unexpected(parser, &lexer->current);
+            } else {
+                int operand = parse_primary(parser);
+                if (push_operand(parser, operand)) {
+                    reduce_prefix(parser);
+                }
+                expect_operand = 0;
+                after_function = 0;
+            }
+            continue;
+        }
+        
+        if (type == TOKEN_COMMA && groups > 0) {
+            reduce_binary(parser, 1);
+            if (missing_arguments(parser) == 0) {
+                break;
+            }
+            parser->operators[parser->operator_count - 1]--;
+            lexer_advance(lexer);
+            expect_operand = 1;
+            continue;
+        }
+        
+        if (type == TOKEN_RPAREN && groups > 0) {
+            reduce_binary(parser, 1);
+            if (missing_arguments(parser) > 0) {
+                parser_error(parser, CALC_ERROR_UNEXPECTED_TOKEN, &lexer->current);
+                break;
+            }
+            parser->operator_count--;   // The matching PARSE_GROUP or PARSE_ARGUMENTS
+            groups--;
+            lexer_advance(lexer);
+            reduce_prefix(parser);
+            continue;
+        }
+        
+        int op = binary_operator(type);
+        if (op < 0) {
+            break;
+        }
+        if (op != PARSE_IMPLICIT) {
+            lexer_advance(lexer);
+        }
+        // ^ is right-associative, so it never reduces an earlier ^
+        reduce_binary(parser, op == NODE_POWER ? 5 : precedence(op));
+        push_operator(parser, op);
+        expect_operand = 1;
+    }
+    
+    // Close the parentheses still open the way nested calls would have
+    // returned: each takes a ) if one is next and otherwise reports it
+    // missing there, replacing any error raised inside it
+    if (!parser->has_error || parser->error.code != CALC_ERROR_OUT_OF_MEMORY) {
+        for (; groups > 0; groups--) {
+            if (lexer->current.type == TOKEN_RPAREN) {
+                lexer_advance(lexer);
+            } else {
+                parser_error(parser, CALC_ERROR_EXPECTED_RPAREN, &lexer->current);
+            }
+        }
+    }
+    
+    if (parser->has_error) {
+        return -1;
+    }
+    
+    reduce_binary(parser, 1);
+    return parser->operands[0];
+}
+
+// Native code generation for hot expressions. The JIT translates the
+// register bytecode into straight-line SSE2 code: registers live in the
+// caller's register array (rbx), variables are read through r12 and libm
+// functions are called directly. Math errors return their CalcErrorCode.
+// When executable memory cannot be mapped the
+// expression simply stays on the interpreter.
+#if CALC_JIT
+
+typedef int (*JitFunction)(double *registers, const double *vars);
+
+typedef struct {
+    unsigned char *code;
+    size_t size;
+    size_t *exits;      // Offsets of rel32 jumps to patch with the exit label
+    int exit_count;
+} JitBuffer;
+
+static void jit_emit(JitBuffer *jb, const char *bytes, int length) {
+    memcpy(jb->code + jb->size, bytes, length);
+    jb->size += length;
+}
+
+static void jit_emit_u32(JitBuffer *jb, unsigned int value) {
+    memcpy(jb->code + jb->size, &value, 4);
+    jb->size += 4;
+}
+
+// movsd xmmN, [rbx + 8*reg]
+static void jit_load_register(JitBuffer *jb, int xmm, int reg) {
+    char modrm = (char)(0x83 | (xmm << 3));
+    jit_emit(jb, "\xF2\x0F\x10", 3);
+    jit_emit(jb, &modrm, 1);
+    jit_emit_u32(jb, reg * 8);
+}
+
+// movsd [rbx + 8*reg], xmm0
+static void jit_store_register(JitBuffer *jb, int reg) {
+    jit_emit(jb, "\xF2\x0F\x11\x83", 4);
+    jit_emit_u32(jb, reg * 8);
+}
+
+// movsd xmmN, [r12 + 8*slot]
+static void jit_load_variable(JitBuffer *jb, int xmm, int slot) {
+    char modrm = (char)(0x84 | (xmm << 3));
+    jit_emit(jb, "\xF2\x41\x0F\x10", 4);
+    jit_emit(jb, &modrm, 1);
+    jit_emit(jb, "\x24", 1);
+    jit_emit_u32(jb, slot * 8);
+}
+
+// mov rax, imm64; movq xmmN, rax
+static void jit_load_constant(JitBuffer *jb, int xmm, double value) {
+    char modrm = (char)(0xC0 | (xmm << 3));
+    jit_emit(jb, "\x48\xB8", 2);
+    memcpy(jb->code + jb->size, &value, 8);
+    jb->size += 8;
+    jit_emit(jb, "\x66\x48\x0F\x6E", 4);
+    jit_emit(jb, &modrm, 1);
+}
+
+// <op>sd xmm0, xmm1 for add (0x58), mul (0x59), sub (0x5C) and div (0x5E)
+static void jit_arith(JitBuffer *jb, char opcode) {
+    jit_emit(jb, "\xF2\x0F", 2);
+    jit_emit(jb, &opcode, 1);
+    jit_emit(jb, "\xC1", 1);
+}
+
+// <op>sd xmm0, [rbx + 8*reg]
+static void jit_arith_register(JitBuffer *jb, char opcode, int reg) {
+    jit_emit(jb, "\xF2\x0F", 2);
+    jit_emit(jb, &opcode, 1);
+    jit_emit(jb, "\x83", 1);
+    jit_emit_u32(jb, reg * 8);
+}
+
+// mov rax, imm64; call rax
+static void jit_call(JitBuffer *jb, void *function) {
+    jit_emit(jb, "\x48\xB8", 2);
+    memcpy(jb->code + jb->size, &function, 8);
+    jb->size += 8;
+    jit_emit(jb, "\xFF\xD0", 2);
+}
+
+// Compares xmm<compare> against zero and leaves with error code when the
+// interpreter's check would fail. skip_error holds the inverse jump(s).
+static void jit_check(JitBuffer *jb, const char *compare, const char *skip_error,
+                      int skip_length, int code) {
+    jit_emit(jb, "\x66\x0F\x57\xDB", 4);        // xorpd xmm3, xmm3
+    jit_emit(jb, compare, 4);
+    jit_emit(jb, skip_error, skip_length);
+    jit_emit(jb, "\xB8", 1);                    // mov eax, code
+    jit_emit_u32(jb, code);
+    jit_emit(jb, "\xE9", 1);                    // jmp exit
+    jb->exits[jb->exit_count++] = jb->size;
+    jit_emit_u32(jb, 0);
+}
+
+// Leaves with code when xmm<N> is outside domain
+static void jit_check_domain(JitBuffer *jb, int xmm, FunctionDomain domain, int code) {
+    char compare[] = "\x66\x0F\x2E\xD8";       // ucomisd xmm3, xmm<N>
+    compare[3] = (char)(0xD8 + xmm);
+    if (domain == DOMAIN_NON_NEGATIVE) {
+        // Fail unless 0 <= a (jbe skips)
+        jit_check(jb, compare, "\x76\x0A", 2, code);
+    } else if (domain == DOMAIN_POSITIVE) {
+        // Fail unless 0 < a (jb skips)
+        jit_check(jb, compare, "\x72\x0A", 2, code);
+    }
+}
+
+// Fails when xmm<N> == 0 (NaN compares unequal, as in the interpreter)
+static void jit_check_zero(JitBuffer *jb, int xmm, int code) {
+    jit_check(jb, xmm == 0 ? "\x66\x0F\x2E\xC3" : "\x66\x0F\x2E\xCB",
+              "\x7A\x0C\x75\x0A", 4, code);
+}
+
+// Error exits calc_jit() may emit for expr: at most one per instruction,
+// except that a checked call tests each of its arguments
+static size_t jit_exit_bound(const CompiledExpr *expr) {
+    size_t bound = 0;
+    for (int i = 0; i < expr->code_count; i++) {
+        int op = expr->code[i].op;
+        bound += op == OP_CALL3 ? 3 : op == OP_CALL2 ? 2 : 1;
+    }
+    return bound;
+}
+
+int calc_jit(CompiledExpr *expr) {
+    if (expr->jit_code) {
+        return 1;
+    }
+    
+    size_t capacity = (size_t)expr->code_count * 128 + 64;
+    long page = sysconf(_SC_PAGESIZE);
+    capacity = (capacity + page - 1) / page * page;
+    
+    void *memory = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return 0;
+    }
+    
+    JitBuffer jb;
+    jb.code = memory;
+    jb.size = 0;
+    jb.exit_count = 0;
+    jb.exits = malloc(jit_exit_bound(expr) * sizeof(size_t));
+    if (!jb.exits) {
+        munmap(memory, capacity);
+        return 0;
+    }
+    
+    // push rbx; push r12; sub rsp, 8; mov rbx, rdi; mov r12, rsi
+    jit_emit(&jb, "\x53\x41\x54\x48\x83\xEC\x08\x48\x89\xFB\x49\x89\xF4", 13);
+    
+    int cached = -1;    // Register whose value is still in xmm0
+    
+    for (int i = 0; i < expr->code_count; i++) {
+        const Instruction *ins = &expr->code[i];
+        
+        // Most instructions start by loading operand a into xmm0
+        int loads_a = ins->op != OP_CONST && ins->op != OP_LOAD && ins->op != OP_HALT &&
+                      ins->op != OP_RSUB_K && ins->op != OP_RDIV_K && ins->op != OP_NMUL_ADD;
+        if (loads_a && ins->a != cached) {
+            jit_load_register(&jb, 0, ins->a);
+        }
+        
+        switch (ins->op) {
+            case OP_HALT:
+                jit_emit(&jb, "\x31\xC0", 2);   // xor eax, eax
+                break;
+            case OP_CONST:
+                jit_load_constant(&jb, 0, ins->k);
+                break;
+            case OP_LOAD:
+                jit_load_variable(&jb, 0, ins->a);
+                break;
+            case OP_NEG:
+                jit_load_constant(&jb, 1, -0.0);
+                jit_emit(&jb, "\x66\x0F\x57\xC1", 4);   // xorpd xmm0, xmm1
+                break;
+            case OP_ABS: {
+                double mask;
+                unsigned long long bits = 0x7FFFFFFFFFFFFFFFULL;
+                memcpy(&mask, &bits, 8);
+                jit_load_constant(&jb, 1, mask);
+                jit_emit(&jb, "\x66\x0F\x54\xC1", 4);   // andpd xmm0, xmm1
+                break;
+            }
+            case OP_ADD: jit_arith_register(&jb, 0x58, ins->b); break;
+            case OP_SUB: jit_arith_register(&jb, 0x5C, ins->b); break;
+            case OP_MUL: jit_arith_register(&jb, 0x59, ins->b); break;
+            case OP_DIV:
+                jit_load_register(&jb, 1, ins->b);
+                jit_check_zero(&jb, 1, CALC_ERROR_DIVISION_BY_ZERO);
+                jit_arith(&jb, 0x5E);
+                break;
+            case OP_MOD:
+                jit_load_register(&jb, 1, ins->b);
+                jit_check_zero(&jb, 1, CALC_ERROR_MODULO_BY_ZERO);
+                jit_call(&jb, (void *)fmod);
+                break;
+            case OP_POW:
+                jit_load_register(&jb, 1, ins->b);
+                jit_call(&jb, (void *)pow);
+                break;
+            case OP_CALL: {
+                const Function *function = &functions[ins->function];
+                jit_check_domain(&jb, 0, function->domain, function->error);
+                jit_call(&jb, (void *)function->scalar.unary);
+                break;
+            }
+            case OP_CALL2:
+            case OP_CALL3: {
+                const Function *function = &functions[ins->function];
+                int arity = ins->op == OP_CALL3 ? 3 : 2;
+                jit_load_register(&jb, 1, ins->b);
+                if (arity == 3) {
+                    jit_load_register(&jb, 2, ins->c);
+                }
+                for (int xmm = 0; xmm < arity; xmm++) {
+                    jit_check_domain(&jb, xmm, function->domain, function->error);
+                }
+                jit_call(&jb, arity == 3 ? (void *)function->scalar.ternary : (void *)function->scalar.binary);
+                break;
+            }
+            case OP_SQRT:
+                jit_check_domain(&jb, 0, DOMAIN_NON_NEGATIVE, CALC_ERROR_NEGATIVE_SQRT);
+                jit_emit(&jb, "\xF2\x0F\x51\xC0", 4);   // sqrtsd xmm0, xmm0
+                break;
+            case OP_ADD_K:
+                jit_load_constant(&jb, 1, ins->k);
+                jit_arith(&jb, 0x58);
+                break;
+            case OP_SUB_K:
+                jit_load_constant(&jb, 1, ins->k);
+                jit_arith(&jb, 0x5C);
+                break;
+            case OP_MUL_K:
+                jit_load_constant(&jb, 1, ins->k);
+                jit_arith(&jb, 0x59);
+                break;
+            case OP_DIV_K:
+                jit_load_constant(&jb, 1, ins->k);
+                jit_arith(&jb, 0x5E);
+                break;
+            case OP_RSUB_K:
+                jit_load_constant(&jb, 0, ins->k);
+                jit_arith_register(&jb, 0x5C, ins->a);
+                break;
+            case OP_RDIV_K:
+                jit_load_register(&jb, 1, ins->a);
+                jit_check_zero(&jb, 1, CALC_ERROR_DIVISION_BY_ZERO);
+                jit_load_constant(&jb, 0, ins->k);
+                jit_arith(&jb, 0x5E);
+                break;
+            case OP_MOD_K:
+                jit_load_constant(&jb, 1, ins->k);
+                jit_call(&jb, (void *)fmod);
+                break;
+            case OP_POW_K:
+                jit_load_constant(&jb, 1, ins->k);
+                jit_call(&jb, (void *)pow);
+                break;
+            case OP_MUL_ADD:
+                jit_arith_register(&jb, 0x59, ins->b);
+                jit_arith_register(&jb, 0x58, ins->c);
+                break;
+            case OP_MUL_SUB:
+                jit_arith_register(&jb, 0x59, ins->b);
+                jit_arith_register(&jb, 0x5C, ins->c);
+                break;
+            case OP_NMUL_ADD:
+                jit_load_register(&jb, 1, ins->a);
+                jit_emit(&jb, "\xF2\x0F\x59\x8B", 4);   // mulsd xmm1, [rbx + 8*b]
+                jit_emit_u32(&jb, ins->b * 8);
+                jit_load_register(&jb, 0, ins->c);
+                jit_arith(&jb, 0x5C);
+                break;
+            case OP_POWI: {
+                // Unrolled calc_powi(): square, then multiply by the base
+                // in xmm1 for every set bit below the leading one
+                unsigned int n = ins->c < 0 ? -ins->c : ins->c;
+                int bit = 0;
+                while (n >> (bit + 1)) {
+                    bit++;
+                }
+                jit_emit(&jb, "\x66\x0F\x28\xC8", 4);       // movapd xmm1, xmm0
+                for (bit--; bit >= 0; bit--) {
+                    jit_emit(&jb, "\xF2\x0F\x59\xC0", 4);   // mulsd xmm0, xmm0
+                    if ((n >> bit) & 1) {
+                        jit_arith(&jb, 0x59);
+                    }
+                }
+                if (ins->c < 0) {
+                    jit_load_constant(&jb, 1, 1.0);
+                    jit_emit(&jb, "\xF2\x0F\x5E\xC8", 4);   // divsd xmm1, xmm0
+                    jit_emit(&jb, "\x66\x0F\x28\xC1", 4);   // movapd xmm0, xmm1
+                }
+                break;
+            }
+        }
+        
+        if (ins->op != OP_HALT) {
+            jit_store_register(&jb, ins->dst);
+            cached = ins->dst;
+        }
+    }
+    
+    // Shared exit: add rsp, 8; pop r12; pop rbx; ret
+    for (int i = 0; i < jb.exit_count; i++) {
+        unsigned int rel = (unsigned int)(jb.size - (jb.exits[i] + 4));
+        memcpy(jb.code + jb.exits[i], &rel, 4);
+    }
+    jit_emit(&jb, "\x48\x83\xC4\x08\x41\x5C\x5B\xC3", 8);
+    free(jb.exits);
+    
+    if (mprotect(memory, capacity, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, capacity);
+        return 0;
+    }
+    
+    expr->jit_code = memory;
+    expr->jit_size = capacity;
+    return 1;
+}
+
+#else
+
+int calc_jit(CompiledExpr *expr) {
+    (void)expr;
+    return 0;
+}
+
+#endif
+
+// Frees what expr owns, but not expr itself
+static void compiled_release(CompiledExpr *expr) {
+    for (int i = 0; i < expr->variable_count; i++) {
+        free(expr->variables[i]);
+    }
+    free(expr->variables);
+    free(expr->code);
+    for (int i = 0; i < expr->callee_count; i++) {
+        calc_free(expr->callees[i]);
+    }
+    free(expr->callees);
+#if CALC_JIT
+    if (expr->jit_code) {
+        munmap(expr->jit_code, expr->jit_size);
+    }
+#endif
+}
+
+static CompiledExpr *compiled_retain(CompiledExpr *expr) {
+    atomic_fetch_add_explicit(&expr->references, 1, memory_order_relaxed);
+    return expr;
+}
+
+void calc_free(CompiledExpr *expr) {
+    if (!expr || atomic_fetch_sub_explicit(&expr->references, 1, memory_order_acq_rel) > 1) {
+        return;
+    }
+    compiled_release(expr);
+    free(expr);
+}
+
+int calc_variable_count(const CompiledExpr *expr) {
+    return expr->variable_count;
+}
+
+const char *calc_variable_name(const CompiledExpr *expr, int slot) {
+    return slot >= 0 && slot < expr->variable_count ? expr->variables[slot] : NULL;
+}
+
+int calc_variable_slot(const CompiledExpr *expr, const char *name) {
+    for (int i = 0; i < expr->variable_count; i++) {
+        if (strcmp(expr->variables[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int calc_nodes_eliminated(const CompiledExpr *expr) {
+    return expr->nodes_eliminated;
+}
+
+// Raises x to a small integer power with a left-to-right multiply chain.
+// The JIT and batch evaluator multiply in exactly the same order, so all
+// three paths round identically.
+static double calc_powi(double x, int exponent) {
+    unsigned int n = exponent < 0 ? -exponent : exponent;
+    int bit = 0;
+    while (n >> (bit + 1)) {
+        bit++;
+    }
+    
+    double result = x;
+    for (bit--; bit >= 0; bit--) {
+        result *= result;
+        if ((n >> bit) & 1) {
+            result *= x;
+        }
+    }
+    return exponent < 0 ? 1 / result : result;
+}
+
+// Built-in functions libm does not have. min and max ignore a NaN
+// argument like fmin() and fmax(), but keep the first of two zeros.
+static double calc_min(double a, double b) {
+    return a < b || b != b ? a : b;
+}
+
+static double calc_max(double a, double b) {
+    return a > b || b != b ? a : b;
+}
+
+static double calc_clamp(double x, double low, double high) {
+    return x < low ? low : x > high ? high : x;
+}
+
+static double calc_logb(double x, double base) {
+    return log(x) / log(base);
+}
+
+// Computes a node whose operands are all constants. Returns 0 when the
+// operation would raise a math error, so the node is left for calc_eval()
+// to report at run time.
+static int fold_node(const Node *node, const double *args, double *result) {
+    double left = args[0];
+    double right = args[1];
+    switch (node->type) {
+        case NODE_NEGATE: *result = -left; return 1;
+        case NODE_ADD: *result = left + right; return 1;
+        case NODE_SUBTRACT: *result = left - right; return 1;
+        case NODE_MULTIPLY: *result = left * right; return 1;
+        case NODE_DIVIDE: *result = left / right; return right != 0;
+        case NODE_MODULO: *result = fmod(left, right); return right != 0;
+        case NODE_POWER: *result = pow(left, right); return 1;
+        case NODE_POWI: *result = calc_powi(left, (int)node->value); return 1;
+        case NODE_CALL: {
+            const Function *function = &functions[(int)node->value];
+            for (int i = 0; i < function->arity; i++) {
+                if (!function_accepts(function, args[i])) {
+                    return 0;
+                }
+            }
+            *result = function_apply(function, args);
+            return 1;
+        }
+        default: return 0;
+    }
+}
+
+static int can_fail(const Node *node) {
+    return node->type == NODE_DIVIDE || node->type == NODE_MODULO || node->type == NODE_INVOKE ||
+           (node->type == NODE_CALL && functions[(int)node->value].domain != DOMAIN_ALL);
+}
+
+// Simplifies the parsed node list before code generation:
+//   - subtrees built only from literals, pi and e are folded to a number
+//   - x+0, 0+x, x-0, x*1, 1*x, x/1, x^1 and --x become x
+//   - x^0 becomes 1 when x cannot raise an error
+//   - x^n for small integer n becomes a multiply chain instead of pow()
+// Results can differ from the unoptimized form only in the sign of a zero
+// (x+0 with x = -0) and in the last bits of a multiply chain versus pow().
+// Returns the number of nodes eliminated, or -1 if memory runs out.
+static int optimize_nodes(Parser *parser) {
+    int count = parser->node_count;
+    Node *nodes = parser->nodes;
+    Node *out = parser_scratch(parser, count * (sizeof(Node) + sizeof(int) + 2));
+    if (!out) {
+        return -1;
+    }
+    int *map = (int *)(out + count);
+    unsigned char *fails = (unsigned char *)(map + count);
+    unsigned char *live = fails + count;
+    memset(live, 0, count);
+    
+    // The parse is complete, so its hash table is free to intern the
+    // rewritten nodes. It already has room for count of them.
+    NodeTable *table = &parser->table;
+    memset(table->slots, -1, table->capacity * sizeof(int));
+    int emitted = 0;
+    
+    for (int i = 0; i < count; i++) {
+        Node node = nodes[i];
+        int operation = node.type != NODE_NUMBER && node.type != NODE_VARIABLE;
+        int binary = node.type >= NODE_ADD && node.type <= NODE_POWER;
+        
+        if (operation) {
+            node.left = map[node.left];
+            if (node.right >= 0) {
+                node.right = map[node.right];
+            }
+            if (node.third >= 0) {
+                node.third = map[node.third];
+            }
+        }
+        
+        const Node *left = operation ? &out[node.left] : NULL;
+        const Node *right = node.right >= 0 ? &out[node.right] : NULL;
+        const Node *third = node.third >= 0 ? &out[node.third] : NULL;
+        int left_constant = left && left->type == NODE_NUMBER;
+        int right_constant = right && right->type == NODE_NUMBER;
+        int third_constant = third && third->type == NODE_NUMBER;
+        double args[3] = {
+            left_constant ? left->value : 0,
+            right_constant ? right->value : 0,
+            third_constant ? third->value : 0
+        };
+        double value;
+        
+        if (left_constant && (!right || right_constant) && (!third || third_constant) &&
+            fold_node(&node, args, &value)) {
+            node.type = NODE_NUMBER;
+            node.left = node.right = node.third = -1;
+            node.value = value;
+        } else if (node.type == NODE_NEGATE && left->type == NODE_NEGATE) {
+            map[i] = left->left;
+            continue;
+        } else if (binary && right_constant &&
+                   ((right->value == 0 && (node.type == NODE_ADD || node.type == NODE_SUBTRACT)) ||
+                    (right->value == 1 && (node.type == NODE_MULTIPLY || node.type == NODE_DIVIDE ||
+                                           node.type == NODE_POWER)))) {
+            map[i] = node.left;
+            continue;
+        } else if (binary && left_constant &&
+                   ((left->value == 0 && node.type == NODE_ADD) ||
+                    (left->value == 1 && node.type == NODE_MULTIPLY))) {
+            map[i] = node.right;
+            continue;
+        } else if (node.type == NODE_POWER && right_constant && right->value == 0 && !fails[node.left]) {
+            node.type = NODE_NUMBER;
+            node.left = node.right = -1;
+            node.value = 1;
+        } else if (node.type == NODE_POWER && right_constant && right->value == (int)right->value &&
+                   right->value != 0 && right->value >= -16 && right->value <= 16) {
+            node.type = NODE_POWI;
+            node.right = -1;
+            node.value = right->value;
+        }
+        
+        // Rewrites can make two subtrees identical, so intern them again
+        int fail = can_fail(&node) ||
+                   (node.left >= 0 && node.type != NODE_VARIABLE && fails[node.left]) ||
+                   (node.right >= 0 && fails[node.right]) ||
+                   (node.third >= 0 && fails[node.third]);
+        int index = node_table_intern(table, out, &emitted, &node);
+        if (index < 0) {
+            return -1;
+        }
+        fails[index] = fail;
+        map[i] = index;
+    }
+    
+    // Folding leaves the operands it consumed behind; keep only the nodes
+    // still reachable from the root, preserving their post-order.
+    int root = map[count - 1];
+    live[root] = 1;
+    for (int i = root; i >= 0; i--) {
+        if (!live[i] || out[i].type == NODE_NUMBER || out[i].type == NODE_VARIABLE) {
+            continue;
+        }
+        live[out[i].left] = 1;
+        if (out[i].right >= 0) {
+            live[out[i].right] = 1;
+        }
+        if (out[i].third >= 0) {
+            live[out[i].third] = 1;
+        }
+    }
+    
+    int kept = 0;
+    for (int i = 0; i <= root; i++) {
+        if (!live[i]) {
+            continue;
+        }
+        Node node = out[i];
+        if (node.type != NODE_NUMBER && node.type != NODE_VARIABLE) {
+            node.left = map[node.left];
+            if (node.right >= 0) {
+                node.right = map[node.right];
+            }
+            if (node.third >= 0) {
+                node.third = map[node.third];
+            }
+        }
+        map[i] = kept;
+        nodes[kept++] = node;
+    }
+    
+    parser->node_count = kept;
+    return count - kept;
+}
+
+#define FUSE_NONE 0
+#define FUSE_CONSTANT_RIGHT 1
+#define FUSE_CONSTANT_LEFT 2
+#define FUSE_PRODUCT_LEFT 3
+#define FUSE_PRODUCT_RIGHT 4
+
+// Picks how each node reads its operands: numeric operands of binary
+// operators become constant-operand superinstructions and products
+// feeding an addition or subtraction become fused multiply-add forms.
+// A product is only fused when it has no other user. On return, uses[i]
+// counts the instructions that read node i from a register (the root
+// counts one for the result); nodes left with no uses are not emitted.
+static void select_superinstructions(const Node *nodes, int count, unsigned char *fuse, int *uses) {
+    for (int i = 0; i < count; i++) {
+        const Node *node = &nodes[i];
+        if (node->type == NODE_NUMBER || node->type == NODE_VARIABLE) {
+            continue;
+        }
+        uses[node->left]++;
+        if (node->right >= 0) {
+            uses[node->right]++;
+        }
+        if (node->third >= 0) {
+            uses[node->third]++;
+        }
+    }
+    uses[count - 1]++;
+    
+    // Every user of a node comes after it, so by the time a node is
+    // visited its final use count is known
+    for (int i = count - 1; i >= 0; i--) {
+        const Node *node = &nodes[i];
+        if (!uses[i] || node->type < NODE_ADD || node->type > NODE_POWER) {
+            continue;
+        }
+        
+        const Node *left = &nodes[node->left];
+        const Node *right = &nodes[node->right];
+        int right_constant = right->type == NODE_NUMBER;
+        int left_constant = left->type == NODE_NUMBER;
+        
+        // Division and modulo by a literal zero keep their runtime check
+        if ((node->type == NODE_DIVIDE || node->type == NODE_MODULO) && right->value == 0) {
+            right_constant = 0;
+        }
+        if (node->type == NODE_MODULO || node->type == NODE_POWER) {
+            left_constant = 0;
+        }
+        
+        if (right_constant) {
+            fuse[i] = FUSE_CONSTANT_RIGHT;
+            uses[node->right]--;
+        } else if (left_constant) {
+            fuse[i] = FUSE_CONSTANT_LEFT;
+            uses[node->left]--;
+        } else if (node->type == NODE_ADD || node->type == NODE_SUBTRACT) {
+            // The product's own operand uses carry over to the fused form
+            if (left->type == NODE_MULTIPLY && uses[node->left] == 1 &&
+                nodes[left->left].type != NODE_NUMBER && nodes[left->right].type != NODE_NUMBER) {
+                fuse[i] = FUSE_PRODUCT_LEFT;
+                uses[node->left]--;
+            } else if (right->type == NODE_MULTIPLY && uses[node->right] == 1 &&
+                nodes[right->left].type != NODE_NUMBER && nodes[right->right].type != NODE_NUMBER) {
+                fuse[i] = FUSE_PRODUCT_RIGHT;
+                uses[node->right]--;
+            }
+        }
+    }
+}
+
+// Index of block among the callees of expr, which takes a reference to
+// it the first time, or -1 when out of memory
+static int expr_add_callee(CompiledExpr *expr, CompiledExpr *block) {
+    for (int i = 0; i < expr->callee_count; i++) {
+        if (expr->callees[i] == block) {
+            return i;
+        }
+    }
+    CompiledExpr **callees = realloc(expr->callees, (expr->callee_count + 1) * sizeof(CompiledExpr *));
+    if (!callees) {
+        return -1;
+    }
+    expr->callees = callees;
+    expr->callees[expr->callee_count] = compiled_retain(block);
+    return expr->callee_count++;
+}
+
+// Lowers the post-order node DAG to register bytecode. A node's value
+// stays in its register until its last reader has run, and that register
+// is then recycled, so a shared subexpression is computed only once. The
+// root always writes register 0: every other value is dead by then.
+static int generate_code(Parser *parser) {
+    static const int unary_ops[] = {
+        [NODE_NEGATE] = OP_NEG, [NODE_POWI] = OP_POWI
+    };
+    static const int binary_ops[][3] = {
+        // Register form, constant on the right, constant on the left
+        [NODE_ADD] = {OP_ADD, OP_ADD_K, OP_ADD_K},
+        [NODE_SUBTRACT] = {OP_SUB, OP_SUB_K, OP_RSUB_K},
+        [NODE_MULTIPLY] = {OP_MUL, OP_MUL_K, OP_MUL_K},
+        [NODE_DIVIDE] = {OP_DIV, OP_DIV_K, OP_RDIV_K},
+        [NODE_MODULO] = {OP_MOD, OP_MOD_K, OP_MOD},
+        [NODE_POWER] = {OP_POW, OP_POW_K, OP_POW}
+    };
+    
+    const Node *nodes = parser->nodes;
+    int count = parser->node_count;
+    CompiledExpr *expr = parser->expr;
+    
+    int *uses = parser_scratch(parser, count * (3 * sizeof(int) + 1));
+    expr->code = malloc((count + 1) * sizeof(Instruction));
+    if (!uses || !expr->code) {
+        return 0;
+    }
+    int *reg = uses + count;
+    int *free_regs = reg + count;
+    unsigned char *fuse = (unsigned char *)(free_regs + count);
+    memset(uses, 0, count * sizeof(int));
+    memset(fuse, 0, count);
+    
+    select_superinstructions(nodes, count, fuse, uses);
+    
+    int free_count = 0;
+    int next_register = 0;
+    int pc = 0;
+    
+    for (int i = 0; i < count; i++) {
+        if (!uses[i]) {
+            continue;
+        }
+        
+        const Node *node = &nodes[i];
+        Instruction *ins = &expr->code[pc++];
+        int operands[3];
+        int operand_count = 0;
+        
+        if (node->type == NODE_NUMBER) {
+            ins->op = OP_CONST;
+            ins->k = node->value;
+        } else if (node->type == NODE_VARIABLE) {
+            ins->op = OP_LOAD;
+            ins->a = node->left;
+        } else if (node->type == NODE_CALL) {
+            const Function *function = &functions[(int)node->value];
+            ins->op = function->op;
+            ins->function = (int)node->value;
+            ins->a = reg[node->left];
+            operands[operand_count++] = node->left;
+            if (function->arity > 1) {
+                ins->b = reg[node->right];
+                operands[operand_count++] = node->right;
+            }
+            if (function->arity > 2) {
+                ins->c = reg[node->third];
+                operands[operand_count++] = node->third;
+            }
+        } else if (node->type == NODE_INVOKE) {
+            ins->op = OP_INVOKE;
+            ins->function = expr_add_callee(expr, parser->user_functions->blocks[(int)node->value]);
+            if (ins->function < 0) {
+                return 0;
+            }
+            ins->a = reg[node->left];
+            operands[operand_count++] = node->left;
+            if (node->right >= 0) {
+                ins->b = reg[node->right];
+                operands[operand_count++] = node->right;
+            }
+            if (node->third >= 0) {
+                ins->c = reg[node->third];
+                operands[operand_count++] = node->third;
+            }
+        } else if (node->type == NODE_NEGATE || node->type == NODE_POWI) {
+            ins->op = unary_ops[node->type];
+            ins->a = reg[node->left];
+            ins->c = (int)node->value;
+            operands[operand_count++] = node->left;
+        } else if (fuse[i] == FUSE_CONSTANT_RIGHT) {
+            ins->op = binary_ops[node->type][1];
+            ins->a = reg[node->left];
+            ins->k = nodes[node->right].value;
+            operands[operand_count++] = node->left;
+        } else if (fuse[i] == FUSE_CONSTANT_LEFT) {
+            ins->op = binary_ops[node->type][2];
+            ins->a = reg[node->right];
+            ins->k = nodes[node->left].value;
+            operands[operand_count++] = node->right;
+        } else if (fuse[i] == FUSE_PRODUCT_LEFT || fuse[i] == FUSE_PRODUCT_RIGHT) {
+            int left = fuse[i] == FUSE_PRODUCT_LEFT;
+            const Node *product = &nodes[left ? node->left : node->right];
+            if (node->type == NODE_ADD) {
+                ins->op = OP_MUL_ADD;
+            } else {
+                ins->op = left ? OP_MUL_SUB : OP_NMUL_ADD;
+            }
+            ins->a = reg[product->left];
+            ins->b = reg[product->right];
+            ins->c = reg[left ? node->right : node->left];
+            operands[operand_count++] = product->left;
+            operands[operand_count++] = product->right;
+            operands[operand_count++] = left ? node->right : node->left;
+        } else {
+            ins->op = binary_ops[node->type][0];
+            ins->a = reg[node->left];
+            ins->b = reg[node->right];
+            operands[operand_count++] = node->left;
+            operands[operand_count++] = node->right;
+        }
+        
+        // Operands read for the last time give up their registers first,
+        // so the result usually overwrites one of them
+        for (int j = 0; j < operand_count; j++) {
+            if (--uses[operands[j]] == 0) {
+                free_regs[free_count++] = reg[operands[j]];
+            }
+        }
+        
+        if (i == count - 1) {
+            ins->dst = 0;
+        } else if (free_count > 0) {
+            ins->dst = free_regs[--free_count];
+        } else {
+            ins->dst = next_register++;
+        }
+        reg[i] = ins->dst;
+    }
+    
+    expr->code[pc].op = OP_HALT;
+    expr->code_count = pc + 1;
+    expr->register_count = next_register > 0 ? next_register : 1;
+    return 1;
+}
+
+// Parses and optimizes a source into parser->nodes. Returns 0 with
+// parser->error set if that fails.
+static int parse_source(Parser *parser, Lexer *lexer, CompiledExpr *expr) {
+    parser_start(parser, lexer, expr);
+    
+    parse_expression(parser);
+    
+    if (!parser->has_error && lexer->current.type != TOKEN_EOF) {
+        parser_error(parser, CALC_ERROR_TRAILING_TOKENS, &lexer->current);
+    }
+    
+    // Running out of input early explains any syntax error it caused
+    if (lexer->failure != CALC_OK) {
+        parser->has_error = 1;
+        parser->error.code = lexer->failure;
+        parser->error.offset = lexer->base + lexer->fill;
+        parser->error.length = 0;
+    }
+    
+    if (!parser->has_error && (expr->nodes_eliminated = optimize_nodes(parser)) < 0) {
+        parser_error(parser, CALC_ERROR_OUT_OF_MEMORY, NULL);
+    }
+    
+    return !parser->has_error;
+}
+
+static CompiledExpr *compile(Lexer *lexer, CalcError *error) {
+    Parser parser;
+    
+    CompiledExpr *expr = calloc(1, sizeof(CompiledExpr));
+    if (!expr) {
+        error->code = CALC_ERROR_OUT_OF_MEMORY;
+        error->offset = 0;
+        error->length = 0;
+        return NULL;
+    }
+    atomic_init(&expr->references, 1);
+    
+    parser_init(&parser);
+    if (parse_source(&parser, lexer, expr) && !generate_code(&parser)) {
+        parser_error(&parser, CALC_ERROR_OUT_OF_MEMORY, NULL);
+    }
+    
+    *error = parser.error;
+    if (parser.has_error) {
+        calc_free(expr);
+        expr = NULL;
+    }
+    parser_release(&parser);
+    return expr;
+}
+
+CompiledExpr *calc_compile(const char *expression, CalcError *error) {
+    Lexer lexer;
+    lexer_init(&lexer, expression);
+    return compile(&lexer, error);
+}
+
+CompiledExpr *calc_compile_stream(CalcReader reader, void *state, CalcError *error) {
+    Lexer lexer;
+    lexer_init_stream(&lexer, reader, state);
+    CompiledExpr *expr = compile(&lexer, error);
+    free(lexer.buffer);
+    return expr;
+}
+
+long calc_read_fd(void *state, char *buffer, size_t size) {
+    ssize_t count;
+    do {
+        count = read(*(int *)state, buffer, size);
+    } while (count < 0 && errno == EINTR);
+    return (long)count;
+}
+
+// The interpreter uses computed-goto dispatch where the compiler supports
+// it, so every handler jumps straight to the next one; otherwise it falls
+// back to a portable switch loop.
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#define VM_CASE(op) label_##op
+#define VM_NEXT() goto *dispatch[(++ip)->op]
+#define VM_DISPATCH() goto *dispatch[ip->op];
+#define VM_END
+#else
+#define VM_THREADED 0
+#define VM_CASE(op) case op
+#define VM_NEXT() ip++; continue
+#define VM_DISPATCH() for (;;) switch (ip->op) {
+#define VM_END }
+#endif
+
+double calc_eval(const CompiledExpr *expr, const double *vars, CalcErrorCode *error) {
+#if VM_THREADED
+    static const void *dispatch[] = {
+        &&label_OP_HALT, &&label_OP_CONST, &&label_OP_LOAD, &&label_OP_NEG,
+        &&label_OP_ADD, &&label_OP_SUB, &&label_OP_MUL, &&label_OP_DIV,
+        &&label_OP_MOD, &&label_OP_POW, &&label_OP_CALL, &&label_OP_CALL2,
+        &&label_OP_CALL3, &&label_OP_INVOKE, &&label_OP_SQRT, &&label_OP_ABS, &&label_OP_ADD_K, &&label_OP_SUB_K, &&label_OP_RSUB_K,
+        &&label_OP_MUL_K, &&label_OP_DIV_K, &&label_OP_RDIV_K, &&label_OP_MOD_K,
+        &&label_OP_POW_K, &&label_OP_MUL_ADD, &&label_OP_MUL_SUB, &&label_OP_NMUL_ADD,
+        &&label_OP_POWI
+    };
+#endif
+    double stack_registers[64];
+    double *r = stack_registers;
+    
+    if (expr->register_count > 64) {
+        r = malloc(expr->register_count * sizeof(double));
+        if (!r) {
+            *error = CALC_ERROR_OUT_OF_MEMORY;
+            return 0;
+        }
+    }
+    
+    const Instruction *ip = expr->code;
+    CalcErrorCode status = CALC_OK;
+    double result = 0;
+    
+#if CALC_JIT
+    if (expr->jit_code) {
+        int code = ((JitFunction)expr->jit_code)(r, vars);
+        status = (CalcErrorCode)code;
+        result = r[0];
+        goto done;
+    }
+#endif
+    
+    VM_DISPATCH()
+        VM_CASE(OP_CONST): r[ip->dst] = ip->k; VM_NEXT();
+        VM_CASE(OP_LOAD): r[ip->dst] = vars[ip->a]; VM_NEXT();
+        VM_CASE(OP_NEG): r[ip->dst] = -r[ip->a]; VM_NEXT();
+        VM_CASE(OP_ADD): r[ip->dst] = r[ip->a] + r[ip->b]; VM_NEXT();
+        VM_CASE(OP_SUB): r[ip->dst] = r[ip->a] - r[ip->b]; VM_NEXT();
+        VM_CASE(OP_MUL): r[ip->dst] = r[ip->a] * r[ip->b]; VM_NEXT();
+        VM_CASE(OP_DIV):
+            if (r[ip->b] == 0) {
+                status = CALC_ERROR_DIVISION_BY_ZERO;
+                goto done;
+            }
+            r[ip->dst] = r[ip->a] / r[ip->b];
+            VM_NEXT();
+        VM_CASE(OP_MOD):
+            if (r[ip->b] == 0) {
+                status = CALC_ERROR_MODULO_BY_ZERO;
+                goto done;
+            }
+            r[ip->dst] = fmod(r[ip->a], r[ip->b]);
+            VM_NEXT();
+        VM_CASE(OP_POW): r[ip->dst] = pow(r[ip->a], r[ip->b]); VM_NEXT();
+        VM_CASE(OP_CALL): {
+            const Function *function = &functions[ip->function];
+            if (!function_accepts(function, r[ip->a])) {
+                status = function->error;
+                goto done;
+            }
+            r[ip->dst] = function->scalar.unary(r[ip->a]);
+            VM_NEXT();
+        }
+        VM_CASE(OP_CALL2): {
+            const Function *function = &functions[ip->function];
+            if (!function_accepts(function, r[ip->a]) || !function_accepts(function, r[ip->b])) {
+                status = function->error;
+                goto done;
+            }
+            r[ip->dst] = function->scalar.binary(r[ip->a], r[ip->b]);
+            VM_NEXT();
+        }
+        VM_CASE(OP_CALL3): {
+            const Function *function = &functions[ip->function];
+            if (!function_accepts(function, r[ip->a]) || !function_accepts(function, r[ip->b]) ||
+                !function_accepts(function, r[ip->c])) {
+                status = function->error;
+                goto done;
+            }
+            r[ip->dst] = function->scalar.ternary(r[ip->a], r[ip->b], r[ip->c]);
+            VM_NEXT();
+        }
+        VM_CASE(OP_INVOKE): {
+            const CompiledExpr *callee = expr->callees[ip->function];
+            const int args[3] = {ip->a, ip->b, ip->c};
+            double values[3];
+            for (int i = 0; i < callee->variable_count; i++) {
+                values[i] = r[args[i]];
+            }
+            r[ip->dst] = calc_eval(callee, values, &status);
+            if (status != CALC_OK) {
+                goto done;
+            }
+            VM_NEXT();
+        }
+        VM_CASE(OP_SQRT):
+            if (r[ip->a] < 0) {
+                status = CALC_ERROR_NEGATIVE_SQRT;
+                goto done;
+            }
+            r[ip->dst] = sqrt(r[ip->a]);
+            VM_NEXT();
+        VM_CASE(OP_ABS): r[ip->dst] = fabs(r[ip->a]); VM_NEXT();
+        VM_CASE(OP_ADD_K): r[ip->dst] = r[ip->a] + ip->k; VM_NEXT();
+        VM_CASE(OP_SUB_K): r[ip->dst] = r[ip->a] - ip->k; VM_NEXT();
+        VM_CASE(OP_RSUB_K): r[ip->dst] = ip->k - r[ip->a]; VM_NEXT();
+        VM_CASE(OP_MUL_K): r[ip->dst] = r[ip->a] * ip->k; VM_NEXT();
+        VM_CASE(OP_DIV_K): r[ip->dst] = r[ip->a] / ip->k; VM_NEXT();
+        VM_CASE(OP_RDIV_K):
+            if (r[ip->a] == 0) {
+                status = CALC_ERROR_DIVISION_BY_ZERO;
+                goto done;
+            }
+            r[ip->dst] = ip->k / r[ip->a];
+            VM_NEXT();
+        VM_CASE(OP_MOD_K): r[ip->dst] = fmod(r[ip->a], ip->k); VM_NEXT();
+        VM_CASE(OP_POW_K): r[ip->dst] = pow(r[ip->a], ip->k); VM_NEXT();
+        VM_CASE(OP_MUL_ADD): r[ip->dst] = r[ip->a] * r[ip->b] + r[ip->c]; VM_NEXT();
+        VM_CASE(OP_MUL_SUB): r[ip->dst] = r[ip->a] * r[ip->b] - r[ip->c]; VM_NEXT();
+        VM_CASE(OP_NMUL_ADD): r[ip->dst] = r[ip->c] - r[ip->a] * r[ip->b]; VM_NEXT();
+        VM_CASE(OP_POWI): r[ip->dst] = calc_powi(r[ip->a], ip->c); VM_NEXT();
+        VM_CASE(OP_HALT):
+            result = r[0];
+            goto done;
+    VM_END
+    
+done:
+    if (r != stack_registers) {
+        free(r);
+    }
+    
+    *error = status;
+    return status == CALC_OK ? result : 0;
+}
+
+// Column evaluation. calc_eval_batch() runs the bytecode over blocks of
+// BATCH_BLOCK rows, so every register holds a block of values and each
+// instruction is a loop over SIMD vectors. With GCC on x86-64 Linux the
+// block kernel is cloned for AVX-512, AVX2 and baseline SSE2, and the
+// loader picks the widest variant the CPU supports.
+#define BATCH_BLOCK 256
+
+#if defined(__GNUC__)
+#define BATCH_LANES 8
+typedef double BatchVector __attribute__((vector_size(BATCH_LANES * sizeof(double)), aligned(8)));
+typedef long long BatchMask __attribute__((vector_size(BATCH_LANES * sizeof(long long)), aligned(8)));
+#else
+#define BATCH_LANES 1
+typedef double BatchVector;
+typedef long long BatchMask;
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define BATCH_TARGETS __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define BATCH_TARGETS
+#endif
+
+#define BATCH_VECTOR(reg) (*(BatchVector *)(r + (size_t)(reg) * BATCH_BLOCK + i))
+#define BATCH_ERRORS (*(BatchMask *)(errors + i))
+#define BATCH_LOOP(body) \
+    for (int i = 0; i < BATCH_BLOCK; i += BATCH_LANES) { body }
+#define BATCH_SCALAR_LOOP(body) \
+    for (int i = 0; i < BATCH_BLOCK; i++) { body }
+#define BATCH_SCALAR(reg) (r[(size_t)(reg) * BATCH_BLOCK + i])
+
+// Vector kernels for the built-in functions in batch mode. Arguments are
+// reduced with Cody-Waite constants and evaluated with Taylor polynomials
+// of high enough degree that truncation error is below rounding error;
+// atan uses the Cephes rational approximation.
+// Maximum error against glibc, sampled over the whole double range:
+//   exp, log        1 ULP
+//   sin, cos        1 ULP for |x| <= 1e5
+//   tan             2 ULP for |x| <= 1e5
+//   atan2           2 ULP
+//   hypot           1 ULP
+//   logb            3 ULP
+//   sqrt, abs, min, max, clamp, fma   exact
+// Blocks holding a larger trig argument, inf or NaN are passed to libm,
+// as are atan2 blocks with a zero, infinite or extreme-ratio argument and
+// hypot blocks that could overflow or underflow. pow calls libm unless
+// the exponent is a small integer.
+// The scalar interpreter keeps calling libm, so batch results for these
+// functions may differ from calc_eval() in the last bit or two.
+#if BATCH_LANES > 1
+
+#define BATCH_INLINE static inline __attribute__((always_inline))
+#define BATCH_SPLAT(value) ((BatchVector){0} + (value))
+#define BATCH_SHIFT 6755399441055744.0   // 1.5 * 2^52: adding it rounds to an integer
+#define BATCH_TRIG_LIMIT 1e5
+
+BATCH_INLINE BatchVector batch_select(BatchMask mask, BatchVector a, BatchVector b) {
+    return (BatchVector)((mask & (BatchMask)a) | (~mask & (BatchMask)b));
+}
+
+BATCH_INLINE BatchVector batch_abs(BatchVector x) {
+    return (BatchVector)((BatchMask)x & 0x7FFFFFFFFFFFFFFFLL);
+}
+
+// Vector extensions have no square root, so x86 uses the baseline SSE2
+// instruction two lanes at a time; it is correctly rounded like sqrt()
+BATCH_INLINE BatchVector batch_sqrt(BatchVector x) {
+#if defined(__SSE2__)
+    BatchVector y;
+    for (int lane = 0; lane < BATCH_LANES; lane += 2) {
+        _mm_storeu_pd((double *)&y + lane, _mm_sqrt_pd(_mm_loadu_pd((const double *)&x + lane)));
+    }
+    return y;
+#else
+    for (int lane = 0; lane < BATCH_LANES; lane++) {
+        x[lane] = sqrt(x[lane]);
+    }
+    return x;
+#endif
+}
+
+BATCH_INLINE BatchVector batch_exp(BatchVector x) {
+    x = batch_select(x > 710.0, BATCH_SPLAT(710.0), x);
+    x = batch_select(x < -746.0, BATCH_SPLAT(-746.0), x);
+    
+    // x = n*ln2 + r with |r| <= ln2/2
+    BatchVector t = x * 1.44269504088896338700e+00 + BATCH_SHIFT;
+    BatchVector n = t - BATCH_SHIFT;
+    BatchMask ni = (BatchMask)t - (BatchMask)BATCH_SPLAT(BATCH_SHIFT);
+    BatchVector r = (x - n * 6.93147180369123816490e-01) - n * 1.90821492927058770002e-10;
+    
+    BatchVector q = BATCH_SPLAT(1.0 / 6227020800.0);
+    q = q * r + 1.0 / 479001600.0;
+    q = q * r + 1.0 / 39916800.0;
+    q = q * r + 1.0 / 3628800.0;
+    q = q * r + 1.0 / 362880.0;
+    q = q * r + 1.0 / 40320.0;
+    q = q * r + 1.0 / 5040.0;
+    q = q * r + 1.0 / 720.0;
+    q = q * r + 1.0 / 120.0;
+    q = q * r + 1.0 / 24.0;
+    q = q * r + 1.0 / 6.0;
+    q = q * r + 0.5;
+    BatchVector p = 1.0 + (r + r * r * q);
+    
+    // Scale by 2^n in two steps so subnormal and overflowing results
+    // round once, like libm
+    BatchMask n1 = ni >> 1;
+    BatchMask n2 = ni - n1;
+    return p * (BatchVector)((n1 + 1023) << 52) * (BatchVector)((n2 + 1023) << 52);
+}
+
+BATCH_INLINE BatchVector batch_log(BatchVector x) {
+    BatchMask subnormal = x < 0x1p-1022;
+    BatchVector y = batch_select(subnormal, x * 0x1p54, x);
+    BatchMask bits = (BatchMask)y;
+    
+    // y = m * 2^k with m in [sqrt(1/2), sqrt(2))
+    BatchMask k = ((bits >> 52) & 0x7FF) - 1023 - (subnormal & 54);
+    BatchVector m = (BatchVector)((bits & 0x000FFFFFFFFFFFFFLL) | 0x3FF0000000000000LL);
+    BatchMask high = m > 1.41421356237309504880;
+    m = batch_select(high, m * 0.5, m);
+    k -= high;
+    BatchVector kd = __builtin_convertvector(k, BatchVector);
+    
+    // With f = m - 1 (exact) and s = f/(2+f), log(m) = 2*atanh(s) =
+    // f - hfsq + s*(hfsq + R) where R = 2s^2/3 + 2s^4/5 + ...
+    BatchVector f = m - 1.0;
+    BatchVector s = f / (2.0 + f);
+    BatchVector z = s * s;
+    BatchVector hfsq = 0.5 * f * f;
+    BatchVector p = BATCH_SPLAT(2.0 / 23.0);
+    p = p * z + 2.0 / 21.0;
+    p = p * z + 2.0 / 19.0;
+    p = p * z + 2.0 / 17.0;
+    p = p * z + 2.0 / 15.0;
+    p = p * z + 2.0 / 13.0;
+    p = p * z + 2.0 / 11.0;
+    p = p * z + 2.0 / 9.0;
+    p = p * z + 2.0 / 7.0;
+    p = p * z + 2.0 / 5.0;
+    p = p * z + 2.0 / 3.0;
+    BatchVector big_r = z * p;
+    BatchVector result = kd * 6.93147180369123816490e-01 -
+                         ((hfsq - (s * (hfsq + big_r) + kd * 1.90821492927058770002e-10)) - f);
+    
+    // log(0) = -inf, log(negative) = NaN, log(inf) = inf, log(NaN) = NaN
+    BatchVector special = batch_select(x == 0, BATCH_SPLAT(-INFINITY),
+                                       batch_select(x < 0, BATCH_SPLAT(NAN), x));
+    return batch_select((x > 0) & (x < INFINITY), result, special);
+}
+
+// Computes sin(x) and cos(x) together; both share the reduction
+// x = n*pi/2 + r with |r| <= pi/4 and differ only by quadrant.
+BATCH_INLINE void batch_sincos(BatchVector x, BatchVector *sin_x, BatchVector *cos_x) {
+    BatchVector t = x * 6.36619772367581382433e-01 + BATCH_SHIFT;
+    BatchVector n = t - BATCH_SHIFT;
+    BatchMask quadrant = (BatchMask)t & 3;
+    
+    // r + lo carries the reduced argument to about 70 bits: the first two
+    // products are exact and the rounding error of their difference is
+    // recovered with TwoSum
+    BatchVector a = x - n * 1.57079632673412561417e+00;
+    BatchVector b = n * 6.07710050630396597660e-11;
+    BatchVector r = a - b;
+    BatchVector bv = r - a;
+    BatchVector lo = ((a - (r - bv)) - (b + bv)) -
+                     n * 2.02226624871116645580e-21 - n * 8.47842766036889956997e-32;
+    BatchVector y = r + lo;
+    lo = lo - (y - r);
+    r = y;
+    BatchVector z = r * r;
+    
+    BatchVector ps = BATCH_SPLAT(1.0 / 355687428096000.0);
+    ps = ps * z - 1.0 / 1307674368000.0;
+    ps = ps * z + 1.0 / 6227020800.0;
+    ps = ps * z - 1.0 / 39916800.0;
+    ps = ps * z + 1.0 / 362880.0;
+    ps = ps * z - 1.0 / 5040.0;
+    ps = ps * z + 1.0 / 120.0;
+    ps = ps * z - 1.0 / 6.0;
+    BatchVector hz = 0.5 * z;
+    BatchVector sin_r = r + (r * z * ps + lo * (1.0 - hz));
+    
+    BatchVector pc = BATCH_SPLAT(1.0 / 20922789888000.0);
+    pc = pc * z - 1.0 / 87178291200.0;
+    pc = pc * z + 1.0 / 479001600.0;
+    pc = pc * z - 1.0 / 3628800.0;
+    pc = pc * z + 1.0 / 40320.0;
+    pc = pc * z - 1.0 / 720.0;
+    pc = pc * z + 1.0 / 24.0;
+    BatchVector w = 1.0 - hz;
+    BatchVector cos_r = w + (((1.0 - w) - hz) + (z * z * pc - r * lo));
+    
+    BatchMask odd = (quadrant & 1) == 1;
+    *sin_x = (BatchVector)((BatchMask)batch_select(odd, cos_r, sin_r) ^ ((quadrant & 2) << 62));
+    *cos_x = (BatchVector)((BatchMask)batch_select(odd, sin_r, cos_r) ^ (((quadrant + 1) & 2) << 62));
+}
+
+BATCH_INLINE BatchVector batch_sin(BatchVector x) {
+    BatchVector s, c;
+    batch_sincos(x, &s, &c);
+    return s;
+}
+
+BATCH_INLINE BatchVector batch_cos(BatchVector x) {
+    BatchVector s, c;
+    batch_sincos(x, &s, &c);
+    return c;
+}
+
+BATCH_INLINE BatchVector batch_tan(BatchVector x) {
+    BatchVector s, c;
+    batch_sincos(x, &s, &c);
+    return s / c;
+}
+
+// The reduction is only accurate for moderate arguments, so a block with
+// any lane outside that range (including inf and NaN) goes to libm
+BATCH_INLINE int batch_trig_in_range(const double *x) {
+    int in_range = 1;
+    for (int i = 0; i < BATCH_BLOCK; i++) {
+        in_range &= fabs(x[i]) <= BATCH_TRIG_LIMIT;
+    }
+    return in_range;
+}
+
+// Cephes: x is reduced to |x| <= 0.66 with atan(x) = pi/2 - atan(1/x)
+// above tan(3pi/8) and pi/4 + atan((x-1)/(x+1)) above 0.66, then a
+// rational approximation is applied
+BATCH_INLINE BatchVector batch_atan(BatchVector x) {
+    BatchMask sign = (BatchMask)x & ~0x7FFFFFFFFFFFFFFFLL;
+    x = batch_abs(x);
+    BatchMask big = x > 2.41421356237309504880;
+    BatchMask middle = ~big & (x > 0.66);
+    BatchVector base = batch_select(big, BATCH_SPLAT(1.57079632679489661923),
+                                    batch_select(middle, BATCH_SPLAT(0.78539816339744830962), BATCH_SPLAT(0)));
+    BatchVector tail = batch_select(big, BATCH_SPLAT(6.123233995736765886130e-17),
+                                    batch_select(middle, BATCH_SPLAT(3.061616997868382943065e-17), BATCH_SPLAT(0)));
+    x = batch_select(big, -1.0 / x, batch_select(middle, (x - 1.0) / (x + 1.0), x));
+    
+    BatchVector z = x * x;
+    BatchVector p = BATCH_SPLAT(-8.750608600031904122785e-01);
+    p = p * z - 1.615753718733365076637e+01;
+    p = p * z - 7.500855792314704667340e+01;
+    p = p * z - 1.228866684490136173410e+02;
+    p = p * z - 6.485021904942025371773e+01;
+    BatchVector q = z + 2.485846490142306297962e+01;
+    q = q * z + 1.650270098316988542046e+02;
+    q = q * z + 4.328810604912902668951e+02;
+    q = q * z + 4.853903996359136964868e+02;
+    q = q * z + 1.945506571482613964425e+02;
+    BatchVector result = base + ((x * (z * p / q) + tail) + x);
+    return (BatchVector)((BatchMask)result ^ sign);
+}
+
+// Left of the y axis the angle is moved by pi, in two parts so the sum
+// is rounded once, toward the sign of y
+BATCH_INLINE BatchVector batch_atan2(BatchVector y, BatchVector x) {
+    BatchVector angle = batch_atan(y / x);
+    BatchMask sign = (BatchMask)y & ~0x7FFFFFFFFFFFFFFFLL;
+    BatchVector pi_high = (BatchVector)((BatchMask)BATCH_SPLAT(3.14159265358979311600e+00) | sign);
+    BatchVector pi_low = (BatchVector)((BatchMask)BATCH_SPLAT(1.22464679914735317723e-16) | sign);
+    return batch_select(x < 0, (angle + pi_low) + pi_high, angle);
+}
+
+// Zeros, infinities and quotients that underflow or overflow need libm's
+// handling of signs and limits
+BATCH_INLINE int batch_atan2_in_range(const double *y, const double *x) {
+    int in_range = 1;
+    for (int i = 0; i < BATCH_BLOCK; i++) {
+        double quotient = fabs(y[i] / x[i]);
+        in_range &= (y[i] != 0) & (x[i] != 0) & (fabs(y[i]) < INFINITY) & (fabs(x[i]) < INFINITY) &
+                    (quotient >= 0x1p-1022) & (quotient < INFINITY);
+    }
+    return in_range;
+}
+
+BATCH_INLINE BatchVector batch_hypot(BatchVector x, BatchVector y) {
+    return batch_sqrt(x * x + y * y);
+}
+
+// The squares neither overflow nor lose bits to underflow below 2^500
+// and above 2^-500
+BATCH_INLINE int batch_hypot_in_range(const double *x, const double *y) {
+    int in_range = 1;
+    for (int i = 0; i < BATCH_BLOCK; i++) {
+        double ax = fabs(x[i]);
+        double ay = fabs(y[i]);
+        in_range &= (ax <= 0x1p500) & (ay <= 0x1p500) &
+                    ((ax >= 0x1p-500) | (ay >= 0x1p-500) | ((ax == 0) & (ay == 0)));
+    }
+    return in_range;
+}
+
+BATCH_INLINE BatchVector batch_min(BatchVector a, BatchVector b) {
+    return batch_select((a < b) | (b != b), a, b);
+}
+
+BATCH_INLINE BatchVector batch_max(BatchVector a, BatchVector b) {
+    return batch_select((a > b) | (b != b), a, b);
+}
+
+BATCH_INLINE BatchVector batch_clamp(BatchVector x, BatchVector low, BatchVector high) {
+    return batch_select(x < low, low, batch_select(x > high, high, x));
+}
+
+// One lane at a time so each result is rounded once; clones whose target
+// has FMA instructions expand the calls inline
+BATCH_INLINE BatchVector batch_fma(BatchVector a, BatchVector b, BatchVector c) {
+    for (int lane = 0; lane < BATCH_LANES; lane++) {
+        a[lane] = fma(a[lane], b[lane], c[lane]);
+    }
+    return a;
+}
+
+#else
+
+#define BATCH_INLINE static inline
+
+BATCH_INLINE BatchVector batch_abs(BatchVector x) { return fabs(x); }
+BATCH_INLINE BatchVector batch_sqrt(BatchVector x) { return sqrt(x); }
+BATCH_INLINE BatchVector batch_exp(BatchVector x) { return exp(x); }
+BATCH_INLINE BatchVector batch_log(BatchVector x) { return log(x); }
+BATCH_INLINE BatchVector batch_sin(BatchVector x) { return sin(x); }
+BATCH_INLINE BatchVector batch_cos(BatchVector x) { return cos(x); }
+BATCH_INLINE BatchVector batch_tan(BatchVector x) { return tan(x); }
+BATCH_INLINE int batch_trig_in_range(const double *x) { (void)x; return 1; }
+BATCH_INLINE BatchVector batch_atan2(BatchVector y, BatchVector x) { return atan2(y, x); }
+BATCH_INLINE int batch_atan2_in_range(const double *y, const double *x) { (void)y; (void)x; return 1; }
+BATCH_INLINE BatchVector batch_hypot(BatchVector x, BatchVector y) { return hypot(x, y); }
+BATCH_INLINE int batch_hypot_in_range(const double *x, const double *y) { (void)x; (void)y; return 1; }
+BATCH_INLINE BatchVector batch_min(BatchVector a, BatchVector b) { return calc_min(a, b); }
+BATCH_INLINE BatchVector batch_max(BatchVector a, BatchVector b) { return calc_max(a, b); }
+BATCH_INLINE BatchVector batch_clamp(BatchVector x, BatchVector low, BatchVector high) {
+    return calc_clamp(x, low, high);
+}
+BATCH_INLINE BatchVector batch_fma(BatchVector a, BatchVector b, BatchVector c) { return fma(a, b, c); }
+
+#endif
+
+// Same multiply chain as calc_powi(), applied to every lane
+BATCH_INLINE BatchVector batch_powi(BatchVector x, int exponent) {
+    unsigned int n = exponent < 0 ? -exponent : exponent;
+    int bit = 0;
+    while (n >> (bit + 1)) {
+        bit++;
+    }
+    
+    BatchVector result = x;
+    for (bit--; bit >= 0; bit--) {
+        result *= result;
+        if ((n >> bit) & 1) {
+            result *= x;
+        }
+    }
+    return exponent < 0 ? 1 / result : result;
+}
+
+// Lanes outside domain, as the scalar check would find them
+BATCH_INLINE BatchMask batch_outside(FunctionDomain domain, BatchVector x) {
+    return domain == DOMAIN_NON_NEGATIVE ? (BatchMask)(x < 0) : (BatchMask)(x <= 0);
+}
+
+BATCH_INLINE BatchVector batch_logb(BatchVector x, BatchVector base) {
+    return batch_log(x) / batch_log(base);
+}
+
+// Registry kernels: each applies one function to whole registers, one per
+// argument. The arguments are given as BATCH_ARGUMENT(n).
+#define BATCH_ARGUMENT(n) (*(const BatchVector *)(x[n] + i))
+#define BATCH_FUNCTION_KERNEL(name, in_range, ...) \
+    BATCH_TARGETS \
+    static int batch_block_##name(double *result, const double *const x[]) { \
+        if (!(in_range)) { \
+            return 0; \
+        } \
+        for (int i = 0; i < BATCH_BLOCK; i += BATCH_LANES) { \
+            *(BatchVector *)(result + i) = batch_##name(__VA_ARGS__); \
+        } \
+        return 1; \
+    }
+
+BATCH_FUNCTION_KERNEL(sin, batch_trig_in_range(x[0]), BATCH_ARGUMENT(0))
+BATCH_FUNCTION_KERNEL(cos, batch_trig_in_range(x[0]), BATCH_ARGUMENT(0))
+BATCH_FUNCTION_KERNEL(tan, batch_trig_in_range(x[0]), BATCH_ARGUMENT(0))
+BATCH_FUNCTION_KERNEL(sqrt, 1, BATCH_ARGUMENT(0))
+BATCH_FUNCTION_KERNEL(log, 1, BATCH_ARGUMENT(0))
+BATCH_FUNCTION_KERNEL(exp, 1, BATCH_ARGUMENT(0))
+BATCH_FUNCTION_KERNEL(abs, 1, BATCH_ARGUMENT(0))
+BATCH_FUNCTION_KERNEL(atan2, batch_atan2_in_range(x[0], x[1]), BATCH_ARGUMENT(0), BATCH_ARGUMENT(1))
+BATCH_FUNCTION_KERNEL(hypot, batch_hypot_in_range(x[0], x[1]), BATCH_ARGUMENT(0), BATCH_ARGUMENT(1))
+BATCH_FUNCTION_KERNEL(min, 1, BATCH_ARGUMENT(0), BATCH_ARGUMENT(1))
+BATCH_FUNCTION_KERNEL(max, 1, BATCH_ARGUMENT(0), BATCH_ARGUMENT(1))
+BATCH_FUNCTION_KERNEL(clamp, 1, BATCH_ARGUMENT(0), BATCH_ARGUMENT(1), BATCH_ARGUMENT(2))
+BATCH_FUNCTION_KERNEL(fma, 1, BATCH_ARGUMENT(0), BATCH_ARGUMENT(1), BATCH_ARGUMENT(2))
+BATCH_FUNCTION_KERNEL(logb, 1, BATCH_ARGUMENT(0), BATCH_ARGUMENT(1))
+
+static const Function functions[FUNCTION_COUNT] = {
+    [FUNCTION_SIN] = {"sin", 1, {.unary = sin}, batch_block_sin, DOMAIN_ALL, CALC_OK,
+                      NODE_CALL, OP_CALL},
+    [FUNCTION_COS] = {"cos", 1, {.unary = cos}, batch_block_cos, DOMAIN_ALL, CALC_OK,
+                      NODE_CALL, OP_CALL},
+    [FUNCTION_TAN] = {"tan", 1, {.unary = tan}, batch_block_tan, DOMAIN_ALL, CALC_OK,
+                      NODE_CALL, OP_CALL},
+    [FUNCTION_SQRT] = {"sqrt", 1, {.unary = sqrt}, batch_block_sqrt, DOMAIN_NON_NEGATIVE,
+                       CALC_ERROR_NEGATIVE_SQRT, NODE_CALL, OP_SQRT},
+    [FUNCTION_LOG] = {"log", 1, {.unary = log}, batch_block_log, DOMAIN_POSITIVE,
+                      CALC_ERROR_NON_POSITIVE_LOG, NODE_CALL, OP_CALL},
+    [FUNCTION_EXP] = {"exp", 1, {.unary = exp}, batch_block_exp, DOMAIN_ALL, CALC_OK,
+                      NODE_CALL, OP_CALL},
+    [FUNCTION_ABS] = {"abs", 1, {.unary = fabs}, batch_block_abs, DOMAIN_ALL, CALC_OK,
+                      NODE_CALL, OP_ABS},
+    [FUNCTION_ATAN2] = {"atan2", 2, {.binary = atan2}, batch_block_atan2, DOMAIN_ALL, CALC_OK,
+                        NODE_CALL, OP_CALL2},
+    [FUNCTION_HYPOT] = {"hypot", 2, {.binary = hypot}, batch_block_hypot, DOMAIN_ALL, CALC_OK,
+                        NODE_CALL, OP_CALL2},
+    [FUNCTION_MIN] = {"min", 2, {.binary = calc_min}, batch_block_min, DOMAIN_ALL, CALC_OK,
+                      NODE_CALL, OP_CALL2},
+    [FUNCTION_MAX] = {"max", 2, {.binary = calc_max}, batch_block_max, DOMAIN_ALL, CALC_OK,
+                      NODE_CALL, OP_CALL2},
+    [FUNCTION_CLAMP] = {"clamp", 3, {.ternary = calc_clamp}, batch_block_clamp, DOMAIN_ALL, CALC_OK,
+                        NODE_CALL, OP_CALL3},
+    [FUNCTION_FMA] = {"fma", 3, {.ternary = fma}, batch_block_fma, DOMAIN_ALL, CALC_OK,
+                      NODE_CALL, OP_CALL3},
+    // The ^ operator, so it shares its folding and integer powers
+    [FUNCTION_POW] = {"pow", 2, {.binary = pow}, NULL, DOMAIN_ALL, CALC_OK, NODE_POWER, OP_POW},
+    [FUNCTION_LOGB] = {"logb", 2, {.binary = calc_logb}, batch_block_logb, DOMAIN_POSITIVE,
+                       CALC_ERROR_NON_POSITIVE_LOG, NODE_CALL, OP_CALL2}
+};
+
+// Evaluates one block of rows. Lanes that hit a math error get a
+// non-zero entry in errors; their values are discarded by the caller.
+BATCH_TARGETS
+static void batch_run_block(const CompiledExpr *expr, double *r, const double *const x[],
+                            size_t offset, int count, long long *errors) {
+    for (const Instruction *ins = expr->code; ins->op != OP_HALT; ins++) {
+        switch (ins->op) {
+            case OP_CONST:
+                BATCH_LOOP(BATCH_VECTOR(ins->dst) = ins->k + (BatchVector){0};)
+                break;
+            case OP_LOAD:
+                memcpy(r + (size_t)ins->dst * BATCH_BLOCK, x[ins->a] + offset, count * sizeof(double));
+                memset(r + (size_t)ins->dst * BATCH_BLOCK + count, 0,
+                       (BATCH_BLOCK - count) * sizeof(double));
+                break;
+            case OP_NEG: BATCH_LOOP(BATCH_VECTOR(ins->dst) = -BATCH_VECTOR(ins->a);) break;
+            case OP_ADD:
+                BATCH_LOOP(BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) + BATCH_VECTOR(ins->b);)
+                break;
+            case OP_SUB:
+                BATCH_LOOP(BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) - BATCH_VECTOR(ins->b);)
+                break;
+            case OP_MUL:
+                BATCH_LOOP(BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) * BATCH_VECTOR(ins->b);)
+                break;
+            case OP_DIV:
+                BATCH_LOOP(
+                    BATCH_ERRORS |= (BatchMask)(BATCH_VECTOR(ins->b) == 0);
+                    BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) / BATCH_VECTOR(ins->b);
+                )
+                break;
+            case OP_MOD:
+                BATCH_LOOP(BATCH_ERRORS |= (BatchMask)(BATCH_VECTOR(ins->b) == 0);)
+                BATCH_SCALAR_LOOP(BATCH_SCALAR(ins->dst) = fmod(BATCH_SCALAR(ins->a), BATCH_SCALAR(ins->b));)
+                break;
+            case OP_POW:
+                BATCH_SCALAR_LOOP(BATCH_SCALAR(ins->dst) = pow(BATCH_SCALAR(ins->a), BATCH_SCALAR(ins->b));)
+                break;
+            case OP_CALL:
+            case OP_CALL2:
+            case OP_CALL3: {
+                // The domain is checked first: dst may be an argument
+                const Function *function = &functions[ins->function];
+                int registers[3] = {ins->a, ins->b, ins->c};
+                const double *args[3];
+                for (int j = 0; j < function->arity; j++) {
+                    if (function->domain != DOMAIN_ALL) {
+                        BATCH_LOOP(BATCH_ERRORS |= batch_outside(function->domain, BATCH_VECTOR(registers[j]));)
+                    }
+                    args[j] = r + (size_t)registers[j] * BATCH_BLOCK;
+                }
+                if (!function->vector(r + (size_t)ins->dst * BATCH_BLOCK, args)) {
+                    BATCH_SCALAR_LOOP(
+                        double values[3];
+                        for (int j = 0; j < function->arity; j++) {
+                            values[j] = BATCH_SCALAR(registers[j]);
+                        }
+                        BATCH_SCALAR(ins->dst) = function_apply(function, values);
+                    )
+                }
+                break;
+            }
+            case OP_SQRT:
+                BATCH_LOOP(
+                    BATCH_ERRORS |= (BatchMask)(BATCH_VECTOR(ins->a) < 0);
+                    BATCH_VECTOR(ins->dst) = batch_sqrt(BATCH_VECTOR(ins->a));
+                )
+                break;
+            case OP_ABS: BATCH_LOOP(BATCH_VECTOR(ins->dst) = batch_abs(BATCH_VECTOR(ins->a));) break;
+            case OP_ADD_K: BATCH_LOOP(BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) + ins->k;) break;
+            case OP_SUB_K: BATCH_LOOP(BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) - ins->k;) break;
+            case OP_RSUB_K: BATCH_LOOP(BATCH_VECTOR(ins->dst) = ins->k - BATCH_VECTOR(ins->a);) break;
+            case OP_MUL_K: BATCH_LOOP(BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) * ins->k;) break;
+            case OP_DIV_K: BATCH_LOOP(BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) / ins->k;) break;
+            case OP_RDIV_K:
+                BATCH_LOOP(
+                    BATCH_ERRORS |= (BatchMask)(BATCH_VECTOR(ins->a) == 0);
+                    BATCH_VECTOR(ins->dst) = ins->k / BATCH_VECTOR(ins->a);
+                )
+                break;
+            case OP_MOD_K:
+                BATCH_SCALAR_LOOP(BATCH_SCALAR(ins->dst) = fmod(BATCH_SCALAR(ins->a), ins->k);)
+                break;
+            case OP_POW_K:
+                BATCH_SCALAR_LOOP(BATCH_SCALAR(ins->dst) = pow(BATCH_SCALAR(ins->a), ins->k);)
+                break;
+            case OP_MUL_ADD:
+                BATCH_LOOP(
+                    BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) * BATCH_VECTOR(ins->b) +
+                                             BATCH_VECTOR(ins->c);
+                )
+                break;
+            case OP_MUL_SUB:
+                BATCH_LOOP(
+                    BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->a) * BATCH_VECTOR(ins->b) -
+                                             BATCH_VECTOR(ins->c);
+                )
+                break;
+            case OP_NMUL_ADD:
+                BATCH_LOOP(
+                    BATCH_VECTOR(ins->dst) = BATCH_VECTOR(ins->c) -
+                                             BATCH_VECTOR(ins->a) * BATCH_VECTOR(ins->b);
+                )
+                break;
+            case OP_POWI: BATCH_LOOP(BATCH_VECTOR(ins->dst) = batch_powi(BATCH_VECTOR(ins->a), ins->c);) break;
+        }
+    }
+}
+
+size_t calc_eval_batch(const CompiledExpr *expr, const double *const x[], size_t n, double *out) {
+    double *r = malloc((size_t)expr->register_count * BATCH_BLOCK * sizeof(double));
+    long long *errors = malloc(BATCH_BLOCK * sizeof(long long));
+    if (!r || !errors) {
+        free(r);
+        free(errors);
+        return (size_t)-1;
+    }
+    
+    size_t failed = 0;
+    
+    for (size_t offset = 0; offset < n; offset += BATCH_BLOCK) {
+        int count = n - offset < BATCH_BLOCK ? (int)(n - offset) : BATCH_BLOCK;
+        
+        memset(errors, 0, BATCH_BLOCK * sizeof(long long));
+        batch_run_block(expr, r, x, offset, count, errors);
+        
+        for (int i = 0; i < count; i++) {
+            if (errors[i]) {
+                out[offset + i] = NAN;
+                failed++;
+            } else {
+                out[offset + i] = r[i];
+            }
+        }
+    }
+    
+    free(r);
+    free(errors);
+    return failed;
+}
+
+static const char *const error_strings[] = {
+    "No error",
+    "Division by zero",
+    "Modulo by zero",
+    "Square root of negative number",
+    "Logarithm of non-positive number",
+    "Unexpected end of expression",
+    "Unexpected character",
+    "Unexpected token",
+    "Expected closing parenthesis",
+    "Unexpected tokens after expression",
+    "Unknown identifier",
+    "Out of memory",
+    "Error reading input",
+    "Read-only name"
+};
+
+const char *calc_error_string(CalcErrorCode code) {
+    if ((unsigned int)code >= sizeof(error_strings) / sizeof(error_strings[0])) {
+        return "Unknown error";
+    }
+    return error_strings[code];
+}
+
+size_t calc_error_format(const CalcError *error, const char *expression, char *buffer, size_t size) {
+    const char *message = calc_error_string(error->code);
+    int quote = expression && (error->code == CALC_ERROR_UNEXPECTED_CHARACTER ||
+                               error->code == CALC_ERROR_UNEXPECTED_TOKEN ||
+                               error->code == CALC_ERROR_UNKNOWN_IDENTIFIER ||
+                               error->code == CALC_ERROR_READ_ONLY);
+    int written;
+    
+    if (quote) {
+        // Long tokens are cut short; the message only has to identify them
+        int length = error->length < 256 ? (int)error->length : 256;
+        written = snprintf(buffer, size, "%s: %.*s", message, length, expression + error->offset);
+    } else {
+        written = snprintf(buffer, size, "%s", message);
+    }
+    return written < 0 ? 0 : (size_t)written;
+}
+
+// Caches. The result and compile caches share one LRU table. It is
+// open-addressed with each slot holding its entry's hash, so a miss
+// usually costs one cache line, and its entries are on a list from most
+// to least recently used. Every byte of the slots, the entries and what
+// they own counts against the cap.
+
+typedef struct CacheEntry {
+    struct CacheEntry *newer;
+    struct CacheEntry *older;
+    unsigned long long hash;
+    double result;                  // Result cache: the outcome
+    CalcErrorCode code;
+    CompiledExpr *expr;             // Compile cache: a reference held by the entry
+    unsigned long long compile_ns;  // and how long compiling it took
+    size_t size;                    // Bytes allocated for the entry
+    size_t charge;                  // Bytes counted against the cap
+    size_t key_length;
+    unsigned char key[];
+} CacheEntry;
+
+typedef struct {
+    unsigned long long hash;
+    CacheEntry *entry;          // NULL for a free slot
+} CacheSlot;
+
+typedef struct {
+    CacheSlot *slots;
+    size_t slot_count;          // A power of two, or 0 before first use
+    CacheEntry *newest;
+    CacheEntry *oldest;
+    size_t entries;             // At most half of slot_count
+    size_t bytes;
+    size_t max_bytes;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+} Cache;
+
+#define CACHE_MIN_SLOTS 64
+
+// Mixes the key eight bytes at a time; the low bits pick the slot, so
+// every round folds the high half of the product back down
+static unsigned long long cache_hash(const unsigned char *key, size_t length) {
+    unsigned long long hash = length * 0x9E3779B97F4A7C15ULL;
+    
+    for (size_t i = 0; i < length; i += 8) {
+        unsigned long long word = 0;
+        memcpy(&word, key + i, length - i < 8 ? length - i : 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+static void cache_unlink(Cache *cache, CacheEntry *entry) {
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+}
+
+static void cache_push(Cache *cache, CacheEntry *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    } else {
+        cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+static CacheEntry *cache_find(Cache *cache, unsigned long long hash, const void *key, size_t length) {
+    size_t mask = cache->slot_count - 1;
+    
+    if (cache->slot_count == 0) {
+        return NULL;
+    }
+    for (size_t i = hash & mask; cache->slots[i].entry; i = (i + 1) & mask) {
+        CacheEntry *entry = cache->slots[i].entry;
+        if (cache->slots[i].hash == hash && entry->key_length == length &&
+            memcmp(entry->key, key, length) == 0) {
+            cache_unlink(cache, entry);
+            cache_push(cache, entry);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void cache_place(CacheSlot *slots, size_t count, unsigned long long hash, CacheEntry *entry) {
+    size_t i = hash & (count - 1);
+    while (slots[i].entry) {
+        i = (i + 1) & (count - 1);
+    }
+    slots[i].hash = hash;
+    slots[i].entry = entry;
+}
+
+// Takes entry out of the table and the list without freeing it. Later
+// slots of the probe run shift back into the hole, so lookups never need
+// tombstones.
+static void cache_remove(Cache *cache, CacheEntry *entry) {
+    size_t mask = cache->slot_count - 1;
+    size_t hole = entry->hash & mask;
+    
+    while (cache->slots[hole].entry != entry) {
+        hole = (hole + 1) & mask;
+    }
+    for (size_t i = (hole + 1) & mask; cache->slots[i].entry; i = (i + 1) & mask) {
+        size_t home = cache->slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            cache->slots[hole] = cache->slots[i];
+            hole = i;
+        }
+    }
+    cache->slots[hole].entry = NULL;
+    
+    cache_unlink(cache, entry);
+    cache->bytes -= entry->charge;
+    cache->entries--;
+}
+
+static void cache_entry_free(CacheEntry *entry) {
+    calc_free(entry->expr);
+    free(entry);
+}
+
+static void cache_evict_oldest(Cache *cache) {
+    CacheEntry *entry = cache->oldest;
+    cache_remove(cache, entry);
+    cache->evictions++;
+    cache_entry_free(entry);
+}
+
+// Doubles the slots, unless that would take the cache over its cap
+static void cache_grow(Cache *cache) {
+    size_t count = cache->slot_count ? cache->slot_count * 2 : CACHE_MIN_SLOTS;
+    size_t size = count * sizeof(CacheSlot);
+    size_t old_size = cache->slot_count * sizeof(CacheSlot);
+    
+    if (cache->bytes - old_size + size > cache->max_bytes) {
+        return;
+    }
+    CacheSlot *slots = calloc(count, sizeof(CacheSlot));
+    if (!slots) {
+        return;
+    }
+    
+    for (size_t i = 0; i < cache->slot_count; i++) {
+        if (cache->slots[i].entry) {
+            cache_place(slots, count, cache->slots[i].hash, cache->slots[i].entry);
+        }
+    }
+    free(cache->slots);
+    cache->slots = slots;
+    cache->slot_count = count;
+    cache->bytes += size - old_size;
+}
+
+// Adds an entry for key, evicting as needed to fit it and extra bytes
+// the caller will hang off it, and returns it for the caller to fill in.
+// Returns NULL when it cannot fit or memory runs out.
+static CacheEntry *cache_insert(Cache *cache, unsigned long long hash, const void *key,
+                                size_t length, size_t extra) {
+    // Sizes are rounded so that entries of similar keys can swap blocks
+    size_t size = (sizeof(CacheEntry) + length + 15) & ~(size_t)15;
+    CacheEntry *entry = NULL;
+    
+    if (2 * (cache->entries + 1) > cache->slot_count) {
+        cache_grow(cache);
+    }
+    if (cache->slot_count == 0 || cache->slot_count * sizeof(CacheSlot) + size + extra > cache->max_bytes) {
+        return NULL;    // Would not fit even in an empty cache
+    }
+    
+    // Make room, keeping an evicted block of the right size for reuse
+    while (cache->entries > 0 && (cache->bytes + size + extra > cache->max_bytes ||
+                                  2 * (cache->entries + 1) > cache->slot_count)) {
+        CacheEntry *oldest = cache->oldest;
+        cache_remove(cache, oldest);
+        cache->evictions++;
+        if (!entry && oldest->size == size) {
+            calc_free(oldest->expr);
+            entry = oldest;
+        } else {
+            cache_entry_free(oldest);
+        }
+    }
+    if (!entry && !(entry = malloc(size))) {
+        return NULL;
+    }
+    
+    entry->hash = hash;
+    entry->expr = NULL;
+    entry->compile_ns = 0;
+    entry->size = size;
+    entry->charge = size + extra;
+    entry->key_length = length;
+    memcpy(entry->key, key, length);
+    
+    cache_place(cache->slots, cache->slot_count, hash, entry);
+    cache_push(cache, entry);
+    cache->bytes += entry->charge;
+    cache->entries++;
+    return entry;
+}
+
+// Frees every entry and the slots; the cap and counters stay
+static void cache_clear(Cache *cache) {
+    while (cache->oldest) {
+        CacheEntry *entry = cache->oldest;
+        cache->oldest = entry->newer;
+        cache_entry_free(entry);
+    }
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->slot_count = 0;
+    cache->newest = NULL;
+    cache->entries = 0;
+    cache->bytes = 0;
+}
+
+static void cache_set_limit(Cache *cache, size_t max_bytes) {
+    cache->max_bytes = max_bytes;
+    while (cache->entries > 0 && cache->bytes > max_bytes) {
+        cache_evict_oldest(cache);
+    }
+    if (cache->bytes > max_bytes) {
+        cache_clear(cache);     // The empty slots alone are over the cap
+    }
+}
+
+static void cache_stats_add(const Cache *cache, CalcCacheStats *stats) {
+    stats->hits += cache->hits;
+    stats->misses += cache->misses;
+    stats->evictions += cache->evictions;
+    stats->entries += cache->entries;
+    stats->bytes += cache->bytes;
+    stats->max_bytes += cache->max_bytes;
+}
+
+// Result cache. Entries are keyed by the expression's token stream, which
+// is cheap to produce next to parsing and folding and already erases
+// spacing and the spelling of literals. Reordering commutative operands
+// would take a parse, which is most of what a hit saves, so it is not
+// attempted.
+
+typedef struct {
+    Cache table;
+    unsigned char *key;         // Key of the expression being evaluated
+    size_t key_capacity;
+    Token *tokens;              // Its tokens, replayed to the parser on a miss
+    size_t token_capacity;
+} ResultCache;
+
+// Makes room for a key of size bytes
+static int cache_key_reserve(ResultCache *cache, size_t size) {
+    size_t capacity = cache->key_capacity ? cache->key_capacity : 256;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    unsigned char *key = realloc(cache->key, capacity);
+    if (!key) {
+        return 0;
+    }
+    cache->key = key;
+    cache->key_capacity = capacity;
+    return 1;
+}
+
+// Spells the source's tokens into cache->key: one byte per token, plus
+// the bits of each number's value or function's id. The tokens
+// themselves are kept in cache->tokens so a miss need not scan the
+// source again. Returns 0 for sources that cannot be cached: those that
+// do not lex cleanly or name a variable.
+static int cache_key(ResultCache *cache, Lexer *lexer, size_t *length) {
+    size_t used = 0;
+    
+    for (size_t count = 0;; count++) {
+        lexer_advance(lexer);
+        const Token *token = &lexer->current;
+        
+        if (token->type == TOKEN_ERROR || token->type == TOKEN_IDENTIFIER) {
+            return 0;
+        }
+        if (count == cache->token_capacity) {
+            size_t capacity = count ? count * 2 : 64;
+            Token *tokens = realloc(cache->tokens, capacity * sizeof(Token));
+            if (!tokens) {
+                return 0;
+            }
+            cache->tokens = tokens;
+            cache->token_capacity = capacity;
+        }
+        cache->tokens[count] = *token;
+        
+        if (token->type == TOKEN_EOF) {
+            *length = used;
+            return 1;
+        }
+        if (cache->key_capacity - used < 1 + sizeof(double) &&
+            !cache_key_reserve(cache, used + 1 + sizeof(double))) {
+            return 0;
+        }
+        cache->key[used++] = (unsigned char)token->type;
+        if (token->type == TOKEN_NUMBER || token->type == TOKEN_FUNCTION) {
+            memcpy(cache->key + used, &token->value, sizeof(double));
+            used += sizeof(double);
+        }
+    }
+}
+
+static void result_cache_free(ResultCache *cache) {
+    cache_clear(&cache->table);
+    free(cache->key);
+    free(cache->tokens);
+    cache->key = NULL;
+    cache->key_capacity = 0;
+    cache->tokens = NULL;
+    cache->token_capacity = 0;
+}
+
+struct CalcContext {
+    CalcError error;    // Outcome of the last calc_evaluate()
+    Parser parser;      // Kept warm between calls
+    ResultCache cache;
+    VariableTable variables;
+    FunctionTable functions;
+    int defined;        // Function the last calc_evaluate() defined, or -1
+    CalcStore *store;               // Consulted before parsing, if set
+    unsigned char *store_buffer;    // Holds the record being evaluated
+    size_t store_capacity;
+    unsigned char *store_pending;   // Records not yet added to store
+    size_t store_pending_size;
+    size_t store_pending_capacity;
+};
+
+CalcContext *calc_context_new(void) {
+    CalcContext *ctx = malloc(sizeof(CalcContext));
+    if (ctx) {
+        ctx->error.code = CALC_OK;
+        parser_init(&ctx->parser);
+        memset(&ctx->cache, 0, sizeof(ctx->cache));
+        memset(&ctx->variables, 0, sizeof(ctx->variables));
+        if (variables_define(&ctx->variables, "ans", 3) != 0) {
+            variables_release(&ctx->variables);
+            free(ctx);
+            return NULL;
+        }
+        memset(&ctx->functions, 0, sizeof(ctx->functions));
+        ctx->defined = -1;
+        ctx->store = NULL;
+        ctx->store_buffer = NULL;
+        ctx->store_capacity = 0;
+        ctx->store_pending = NULL;
+        ctx->store_pending_size = 0;
+        ctx->store_pending_capacity = 0;
+    }
+    return ctx;
+}
+
+void calc_context_free(CalcContext *ctx) {
+    if (ctx) {
+        parser_release(&ctx->parser);
+        calc_set_store(ctx, NULL);     // Adds what is still pending
+        result_cache_free(&ctx->cache);
+        variables_release(&ctx->variables);
+        functions_release(&ctx->functions);
+        free(ctx->store_buffer);
+        free(ctx->store_pending);
+        free(ctx);
+    }
+}
+
+void calc_set_result_cache(CalcContext *ctx, size_t max_bytes) {
+    cache_set_limit(&ctx->cache.table, max_bytes);
+    if (max_bytes == 0) {
+        result_cache_free(&ctx->cache);
+    }
+}
+
+void calc_result_cache_stats(const CalcContext *ctx, CalcCacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    cache_stats_add(&ctx->cache.table, stats);
+}
+
+// Compile cache. Source text maps to a shared compiled expression. The
+// text is matched exactly, since variable names and error spans depend on
+// it. The table is split into shards, each behind its own lock and picked
+// by the top bits of the hash, so threads looking up different
+// expressions rarely wait on each other. An entry holds a reference to its
+// expression and every hit hands out another, so eviction never frees an
+// expression still in use.
+
+#define COMPILE_CACHE_SHARD_BITS 4
+#define COMPILE_CACHE_SHARDS (1 << COMPILE_CACHE_SHARD_BITS)
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;  // Shards never share a cache line
+    Cache table;
+    unsigned long long saved_ns;        // Compile time of every hit's entry
+} CompileShard;
+
+struct CalcCompileCache {
+    CompileShard shards[COMPILE_CACHE_SHARDS];
+    int jit;
+};
+
+// Memory held by a compiled expression, charged to its cache entry
+static size_t compiled_size(const CompiledExpr *expr) {
+    size_t size = sizeof(CompiledExpr) + (size_t)expr->code_count * sizeof(Instruction) +
+                  expr->jit_size + (size_t)expr->variable_count * sizeof(char *);
+    
+    for (int i = 0; i < expr->variable_count; i++) {
+        size += strlen(expr->variables[i]) + 1;
+    }
+    return size;
+}
+
+static unsigned long long monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+CalcCompileCache *calc_compile_cache_new(size_t max_bytes, int jit) {
+    CalcCompileCache *cache = aligned_alloc(_Alignof(CalcCompileCache), sizeof(CalcCompileCache));
+    if (!cache) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(*cache));
+    
+    cache->jit = jit;
+    for (int i = 0; i < COMPILE_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].table.max_bytes = max_bytes / COMPILE_CACHE_SHARDS;
+    }
+    return cache;
+}
+
+void calc_compile_cache_free(CalcCompileCache *cache) {
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < COMPILE_CACHE_SHARDS; i++) {
+        cache_clear(&cache->shards[i].table);
+        pthread_mutex_destroy(&cache->shards[i].lock);
+    }
+    free(cache);
+}
+
+CompiledExpr *calc_compile_cached(CalcCompileCache *cache, const char *expression, CalcError *error) {
+    size_t length = strlen(expression);
+    unsigned long long hash = cache_hash((const unsigned char *)expression, length);
+    CompileShard *shard = &cache->shards[hash >> (64 - COMPILE_CACHE_SHARD_BITS)];
+    
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry *entry = cache_find(&shard->table, hash, expression, length);
+    if (entry) {
+        CompiledExpr *expr = compiled_retain(entry->expr);
+        shard->table.hits++;
+        shard->saved_ns += entry->compile_ns;
+        pthread_mutex_unlock(&shard->lock);
+        
+        error->code = CALC_OK;
+        error->offset = 0;
+        error->length = 0;
+        return expr;
+    }
+    shard->table.misses++;
+    pthread_mutex_unlock(&shard->lock);
+    
+    // Compile outside the lock so that one slow expression does not stall
+    // the shard; the JIT runs now since the expression is about to be shared
+    unsigned long long start = monotonic_ns();
+    CompiledExpr *expr = calc_compile(expression, error);
+    if (!expr) {
+        return NULL;
+    }
+    if (cache->jit) {
+        calc_jit(expr);
+    }
+    unsigned long long elapsed = monotonic_ns() - start;
+    
+    // Another thread may have added the same text meanwhile; if so this
+    // copy is returned without being cached
+    pthread_mutex_lock(&shard->lock);
+    if (!cache_find(&shard->table, hash, expression, length)) {
+        entry = cache_insert(&shard->table, hash, expression, length, compiled_size(expr));
+        if (entry) {
+            entry->expr = compiled_retain(expr);
+            entry->compile_ns = elapsed;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return expr;
+}
+
+void calc_compile_cache_stats(CalcCompileCache *cache, CalcCacheStats *stats) {
+    unsigned long long saved_ns = 0;
+    
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < COMPILE_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&cache->shards[i].lock);
+        cache_stats_add(&cache->shards[i].table, stats);
+        saved_ns += cache->shards[i].saved_ns;
+        pthread_mutex_unlock(&cache->shards[i].lock);
+    }
+    stats->seconds_saved = saved_ns / 1e9;
+}
+
+// Compiled-expression store: a file that lets a fresh process reuse what
+// earlier ones compiled. It is mapped whole and holds a header, a table of
+// slots and the records appended after them. A slot packs the top half of
+// its key's hash with the record's offset in 8-byte units, so a single
+// 64-bit store publishes an entry. Records never change once published;
+// when the file fills up it is emptied and filled again.
+//
+// Readers take no locks. They copy a record out and check its checksum
+// and key, so a record torn by a concurrent reset or a crash reads as a
+// miss. Writers hold a mutex against other threads and an fcntl() lock
+// against other processes. Instructions are stored as they lie in memory,
+// so the header records their layout, and a file written by a different
+// build is started afresh.
+
+#define STORE_MAGIC "CALCSTOR"
+#define STORE_VERSION 1
+#define STORE_MIN_SLOTS 64
+#define STORE_MIN_BYTES 65536
+#define STORE_MAX_BYTES ((size_t)UINT32_MAX * 8)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;            // Instruction size, opcode and function counts
+    uint64_t capacity;          // Size of the file
+    uint64_t slot_count;        // A power of two
+    uint64_t checksum;          // Of the fields above
+    _Atomic uint64_t used;      // End of the last record
+    _Atomic uint64_t entries;
+} StoreHeader;
+
+// A record is followed by its source text padded to 8 bytes, its
+// instructions and its variable names, each ending in a NUL.
+typedef struct {
+    uint64_t checksum;          // Of the rest of the record
+    uint64_t hash;              // Of the source text
+    uint32_t size;              // A multiple of 8
+    uint32_t key_length;
+    int32_t code_count;
+    int32_t register_count;
+    int32_t variable_count;
+    int32_t nodes_eliminated;
+    uint64_t variable_offset;
+} StoreRecord;
+
+struct CalcStore {
+    int fd;
+    StoreHeader *header;        // The whole file
+    size_t size;
+    _Atomic uint64_t *slots;
+    size_t slot_count;
+    size_t data;                // Where records start
+    pthread_mutex_t lock;       // fcntl() locks do not exclude threads of one process
+    atomic_ullong hits;
+    atomic_ullong misses;
+    atomic_ullong evictions;
+};
+
+static uint32_t store_layout(void) {
+    return (uint32_t)sizeof(Instruction) | (uint32_t)(OP_POWI + 1) << 8 |
+           (uint32_t)FUNCTION_COUNT << 16;
+}
+
+static unsigned long long store_header_checksum(const StoreHeader *header) {
+    return cache_hash((const unsigned char *)header, offsetof(StoreHeader, checksum));
+}
+
+static int store_header_valid(const StoreHeader *header, size_t size) {
+    return memcmp(header->magic, STORE_MAGIC, 8) == 0 && header->version == STORE_VERSION &&
+           header->layout == store_layout() && header->capacity == size &&
+           header->checksum == store_header_checksum(header) &&
+           header->slot_count >= STORE_MIN_SLOTS && (header->slot_count & (header->slot_count - 1)) == 0 &&
+           header->slot_count < (size - sizeof(StoreHeader)) / sizeof(uint64_t);
+}
+
+static int store_lock(int fd, short type) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    
+    while (fcntl(fd, F_SETLKW, &lock) == -1) {
+        if (errno != EINTR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Empties the store; writers only
+static void store_reset(CalcStore *store) {
+    for (size_t i = 0; i < store->slot_count; i++) {
+        atomic_store_explicit(&store->slots[i], 0, memory_order_relaxed);
+    }
+    atomic_store(&store->header->used, store->data);
+    atomic_store(&store->header->entries, 0);
+}
+
+// Writes a fresh header into the file, which is never shrunk: other
+// processes may still have the old one mapped
+static StoreHeader *store_create(int fd, size_t capacity, size_t size) {
+    size_t slot_count = STORE_MIN_SLOTS;
+    
+    if (capacity < size) {
+        capacity = size;
+    }
+    if (capacity < STORE_MIN_BYTES) {
+        capacity = STORE_MIN_BYTES;
+    } else if (capacity > STORE_MAX_BYTES) {
+        capacity = STORE_MAX_BYTES;
+    }
+    capacity &= ~(size_t)7;
+    while (slot_count * 2 <= capacity / 256) {
+        slot_count *= 2;   // Room for records of 128 bytes at half load
+    }
+    
+    if (capacity != size && ftruncate(fd, (off_t)capacity) != 0) {
+        return MAP_FAILED;
+    }
+    StoreHeader *header = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        return header;
+    }
+    
+    memcpy(header->magic, STORE_MAGIC, 8);
+    header->version = STORE_VERSION;
+    header->layout = store_layout();
+    header->capacity = capacity;
+    header->slot_count = slot_count;
+    header->checksum = store_header_checksum(header);
+    return header;
+}
+
+CalcStore *calc_store_open(const char *path, size_t capacity) {
+    CalcStore *store = calloc(1, sizeof(CalcStore));
+    StoreHeader *header = MAP_FAILED;
+    struct stat info;
+    int created = 0;
+    
+    if (!store) {
+        return NULL;
+    }
+    store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (store->fd < 0) {
+        free(store);
+        return NULL;
+    }
+    
+    // The header is checked and, if need be, rewritten under the write
+    // lock, so two processes never set the file up at once
+    if (store_lock(store->fd, F_WRLCK)) {
+        if (fstat(store->fd, &info) == 0 && info.st_size >= 0 && (uint64_t)info.st_size <= STORE_MAX_BYTES) {
+            store->size = (size_t)info.st_size;
+            if (store->size >= sizeof(StoreHeader)) {
+                header = mmap(NULL, store->size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+            }
+            if (header != MAP_FAILED && !store_header_valid(header, store->size)) {
+                munmap(header, store->size);
+                header = MAP_FAILED;
+            }
+            if (header == MAP_FAILED) {
+                header = store_create(store->fd, capacity, store->size);
+                created = 1;
+            }
+        }
+        if (header != MAP_FAILED) {
+            store->header = header;
+            store->size = header->capacity;
+            store->slots = (_Atomic uint64_t *)(header + 1);
+            store->slot_count = header->slot_count;
+            store->data = sizeof(StoreHeader) + store->slot_count * sizeof(uint64_t);
+            if (created) {
+                store_reset(store);
+            }
+        }
+        store_lock(store->fd, F_UNLCK);
+    }
+    if (header == MAP_FAILED) {
+        close(store->fd);
+        free(store);
+        return NULL;
+    }
+    
+    pthread_mutex_init(&store->lock, NULL);
+    atomic_init(&store->hits, 0);
+    atomic_init(&store->misses, 0);
+    atomic_init(&store->evictions, 0);
+    return store;
+}
+
+void calc_store_close(CalcStore *store) {
+    if (!store) {
+        return;
+    }
+    munmap(store->header, store->size);
+    close(store->fd);
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+}
+
+// Checks that code only touches its own registers and variables, so that
+// even a record that passed its checksum cannot lead calc_eval() astray
+static int store_code_valid(const Instruction *code, int count, int registers, int variables) {
+    for (int i = 0; i < count; i++) {
+        const Instruction *ins = &code[i];
+        
+        if (ins->op < OP_HALT || ins->op > OP_POWI || (ins->op == OP_HALT) != (i == count - 1)) {
+            return 0;
+        }
+        if (ins->op == OP_HALT) {
+            break;
+        }
+        if (ins->dst < 0 || ins->dst >= registers) {
+            return 0;
+        }
+        
+        switch (ins->op) {
+            case OP_CONST:
+                break;
+            case OP_INVOKE:
+                // Its callees live in the context that compiled it
+                return 0;
+            case OP_CALL:
+            case OP_CALL2:
+            case OP_CALL3:
+                // The opcode must be the one the function compiles to,
+                // which also fixes its arity
+                if (ins->function < 0 || ins->function >= FUNCTION_COUNT ||
+                    functions[ins->function].op != ins->op) {
+                    return 0;
+                }
+                if ((ins->op == OP_CALL3 && (ins->c < 0 || ins->c >= registers)) ||
+                    (ins->op != OP_CALL && (ins->b < 0 || ins->b >= registers)) ||
+                    ins->a < 0 || ins->a >= registers) {
+                    return 0;
+                }
+                break;
+            case OP_LOAD:
+                if (ins->a < 0 || ins->a >= variables) {
+                    return 0;
+                }
+                break;
+            case OP_MUL_ADD:
+            case OP_MUL_SUB:
+            case OP_NMUL_ADD:
+                if (ins->c < 0 || ins->c >= registers) {
+                    return 0;
+                }
+                // Fall through
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_POW:
+                if (ins->b < 0 || ins->b >= registers) {
+                    return 0;
+                }
+                // Fall through
+            default:
+                if (ins->a < 0 || ins->a >= registers) {
+                    return 0;
+                }
+                break;
+        }
+    }
+    return 1;
+}
+
+static size_t store_code_offset(size_t key_length) {
+    return sizeof(StoreRecord) + ((key_length + 7) & ~(size_t)7);
+}
+
+// Checks a copied record from its checksum down to its names
+static int store_record_valid(const StoreRecord *record) {
+    const char *bytes = (const char *)record;
+    size_t size = record->size;
+    
+    if (record->checksum != cache_hash((const unsigned char *)bytes + 8, size - 8) ||
+        record->key_length > size || record->code_count < 1 || record->register_count < 1 ||
+        record->register_count > record->code_count || record->variable_count < 0) {
+        return 0;
+    }
+    size_t names = store_code_offset(record->key_length);
+    if (names > size || (size - names) / sizeof(Instruction) < (size_t)record->code_count) {
+        return 0;
+    }
+    const Instruction *code = (const Instruction *)(bytes + names);
+    names += (size_t)record->code_count * sizeof(Instruction);
+    
+    for (int i = 0; i < record->variable_count; i++) {
+        const char *end = memchr(bytes + names, '\0', size - names);
+        if (!end) {
+            return 0;
+        }
+        names = (size_t)(end - bytes) + 1;
+    }
+    return store_code_valid(code, record->code_count, record->register_count, record->variable_count);
+}
+
+// Looks text up without locking and copies its record into *buffer,
+// growing it as needed. Returns the copy, or NULL if there is no sound
+// record for text.
+static const StoreRecord *store_find(CalcStore *store, unsigned long long hash, const char *text,
+                                     size_t length, unsigned char **buffer, size_t *capacity) {
+    const unsigned char *base = (const unsigned char *)store->header;
+    size_t mask = store->slot_count - 1;
+    uint64_t tag = hash & ~(uint64_t)UINT32_MAX;
+    
+    for (size_t i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+        uint64_t slot = atomic_load_explicit(&store->slots[i], memory_order_acquire);
+        if (slot == 0) {
+            return NULL;
+        }
+        size_t offset = (size_t)(slot & UINT32_MAX) * 8;
+        if ((slot & ~(uint64_t)UINT32_MAX) != tag || offset < store->data ||
+            offset > store->size - sizeof(StoreRecord)) {
+            continue;
+        }
+        
+        StoreRecord head;
+        memcpy(&head, base + offset, sizeof(head));
+        if (head.hash != hash || head.key_length != length || head.size < sizeof(StoreRecord) ||
+            head.size % 8 != 0 || head.size > store->size - offset) {
+            continue;
+        }
+        if (head.size > *capacity) {
+            unsigned char *grown = realloc(*buffer, head.size);
+            if (!grown) {
+                return NULL;
+            }
+            *buffer = grown;
+            *capacity = head.size;
+        }
+        
+        // The copy is checked rather than the file, which may change under us
+        memcpy(*buffer, base + offset, head.size);
+        const StoreRecord *record = (const StoreRecord *)*buffer;
+        if (record->size == head.size && record->hash == hash && record->key_length == length &&
+            store_record_valid(record) && memcmp(record + 1, text, length) == 0) {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+// Finds where text goes: returns 1 if a sound record for it is already
+// there, or 0 and sets *slot to a free slot or to one whose record for
+// text is damaged. Writers only, so records hold still.
+static int store_probe(CalcStore *store, unsigned long long hash, const char *text, size_t length, size_t *slot) {
+    const unsigned char *base = (const unsigned char *)store->header;
+    size_t mask = store->slot_count - 1;
+    uint64_t tag = hash & ~(uint64_t)UINT32_MAX;
+    size_t i = hash & mask;
+    
+    for (uint64_t value; (value = atomic_load_explicit(&store->slots[i], memory_order_relaxed)); i = (i + 1) & mask) {
+        size_t offset = (size_t)(value & UINT32_MAX) * 8;
+        if ((value & ~(uint64_t)UINT32_MAX) == tag && offset >= store->data &&
+            offset <= store->size - sizeof(StoreRecord) && length <= store->size - sizeof(StoreRecord) - offset) {
+            const StoreRecord *record = (const StoreRecord *)(base + offset);
+            if (record->hash == hash && record->key_length == length && memcmp(record + 1, text, length) == 0) {
+                *slot = i;
+                return record->size >= sizeof(StoreRecord) + length && record->size % 8 == 0 &&
+                       record->size <= store->size - offset && store_record_valid(record);
+            }
+        }
+    }
+    *slot = i;
+    return 0;
+}
+
+static size_t store_record_size(size_t length, const CompiledExpr *expr) {
+    size_t size = store_code_offset(length) + (size_t)expr->code_count * sizeof(Instruction);
+    for (int i = 0; i < expr->variable_count; i++) {
+        size += strlen(expr->variables[i]) + 1;
+    }
+    return (size + 7) & ~(size_t)7;
+}
+
+// Writes the record for text and expr, checksum and all, into at
+static void store_record_write(unsigned char *at, size_t size, unsigned long long hash, const char *text,
+                               size_t length, const CompiledExpr *expr) {
+    size_t code_offset = store_code_offset(length);
+    size_t code_size = (size_t)expr->code_count * sizeof(Instruction);
+    StoreRecord record;
+    
+    record.hash = hash;
+    record.size = (uint32_t)size;
+    record.key_length = (uint32_t)length;
+    record.code_count = expr->code_count;
+    record.register_count = expr->register_count;
+    record.variable_count = expr->variable_count;
+    record.nodes_eliminated = expr->nodes_eliminated;
+    record.variable_offset = expr->variable_offset;
+    memset(at, 0, size);
+    memcpy(at, &record, sizeof(record));
+    memcpy(at + sizeof(record), text, length);
+    memcpy(at + code_offset, expr->code, code_size);
+    
+    unsigned char *name = at + code_offset + code_size;
+    for (int i = 0; i < expr->variable_count; i++) {
+        size_t name_size = strlen(expr->variables[i]) + 1;
+        memcpy(name, expr->variables[i], name_size);
+        name += name_size;
+    }
+    record.checksum = cache_hash(at + 8, size - 8);
+    memcpy(at, &record.checksum, sizeof(record.checksum));
+}
+
+// Publishes records laid end to end in [records, records + size), skipping
+// any whose text another writer got in first. Taking the locks costs
+// system calls, so callers gather records and hand them over together.
+static void store_append(CalcStore *store, const unsigned char *records, size_t size) {
+    pthread_mutex_lock(&store->lock);
+    if (!store_lock(store->fd, F_WRLCK)) {
+        pthread_mutex_unlock(&store->lock);
+        return;
+    }
+    
+    // A different build may have taken the file over since it was opened
+    StoreHeader *header = store->header;
+    for (size_t offset = 0; offset < size && store_header_valid(header, store->size); ) {
+        const StoreRecord *record = (const StoreRecord *)(records + offset);
+        const char *text = (const char *)(record + 1);
+        size_t slot;
+        offset += record->size;
+        
+        if (store_probe(store, record->hash, text, record->key_length, &slot)) {
+            continue;
+        }
+        uint64_t used = atomic_load(&header->used);
+        uint64_t entries = atomic_load(&header->entries);
+        if (used < store->data || used > store->size - record->size || 2 * (entries + 1) > store->slot_count) {
+            atomic_fetch_add(&store->evictions, entries);
+            store_reset(store);
+            used = store->data;
+            entries = 0;
+            store_probe(store, record->hash, text, record->key_length, &slot);
+        }
+        
+        memcpy((unsigned char *)header + used, record, record->size);
+        atomic_store(&header->used, used + record->size);
+        if (atomic_load_explicit(&store->slots[slot], memory_order_relaxed) == 0) {
+            atomic_store(&header->entries, entries + 1);
+        }
+        atomic_store_explicit(&store->slots[slot], (record->hash & ~(uint64_t)UINT32_MAX) | used / 8,
+                              memory_order_release);
+    }
+    
+    store_lock(store->fd, F_UNLCK);
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Whether a record of size bytes fits in the store at all
+static int store_fits(const CalcStore *store, size_t length, size_t size) {
+    return length <= UINT32_MAX && size <= store->size - store->data;
+}
+
+// Builds a standalone expression from a checked record
+static CompiledExpr *store_load(const StoreRecord *record) {
+    const char *bytes = (const char *)record;
+    size_t code_offset = store_code_offset(record->key_length);
+    size_t code_size = (size_t)record->code_count * sizeof(Instruction);
+    
+    CompiledExpr *expr = calloc(1, sizeof(CompiledExpr));
+    if (!expr) {
+        return NULL;
+    }
+    atomic_init(&expr->references, 1);
+    expr->code = malloc(code_size);
+    expr->variables = malloc((record->variable_count + 1) * sizeof(char *));
+    if (!expr->code || !expr->variables) {
+        calc_free(expr);
+        return NULL;
+    }
+    memcpy(expr->code, bytes + code_offset, code_size);
+    expr->code_count = record->code_count;
+    expr->register_count = record->register_count;
+    expr->nodes_eliminated = record->nodes_eliminated;
+    expr->variable_offset = (size_t)record->variable_offset;
+    
+    const char *name = bytes + code_offset + code_size;
+    for (int i = 0; i < record->variable_count; i++) {
+        size_t name_size = strlen(name) + 1;
+        expr->variables[i] = malloc(name_size);
+        if (!expr->variables[i]) {
+            calc_free(expr);
+            return NULL;
+        }
+        memcpy(expr->variables[i], name, name_size);
+        expr->variable_count++;
+        name += name_size;
+    }
+    return expr;
+}
+
+CompiledExpr *calc_compile_stored(CalcStore *store, const char *expression, CalcError *error) {
+    size_t length = strlen(expression);
+    unsigned long long hash = cache_hash((const unsigned char *)expression, length);
+    unsigned char *buffer = NULL;
+    size_t capacity = 0;
+    CompiledExpr *expr;
+    
+    const StoreRecord *record = store_find(store, hash, expression, length, &buffer, &capacity);
+    if (record) {
+        atomic_fetch_add_explicit(&store->hits, 1, memory_order_relaxed);
+        expr = store_load(record);
+        error->code = expr ? CALC_OK : CALC_ERROR_OUT_OF_MEMORY;
+        error->offset = 0;
+        error->length = 0;
+    } else {
+        atomic_fetch_add_explicit(&store->misses, 1, memory_order_relaxed);
+        expr = calc_compile(expression, error);
+        size_t size = expr ? store_record_size(length, expr) : 0;
+        if (expr && store_fits(store, length, size)) {
+            unsigned char *record = size > capacity ? malloc(size) : buffer;
+            if (record) {
+                store_record_write(record, size, hash, expression, length, expr);
+                store_append(store, record, size);
+            }
+            if (record != buffer) {
+                free(record);
+            }
+        }
+    }
+    
+    free(buffer);
+    return expr;
+}
+
+void calc_store_stats(CalcStore *store, CalcCacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->hits = atomic_load(&store->hits);
+    stats->misses = atomic_load(&store->misses);
+    stats->evictions = atomic_load(&store->evictions);
+    stats->entries = (size_t)atomic_load(&store->header->entries);
+    stats->bytes = (size_t)atomic_load(&store->header->used);
+    stats->max_bytes = store->size;
+}
+
+// A context gathers its additions and hands them over in batches of
+// about this many bytes
+#define STORE_PENDING_BYTES (16 << 10)
+
+static void store_flush(CalcContext *ctx) {
+    if (ctx->store_pending_size > 0) {
+        store_append(ctx->store, ctx->store_pending, ctx->store_pending_size);
+        ctx->store_pending_size = 0;
+    }
+}
+
+// Queues expr to be added as the record for text
+static void store_add(CalcContext *ctx, unsigned long long hash, const char *text, size_t length,
+                      const CompiledExpr *expr) {
+    size_t size = store_record_size(length, expr);
+    if (!store_fits(ctx->store, length, size)) {
+        return;
+    }
+    
+    if (size > ctx->store_pending_capacity - ctx->store_pending_size) {
+        store_flush(ctx);
+        if (size > ctx->store_pending_capacity) {
+            size_t capacity = size > STORE_PENDING_BYTES ? size : STORE_PENDING_BYTES;
+            unsigned char *pending = realloc(ctx->store_pending, capacity);
+            if (!pending) {
+                return;
+            }
+            ctx->store_pending = pending;
+            ctx->store_pending_capacity = capacity;
+        }
+    }
+    store_record_write(ctx->store_pending + ctx->store_pending_size, size, hash, text, length, expr);
+    ctx->store_pending_size += size;
+}
+
+void calc_set_store(CalcContext *ctx, CalcStore *store) {
+    if (ctx->store) {
+        store_flush(ctx);
+    }
+    ctx->store = store;
+}
+
+// Compiles with the context's parser and, when the optimizer has folded
+// the whole expression to a number, returns it without generating code.
+// Identifiers must name the context's variables or functions.
+static double evaluate(CalcContext *ctx, Lexer *lexer, CalcError *error) {
+    Parser *parser = &ctx->parser;
+    ResultCache *cache = &ctx->cache;
+    CompiledExpr expr;
+    double result = 0;
+    int cacheable = 0;
+    unsigned long long hash = 0;
+    size_t key_length = 0;
+    const StoreRecord *record = NULL;
+    const char *text = lexer->input + lexer->position;
+    unsigned long long text_hash = 0;
+    size_t text_length = 0;
+    
+    if (cache->table.max_bytes > 0) {
+        Lexer scan = *lexer;
+        cacheable = cache_key(cache, &scan, &key_length);
+        if (cacheable) {
+            hash = cache_hash(cache->key, key_length);
+            CacheEntry *entry = cache_find(&cache->table, hash, cache->key, key_length);
+            if (entry) {
+                cache->table.hits++;
+                ctx->error.code = entry->code;
+                ctx->error.offset = 0;
+                ctx->error.length = 0;
+                *error = ctx->error;
+                return entry->result;
+            }
+            lexer->replay = cache->tokens;
+        }
+        cache->table.misses++;
+    }
+    
+    // Records with variables of their own are no use here
+    if (ctx->store) {
+        text_length = lexer->fill == SIZE_MAX ? strlen(text) : lexer->fill - lexer->position;
+        text_hash = cache_hash((const unsigned char *)text, text_length);
+        record = store_find(ctx->store, text_hash, text, text_length,
+                            &ctx->store_buffer, &ctx->store_capacity);
+        if (record && record->variable_count > 0) {
+            record = NULL;
+        }
+        atomic_fetch_add_explicit(record ? &ctx->store->hits : &ctx->store->misses, 1, memory_order_relaxed);
+    }
+    
+    memset(&expr, 0, sizeof(expr));
+    parser->scope = &ctx->variables;
+    parser->scope_hides_functions = 0;
+    parser->user_functions = &ctx->functions;
+    
+    if (record) {
+        expr.code = (Instruction *)((unsigned char *)record + store_code_offset(record->key_length));
+        expr.code_count = record->code_count;
+        expr.register_count = record->register_count;
+        ctx->error.offset = 0;
+        ctx->error.length = 0;
+        result = calc_eval(&expr, NULL, &ctx->error.code);
+        expr.code = NULL;   // Belongs to the store buffer
+    } else if (!parse_source(parser, lexer, &expr)) {
+        ctx->error = parser->error;
+    } else if (parser->unknown.length > 0) {
+        ctx->error.code = CALC_ERROR_UNKNOWN_IDENTIFIER;
+        ctx->error.offset = parser->unknown.start;
+        ctx->error.length = parser->unknown.length;
+    } else {
+        ctx->error.offset = 0;
+        ctx->error.length = 0;
+        if (parser->node_count == 1 && parser->nodes[0].type == NODE_NUMBER && !ctx->store) {
+            ctx->error.code = CALC_OK;
+            result = parser->nodes[0].value;
+        } else if (!generate_code(parser)) {
+            ctx->error.code = CALC_ERROR_OUT_OF_MEMORY;
+        } else {
+            result = calc_eval(&expr, ctx->variables.values, &ctx->error.code);
+            // Code that reads this context's variables means nothing elsewhere
+            if (ctx->store && !parser->reads_scope) {
+                store_add(ctx, text_hash, text, text_length, &expr);
+            }
+        }
+    }
+    
+    compiled_release(&expr);
+    if (parser->node_capacity > PARSER_KEEP_NODES || parser->operator_capacity > PARSER_KEEP_NODES) {
+        parser_release(parser);
+    }
+    
+    // Math errors have no span, so like results they hold for every
+    // spelling of the expression
+    if (cacheable && ctx->error.code <= CALC_ERROR_NON_POSITIVE_LOG) {
+        CacheEntry *entry = cache_insert(&cache->table, hash, cache->key, key_length, 0);
+        if (entry) {
+            entry->result = result;
+            entry->code = ctx->error.code;
+        }
+    }
+    
+    *error = ctx->error;
+    return result;
+}
+
+// Reads the parameter list of a definition such as f(x, y) = x*y, from
+// its opening parenthesis up to the =. Returns the number of parameters,
+// 0 if the statement is not a definition, or -1 with the error set if
+// it is one with a bad list.
+static int scan_parameters(CalcContext *ctx, Lexer *lexer, Token *params) {
+    Token bad;
+    int count = 0;
+    int malformed = 0;
+    int expect_name = 1;
+    
+    lexer_advance(lexer);
+    while (lexer->current.type != TOKEN_RPAREN) {
+        Token token = lexer->current;
+        if (token.type != (expect_name ? TOKEN_IDENTIFIER : TOKEN_COMMA)) {
+            return 0;
+        }
+        if (expect_name && !malformed) {
+            int duplicate = 0;
+            for (int i = 0; i < count; i++) {
+                duplicate |= params[i].length == token.length &&
+                             memcmp(lexer_text(lexer, &params[i]), lexer_text(lexer, &token), token.length) == 0;
+            }
+            if (count == 3 || duplicate) {
+                malformed = 1;
+                bad = token;
+            } else {
+                params[count++] = token;
+            }
+        }
+        expect_name = !expect_name;
+        lexer_advance(lexer);
+    }
+    
+    // f() and f(x,) have a ) where a name should be
+    if (expect_name && !malformed) {
+        malformed = 1;
+        bad = lexer->current;
+    }
+    lexer_advance(lexer);
+    if (lexer->current.type != TOKEN_ASSIGN) {
+        return 0;
+    }
+    if (malformed) {
+        ctx->error.code = CALC_ERROR_UNEXPECTED_TOKEN;
+        ctx->error.offset = bad.start;
+        ctx->error.length = bad.length;
+        return -1;
+    }
+    return count;
+}
+
+// Compiles the body of name(params) = body, which lexer is at the = of,
+// and makes it the definition of name. An earlier one stays on failure.
+static void define_function(CalcContext *ctx, Lexer *lexer, const Token *name, const Token *params, int arity) {
+    Parser *parser = &ctx->parser;
+    FunctionTable *table = &ctx->functions;
+    VariableTable scope;
+    CompiledExpr *block = calloc(1, sizeof(CompiledExpr));
+    
+    memset(&scope, 0, sizeof(scope));
+    ctx->error.code = CALC_OK;
+    ctx->error.offset = 0;
+    ctx->error.length = 0;
+    
+    // The parameters are the only variables the body sees, in slots 0 up
+    for (int i = 0; i < arity; i++) {
+        if (variables_define(&scope, lexer_text(lexer, &params[i]), params[i].length) < 0) {
+            ctx->error.code = CALC_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    if (!block) {
+        ctx->error.code = CALC_ERROR_OUT_OF_MEMORY;
+    }
+    
+    if (ctx->error.code == CALC_OK) {
+        atomic_init(&block->references, 1);
+        parser->scope = &scope;
+        parser->scope_hides_functions = 1;
+        parser->user_functions = table;
+        
+        if (!parse_source(parser, lexer, block)) {
+            ctx->error = parser->error;
+        } else if (parser->unknown.length > 0) {
+            ctx->error.code = CALC_ERROR_UNKNOWN_IDENTIFIER;
+            ctx->error.offset = parser->unknown.start;
+            ctx->error.length = parser->unknown.length;
+        } else {
+            UserFunction function = {arity, NULL, parser->node_count, -1};
+            int ready = 0;
+            
+            if (parser->node_count <= FUNCTION_INLINE_NODES) {
+                function.body = malloc(parser->node_count * sizeof(Node));
+                if (function.body) {
+                    memcpy(function.body, parser->nodes, parser->node_count * sizeof(Node));
+                    ready = 1;
+                }
+            } else if (generate_code(parser)) {
+                block->variables = scope.names;
+                block->variable_count = scope.count;
+                scope.names = NULL;
+                scope.count = 0;
+                function.block = functions_add_block(table, block);
+                if (function.block >= 0) {
+                    block = NULL;   // The table holds it now
+                    ready = 1;
+                }
+            }
+            
+            int index = ready ? functions_define(table, lexer_text(lexer, name), name->length) : -1;
+            if (index < 0) {
+                free(function.body);
+                ctx->error.code = CALC_ERROR_OUT_OF_MEMORY;
+            } else {
+                functions_replace(table, index, function);
+                ctx->defined = index;
+            }
+        }
+        
+        if (parser->node_capacity > PARSER_KEEP_NODES || parser->operator_capacity > PARSER_KEEP_NODES) {
+            parser_release(parser);
+        }
+    }
+    
+    calc_free(block);
+    variables_release(&scope);
+}
+
+// Evaluates an expression, or "name = expression", which also stores the
+// result in the variable. Either way a result becomes ans. A definition
+// such as "f(x) = x^2" has no result and leaves ans alone.
+static double evaluate_statement(CalcContext *ctx, Lexer *lexer, CalcError *error) {
+    VariableTable *variables = &ctx->variables;
+    Token target;
+    int assign = 0;
+    
+    ctx->defined = -1;
+    
+    // Only a statement that starts with a name can be an assignment or a
+    // definition
+    size_t first = lexer->position;
+    while (first < lexer->fill && isspace((unsigned char)lexer->input[first])) {
+        first++;
+    }
+    if (first < lexer->fill && isalpha((unsigned char)lexer->input[first])) {
+        Lexer scan = *lexer;
+        Token params[3];
+        int arity = 0;
+        lexer_advance(&scan);
+        target = scan.current;
+        lexer_advance(&scan);
+        
+        // The header is read on a copy, so anything that turns out not
+        // to be one is evaluated from the start
+        if (scan.current.type == TOKEN_LPAREN) {
+            Lexer header = scan;
+            arity = scan_parameters(ctx, &header, params);
+            if (arity != 0) {
+                scan = header;
+            }
+        }
+        
+        if (arity != 0 || scan.current.type == TOKEN_ASSIGN) {
+            const char *name = lexer_text(&scan, &target);
+            // Function names win over variables, so one cannot be assigned
+            if (target.type != TOKEN_IDENTIFIER || (target.length == 3 && memcmp(name, "ans", 3) == 0) ||
+                (arity == 0 && functions_find(&ctx->functions, name, target.length) >= 0)) {
+                ctx->error.code = CALC_ERROR_READ_ONLY;
+                ctx->error.offset = target.start;
+                ctx->error.length = target.length;
+                *error = ctx->error;
+                return 0;
+            }
+            if (arity != 0) {
+                if (arity > 0) {
+                    define_function(ctx, &scan, &target, params, arity);
+                }
+                *error = ctx->error;
+                return 0;
+            }
+            *lexer = scan;
+            assign = 1;
+        }
+    }
+    
+    double result = evaluate(ctx, lexer, error);
+    if (error->code != CALC_OK) {
+        return result;
+    }
+    
+    if (assign) {
+        int slot = variables_define(variables, lexer_text(lexer, &target), target.length);
+        if (slot < 0) {
+            ctx->error.code = CALC_ERROR_OUT_OF_MEMORY;
+            *error = ctx->error;
+            return 0;
+        }
+        variables->values[slot] = result;
+    }
+    variables->values[0] = result;
+    return result;
+}
+
+double calc_evaluate(CalcContext *ctx, const char *expression, CalcError *error) {
+    Lexer lexer;
+    lexer_init(&lexer, expression);
+    return evaluate_statement(ctx, &lexer, error);
+}
+
+double calc_evaluate_length(CalcContext *ctx, const char *expression, size_t length, CalcError *error) {
+    Lexer lexer;
+    lexer_init_length(&lexer, expression, length);
+    return evaluate_statement(ctx, &lexer, error);
+}
+
+// A name can be set from outside if an expression could name it
+static int variable_name_valid(const char *name, size_t length) {
+    Lexer lexer;
+    lexer_init_length(&lexer, name, length);
+    lexer_advance(&lexer);
+    return lexer.current.type == TOKEN_IDENTIFIER && (size_t)lexer.current.length == length &&
+           lexer.current.start == 0 && !(length == 3 && memcmp(name, "ans", 3) == 0);
+}
+
+int calc_set_variable(CalcContext *ctx, const char *name, double value) {
+    size_t length = strlen(name);
+    if (length > INT_MAX || !variable_name_valid(name, length)) {
+        return 0;
+    }
+    int slot = variables_define(&ctx->variables, name, (int)length);
+    if (slot < 0) {
+        return 0;
+    }
+    ctx->variables.values[slot] = value;
+    return 1;
+}
+
+int calc_get_variable(const CalcContext *ctx, const char *name, double *value) {
+    size_t length = strlen(name);
+    int slot = length <= INT_MAX ? variables_find(&ctx->variables, name, (int)length) : -1;
+    if (slot < 0) {
+        return 0;
+    }
+    *value = ctx->variables.values[slot];
+    return 1;
+}
+
+void calc_clear_variables(CalcContext *ctx) {
+    variables_clear(&ctx->variables);
+}
+
+const char *calc_defined_function(const CalcContext *ctx) {
+    return ctx->defined >= 0 ? ctx->functions.names[ctx->defined] : NULL;
+}
+
+void calc_clear_functions(CalcContext *ctx) {
+    functions_clear(&ctx->functions);
+    ctx->defined = -1;
+}
+
+int calc_save_functions(CalcContext *ctx) {
+    return functions_save(&ctx->functions);
+}
+
+void calc_restore_functions(CalcContext *ctx) {
+    functions_restore(&ctx->functions);
+    ctx->defined = -1;
+}
+
+// Number formatting without stdio. Shortest mode uses Grisu3 (Loitsch,
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers"),
+// which settles nearly every double with 64-bit integer arithmetic and
+// detects the rare cases it cannot prove shortest. Those, and the fixed
+// and scientific modes, go through an exact big-integer digit generator
+// (Burger and Dybvig's free-format algorithm, and plain long division).
+
+// Digits beyond this many are always zero for a double: its exact
+// decimal expansion has at most 767 significant digits.
+#define FORMAT_MAX_DIGITS 800
+
+typedef struct {
+    unsigned long long f;
+    int e;
+} DiyFp;
+
+// 10^k for k = -348, -340, ..., 340 as normalized 64-bit significands,
+// rounded to nearest: {significand, binary exponent, decimal exponent}
+static const struct {
+    unsigned long long significand;
+    short binary_exponent;
+    short decimal_exponent;
+} cached_powers[] = {
+    {0xFA8FD5A0081C0288ULL, -1220, -348},
+    {0xBAAEE17FA23EBF76ULL, -1193, -340},
+    {0x8B16FB203055AC76ULL, -1166, -332},
+    {0xCF42894A5DCE35EAULL, -1140, -324},
+    {0x9A6BB0AA55653B2DULL, -1113, -316},
+    {0xE61ACF033D1A45DFULL, -1087, -308},
+    {0xAB70FE17C79AC6CAULL, -1060, -300},
+    {0xFF77B1FCBEBCDC4FULL, -1034, -292},
+    {0xBE5691EF416BD60CULL, -1007, -284},
+    {0x8DD01FAD907FFC3CULL, -980, -276},
+    {0xD3515C2831559A83ULL, -954, -268},
+    {0x9D71AC8FADA6C9B5ULL, -927, -260},
+    {0xEA9C227723EE8BCBULL, -901, -252},
+    {0xAECC49914078536DULL, -874, -244},
+    {0x823C12795DB6CE57ULL, -847, -236},
+    {0xC21094364DFB5637ULL, -821, -228},
+    {0x9096EA6F3848984FULL, -794, -220},
+    {0xD77485CB25823AC7ULL, -768, -212},
+    {0xA086CFCD97BF97F4ULL, -741, -204},
+    {0xEF340A98172AACE5ULL, -715, -196},
+    {0xB23867FB2A35B28EULL, -688, -188},
+    {0x84C8D4DFD2C63F3BULL, -661, -180},
+    {0xC5DD44271AD3CDBAULL, -635, -172},
+    {0x936B9FCEBB25C996ULL, -608, -164},
+    {0xDBAC6C247D62A584ULL, -582, -156},
+    {0xA3AB66580D5FDAF6ULL, -555, -148},
+    {0xF3E2F893DEC3F126ULL, -529, -140},
+    {0xB5B5ADA8AAFF80B8ULL, -502, -132},
+    {0x87625F056C7C4A8BULL, -475, -124},
+    {0xC9BCFF6034C13053ULL, -449, -116},
+    {0x964E858C91BA2655ULL, -422, -108},
+    {0xDFF9772470297EBDULL, -396, -100},
+    {0xA6DFBD9FB8E5B88FULL, -369, -92},
+    {0xF8A95FCF88747D94ULL, -343, -84},
+    {0xB94470938FA89BCFULL, -316, -76},
+    {0x8A08F0F8BF0F156BULL, -289, -68},
+    {0xCDB02555653131B6ULL, -263, -60},
+    {0x993FE2C6D07B7FACULL, -236, -52},
+    {0xE45C10C42A2B3B06ULL, -210, -44},
+    {0xAA242499697392D3ULL, -183, -36},
+    {0xFD87B5F28300CA0EULL, -157, -28},
+    {0xBCE5086492111AEBULL, -130, -20},
+    {0x8CBCCC096F5088CCULL, -103, -12},
+    {0xD1B71758E219652CULL, -77, -4},
+    {0x9C40000000000000ULL, -50, 4},
+    {0xE8D4A51000000000ULL, -24, 12},
+    {0xAD78EBC5AC620000ULL, 3, 20},
+    {0x813F3978F8940984ULL, 30, 28},
+    {0xC097CE7BC90715B3ULL, 56, 36},
+    {0x8F7E32CE7BEA5C70ULL, 83, 44},
+    {0xD5D238A4ABE98068ULL, 109, 52},
+    {0x9F4F2726179A2245ULL, 136, 60},
+    {0xED63A231D4C4FB27ULL, 162, 68},
+    {0xB0DE65388CC8ADA8ULL, 189, 76},
+    {0x83C7088E1AAB65DBULL, 216, 84},
+    {0xC45D1DF942711D9AULL, 242, 92},
+    {0x924D692CA61BE758ULL, 269, 100},
+    {0xDA01EE641A708DEAULL, 295, 108},
+    {0xA26DA3999AEF774AULL, 322, 116},
+    {0xF209787BB47D6B85ULL, 348, 124},
+    {0xB454E4A179DD1877ULL, 375, 132},
+    {0x865B86925B9BC5C2ULL, 402, 140},
+    {0xC83553C5C8965D3DULL, 428, 148},
+    {0x952AB45CFA97A0B3ULL, 455, 156},
+    {0xDE469FBD99A05FE3ULL, 481, 164},
+    {0xA59BC234DB398C25ULL, 508, 172},
+    {0xF6C69A72A3989F5CULL, 534, 180},
+    {0xB7DCBF5354E9BECEULL, 561, 188},
+    {0x88FCF317F22241E2ULL, 588, 196},
+    {0xCC20CE9BD35C78A5ULL, 614, 204},
+    {0x98165AF37B2153DFULL, 641, 212},
+    {0xE2A0B5DC971F303AULL, 667, 220},
+    {0xA8D9D1535CE3B396ULL, 694, 228},
+    {0xFB9B7CD9A4A7443CULL, 720, 236},
+    {0xBB764C4CA7A44410ULL, 747, 244},
+    {0x8BAB8EEFB6409C1AULL, 774, 252},
+    {0xD01FEF10A657842CULL, 800, 260},
+    {0x9B10A4E5E9913129ULL, 827, 268},
+    {0xE7109BFBA19C0C9DULL, 853, 276},
+    {0xAC2820D9623BF429ULL, 880, 284},
+    {0x80444B5E7AA7CF85ULL, 907, 292},
+    {0xBF21E44003ACDD2DULL, 933, 300},
+    {0x8E679C2F5E44FF8FULL, 960, 308},
+    {0xD433179D9C8CB841ULL, 986, 316},
+    {0x9E19DB92B4E31BA9ULL, 1013, 324},
+    {0xEB96BF6EBADF77D9ULL, 1039, 332},
+    {0xAF87023B9BF0EE6BULL, 1066, 340},
+};
+
+// Product of two DiyFps rounded to 64 bits
+static DiyFp diyfp_multiply(DiyFp x, DiyFp y) {
+    unsigned long long a = x.f >> 32, b = x.f & 0xFFFFFFFFULL;
+    unsigned long long c = y.f >> 32, d = y.f & 0xFFFFFFFFULL;
+    unsigned long long ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    unsigned long long middle = (bd >> 32) + (ad & 0xFFFFFFFFULL) + (bc & 0xFFFFFFFFULL) + (1ULL << 31);
+    DiyFp result = {ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64};
+    return result;
+}
+
+static DiyFp diyfp_normalize(DiyFp x) {
+    while (!(x.f & (1ULL << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+// Splits a positive finite double into significand and exponent
+static DiyFp double_to_diyfp(double value) {
+    unsigned long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int biased = (int)(bits >> 52) & 0x7FF;
+    DiyFp result;
+    result.f = bits & 0xFFFFFFFFFFFFFULL;
+    if (biased) {
+        result.f |= 1ULL << 52;
+        result.e = biased - 1075;
+    } else {
+        result.e = -1074;
+    }
+    return result;
+}
+
+// Nudges the last digit towards w while that is provably safe, then
+// reports whether the result is guaranteed to be the shortest correct one
+static int grisu_round_weed(char *digits, int length, unsigned long long distance_too_high_w,
+                            unsigned long long unsafe_interval, unsigned long long rest,
+                            unsigned long long ten_kappa, unsigned long long unit) {
+    unsigned long long small_distance = distance_too_high_w - unit;
+    unsigned long long big_distance = distance_too_high_w + unit;
+    
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+           (rest + ten_kappa < small_distance ||
+            small_distance - rest >= rest + ten_kappa - small_distance)) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+    
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+        (rest + ten_kappa < big_distance ||
+         big_distance - rest > rest + ten_kappa - big_distance)) {
+        return 0;
+    }
+    
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+// Grisu3 shortest digits. Returns 0 when it cannot prove the result
+// correct and shortest; the caller then uses the exact algorithm.
+static int grisu3(double value, char *digits, int *length, int *point) {
+    DiyFp v = double_to_diyfp(value);
+    DiyFp w = diyfp_normalize(v);
+    
+    // Neighbouring halfway points; the lower one is closer when value is
+    // a power of two
+    DiyFp plus = diyfp_normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+    DiyFp minus;
+    if (v.f == (1ULL << 52) && v.e > -1074) {
+        minus = (DiyFp){(v.f << 2) - 1, v.e - 2};
+    } else {
+        minus = (DiyFp){(v.f << 1) - 1, v.e - 1};
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    
+    // Pick the cached power that brings the exponent into [-60, -32]
+    int k = (int)ceil((-60 - (w.e + 64) + 63) * 0.30102999566398114);
+    int index = (348 + k - 1) / 8 + 1;
+    DiyFp ten_mk = {cached_powers[index].significand, cached_powers[index].binary_exponent};
+    int mk = cached_powers[index].decimal_exponent;
+    
+    DiyFp scaled_w = diyfp_multiply(w, ten_mk);
+    DiyFp low = diyfp_multiply(minus, ten_mk);
+    DiyFp high = diyfp_multiply(plus, ten_mk);
+    
+    // Each product is off by less than one unit, so widen the interval
+    // by one unit on each side and only accept digits that are safe
+    unsigned long long unit = 1;
+    DiyFp too_low = {low.f - unit, low.e};
+    DiyFp too_high = {high.f + unit, high.e};
+    unsigned long long unsafe_interval = too_high.f - too_low.f;
+    int shift = -scaled_w.e;
+    unsigned long long one = 1ULL << shift;
+    unsigned int integrals = (unsigned int)(too_high.f >> shift);
+    unsigned long long fractionals = too_high.f & (one - 1);
+    
+    static const unsigned int powers[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+    };
+    int kappa = 10;
+    while (kappa > 0 && powers[kappa - 1] > integrals) {
+        kappa--;
+    }
+    unsigned int divisor = kappa > 0 ? powers[kappa - 1] : 1;
+    
+    *length = 0;
+    while (kappa > 0) {
+        digits[(*length)++] = (char)('0' + integrals / divisor);
+        integrals %= divisor;
+        kappa--;
+        unsigned long long rest = ((unsigned long long)integrals << shift) + fractionals;
+        if (rest < unsafe_interval) {
+            *point = *length + kappa - mk;
+            return grisu_round_weed(digits, *length, too_high.f - scaled_w.f, unsafe_interval, rest,
+                                    (unsigned long long)divisor << shift, unit);
+        }
+        divisor /= 10;
+    }
+    
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        digits[(*length)++] = (char)('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        kappa--;
+        if (fractionals < unsafe_interval) {
+            *point = *length + kappa - mk;
+            return grisu_round_weed(digits, *length, (too_high.f - scaled_w.f) * unit, unsafe_interval,
+                                    fractionals, one, unit);
+        }
+    }
+}
+
+// Unsigned big integer in 32-bit limbs, least significant first, wide
+// enough for every intermediate value of a double conversion
+typedef struct {
+    int size;
+    unsigned int limbs[40];
+} BigInt;
+
+static void bigint_set(BigInt *x, unsigned long long value) {
+    x->size = 0;
+    while (value) {
+        x->limbs[x->size++] = (unsigned int)value;
+        value >>= 32;
+    }
+}
+
+static void bigint_multiply_small(BigInt *x, unsigned int factor) {
+    unsigned long long carry = 0;
+    for (int i = 0; i < x->size; i++) {
+        carry += (unsigned long long)x->limbs[i] * factor;
+        x->limbs[i] = (unsigned int)carry;
+        carry >>= 32;
+    }
+    if (carry) {
+        x->limbs[x->size++] = (unsigned int)carry;
+    }
+}
+
+static void bigint_multiply_pow10(BigInt *x, int exponent) {
+    for (; exponent >= 9; exponent -= 9) {
+        bigint_multiply_small(x, 1000000000);
+    }
+    static const unsigned int powers[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+    bigint_multiply_small(x, powers[exponent]);
+}
+
+static void bigint_shift_left(BigInt *x, int bits) {
+    if (!x->size) {
+        return;
+    }
+    int words = bits / 32;
+    bits %= 32;
+    
+    x->limbs[x->size] = 0;
+    for (int i = x->size; i >= 0; i--) {
+        unsigned int high = bits ? x->limbs[i] << bits : x->limbs[i];
+        unsigned int low = bits && i > 0 ? x->limbs[i - 1] >> (32 - bits) : 0;
+        x->limbs[i + words] = high | low;
+    }
+    for (int i = 0; i < words; i++) {
+        x->limbs[i] = 0;
+    }
+    x->size += words + 1;
+    while (x->size && !x->limbs[x->size - 1]) {
+        x->size--;
+    }
+}
+
+static int bigint_compare(const BigInt *a, const BigInt *b) {
+    if (a->size != b->size) {
+        return a->size < b->size ? -1 : 1;
+    }
+    for (int i = a->size - 1; i >= 0; i--) {
+        if (a->limbs[i] != b->limbs[i]) {
+            return a->limbs[i] < b->limbs[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static void bigint_add(BigInt *sum, const BigInt *a, const BigInt *b) {
+    const BigInt *longer = a->size >= b->size ? a : b;
+    const BigInt *shorter = a->size >= b->size ? b : a;
+    unsigned long long carry = 0;
+    int size = longer->size;
+    for (int i = 0; i < size; i++) {
+        carry += (unsigned long long)longer->limbs[i] + (i < shorter->size ? shorter->limbs[i] : 0);
+        sum->limbs[i] = (unsigned int)carry;
+        carry >>= 32;
+    }
+    sum->size = size;
+    if (carry) {
+        sum->limbs[sum->size++] = (unsigned int)carry;
+    }
+}
+
+// x -= y, where x >= y
+static void bigint_subtract(BigInt *x, const BigInt *y) {
+    long long borrow = 0;
+    for (int i = 0; i < x->size; i++) {
+        borrow += (long long)x->limbs[i] - (i < y->size ? y->limbs[i] : 0);
+        x->limbs[i] = (unsigned int)borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+    while (x->size && !x->limbs[x->size - 1]) {
+        x->size--;
+    }
+}
+
+// Returns floor(r / s), which must be below 10, and leaves the remainder in r
+static int bigint_divide_digit(BigInt *r, const BigInt *s) {
+    int digit = 0;
+    while (bigint_compare(r, s) >= 0) {
+        bigint_subtract(r, s);
+        digit++;
+    }
+    return digit;
+}
+
+// Sets up value = r / s * 10^point with 1/10 <= r / s < 1, scaling the
+// margins m_plus and m_minus along with r. When margins is set, the
+// fixup also accounts for the upper margin as the free-format algorithm
+// requires.
+static void dragon_setup(double value, BigInt *r, BigInt *s, BigInt *m_plus, BigInt *m_minus,
+                         int margins, int even, int *point) {
+    DiyFp v = double_to_diyfp(value);
+    int unequal = v.f == (1ULL << 52) && v.e > -1074;
+    
+    // r / s = value, with one extra factor of two (two when the gaps
+    // differ) so the half-gap margins stay integers
+    bigint_set(r, v.f);
+    bigint_set(s, 1);
+    bigint_set(m_plus, 1);
+    bigint_set(m_minus, 1);
+    if (v.e >= 0) {
+        bigint_shift_left(r, v.e + 1 + unequal);
+        bigint_shift_left(s, 1 + unequal);
+        bigint_shift_left(m_plus, v.e + unequal);
+        bigint_shift_left(m_minus, v.e);
+    } else {
+        bigint_shift_left(r, 1 + unequal);
+        bigint_shift_left(s, 1 - v.e + unequal);
+        bigint_shift_left(m_plus, unequal);
+    }
+    
+    int bits = 64;
+    while (!(v.f & (1ULL << (bits - 1)))) {
+        bits--;
+    }
+    int k = (int)ceil((v.e + bits - 1) * 0.30102999566398114 - 1e-10);
+    if (k >= 0) {
+        bigint_multiply_pow10(s, k);
+    } else {
+        bigint_multiply_pow10(r, -k);
+        bigint_multiply_pow10(m_plus, -k);
+        bigint_multiply_pow10(m_minus, -k);
+    }
+    
+    // The estimate is never too high and at most one too low
+    BigInt high;
+    if (margins) {
+        bigint_add(&high, r, m_plus);
+    } else {
+        high = *r;
+    }
+    int compare = bigint_compare(&high, s);
+    if (compare > 0 || (compare == 0 && (even || !margins))) {
+        bigint_multiply_small(s, 10);
+        k++;
+    }
+    *point = k;
+}
+
+// Exact shortest digits (Burger and Dybvig's free-format algorithm)
+static void dragon_shortest(double value, char *digits, int *length, int *point) {
+    BigInt r, s, m_plus, m_minus, high;
+    unsigned long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int even = !(bits & 1);
+    
+    dragon_setup(value, &r, &s, &m_plus, &m_minus, 1, even, point);
+    
+    *length = 0;
+    for (;;) {
+        bigint_multiply_small(&r, 10);
+        bigint_multiply_small(&m_plus, 10);
+        bigint_multiply_small(&m_minus, 10);
+        int digit = bigint_divide_digit(&r, &s);
+        
+        int compare_low = bigint_compare(&r, &m_minus);
+        bigint_add(&high, &r, &m_plus);
+        int compare_high = bigint_compare(&high, &s);
+        int low = compare_low < 0 || (even && compare_low == 0);
+        int up = compare_high > 0 || (even && compare_high == 0);
+        
+        if (low && up) {
+            // Both neighbours are in range: take the closer one
+            BigInt twice = r;
+            bigint_shift_left(&twice, 1);
+            int compare = bigint_compare(&twice, &s);
+            up = compare > 0 || (compare == 0 && (digit & 1));
+        }
+        if (low || up) {
+            digits[(*length)++] = (char)('0' + digit + up);
+            return;
+        }
+        digits[(*length)++] = (char)('0' + digit);
+    }
+}
+
+// Exactly rounded digits (ties to even) up to count significant digits,
+// or, when fixed is set, up to count digits after the decimal point.
+// Trailing digits past FORMAT_MAX_DIGITS are zero and are left out.
+static void dragon_fixed(double value, int count, int fixed, char *digits, int *length, int *point) {
+    BigInt r, s, m_plus, m_minus;
+    dragon_setup(value, &r, &s, &m_plus, &m_minus, 0, 0, point);
+    
+    if (fixed) {
+        count += *point;
+    }
+    
+    *length = 0;
+    if (count < 0) {
+        return;     // Below half of the last place: rounds to zero
+    }
+    
+    while (*length < count && *length < FORMAT_MAX_DIGITS && r.size) {
+        bigint_multiply_small(&r, 10);
+        digits[(*length)++] = (char)('0' + bigint_divide_digit(&r, &s));
+    }
+    if (*length < count && !r.size) {
+        return;     // Exact; the remaining digits are zeros
+    }
+    
+    bigint_shift_left(&r, 1);
+    int compare = bigint_compare(&r, &s);
+    int odd = *length > 0 && ((digits[*length - 1] - '0') & 1);
+    if (compare > 0 || (compare == 0 && odd)) {
+        int i = *length - 1;
+        while (i >= 0 && digits[i] == '9') {
+            digits[i--] = '0';
+        }
+        if (i >= 0) {
+            digits[i]++;
+        } else {
+            // All nines (or no digits at all) carry into a new leading one
+            if (*length > 0) {
+                memmove(digits + 1, digits, *length - 1);
+            } else {
+                *length = 1;
+            }
+            digits[0] = '1';
+            (*point)++;
+        }
+    }
+}
+
+// Appends the decimal exponent of scientific notation, printf style
+static int format_exponent(char *out, int exponent) {
+    int length = 0;
+    out[length++] = 'e';
+    out[length++] = exponent < 0 ? '-' : '+';
+    exponent = exponent < 0 ? -exponent : exponent;
+    if (exponent >= 100) {
+        out[length++] = (char)('0' + exponent / 100);
+    }
+    out[length++] = (char)('0' + exponent / 10 % 10);
+    out[length++] = (char)('0' + exponent % 10);
+    return length;
+}
+
+size_t calc_format(double value, CalcFormat format, int precision, char *buffer, size_t size) {
+    char digits[FORMAT_MAX_DIGITS + 1];
+    int length = 0;
+    int point = 0;
+    int negative = signbit(value) != 0;
+    
+    if (precision < 0) {
+        precision = 6;
+    }
+    
+    if (isnan(value) || isinf(value)) {
+        const char *text = isnan(value) ? "nan" : negative ? "-inf" : "inf";
+        size_t text_length = strlen(text);
+        if (text_length < size) {
+            memcpy(buffer, text, text_length + 1);
+        }
+        return text_length;
+    }
+    
+    double magnitude = fabs(value);
+    if (magnitude == 0) {
+        digits[0] = '0';
+        length = 1;
+        point = 1;
+    } else if (format == CALC_FORMAT_SHORTEST) {
+        if (!grisu3(magnitude, digits, &length, &point)) {
+            dragon_shortest(magnitude, digits, &length, &point);
+        }
+    } else {
+        int fixed = format == CALC_FORMAT_FIXED;
+        dragon_fixed(magnitude, fixed ? precision : precision + 1, fixed, digits, &length, &point);
+    }
+    
+    int scientific = format == CALC_FORMAT_SCIENTIFIC ||
+                     (format == CALC_FORMAT_SHORTEST && (point - 1 < -4 || point - 1 >= 16));
+    
+    // Work out the length first so nothing is written into a short buffer
+    size_t needed = negative;
+    if (scientific) {
+        int fraction = format == CALC_FORMAT_SHORTEST ? length - 1 : precision;
+        int exponent = (magnitude == 0 ? 1 : point) - 1;
+        needed += 1 + (fraction > 0 ? 1 + fraction : 0) + 4 + (abs(exponent) >= 100);
+    } else if (format == CALC_FORMAT_SHORTEST) {
+        needed += point <= 0 ? 2 - point + length : length > point ? length + 1 : point;
+    } else {
+        needed += (point > 0 ? point : 1) + (precision > 0 ? 1 + precision : 0);
+    }
+    if (needed >= size) {
+        return needed;
+    }
+    
+    char *out = buffer;
+    if (negative) {
+        *out++ = '-';
+    }
+    
+    if (scientific) {
+        int fraction = format == CALC_FORMAT_SHORTEST ? length - 1 : precision;
+        *out++ = digits[0];
+        if (fraction > 0) {
+            *out++ = '.';
+            for (int i = 1; i <= fraction; i++) {
+                *out++ = i < length ? digits[i] : '0';
+            }
+        }
+        out += format_exponent(out, (magnitude == 0 ? 1 : point) - 1);
+    } else if (format == CALC_FORMAT_SHORTEST) {
+        if (point <= 0) {
+            *out++ = '0';
+            *out++ = '.';
+            for (int i = point; i < 0; i++) {
+                *out++ = '0';
+            }
+            memcpy(out, digits, length);
+            out += length;
+        } else {
+            for (int i = 0; i < point || i < length; i++) {
+                if (i == point) {
+                    *out++ = '.';
+                }
+                *out++ = i < length ? digits[i] : '0';
+            }
+        }
+    } else {
+        // Digit i of the expansion sits at place value 10^(point - 1 - i)
+        if (point <= 0) {
+            *out++ = '0';
+        }
+        for (int i = 0; i < point; i++) {
+            *out++ = i < length ? digits[i] : '0';
+        }
+        if (precision > 0) {
+            *out++ = '.';
+            for (int i = point; i < point + precision; i++) {
+                *out++ = i >= 0 && i < length ? digits[i] : '0';
+            }
+        }
+    }
+    
+    *out = '\0';
+    return (size_t)(out - buffer);
+}
+
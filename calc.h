@@ -0,0 +1,225 @@
+#ifndef CALC_H
+#define CALC_H
+
+#include <stddef.h>
+
+// libcalc: the expression engine shared by the CLI, terminal and X11
+// front-ends. The library keeps no global state. A CalcContext belongs
+// to one thread at a time; a compiled expression may be evaluated from
+// any number of threads at once.
+
+typedef struct CalcContext CalcContext;
+typedef struct CompiledExpr CompiledExpr;
+typedef struct CalcCompileCache CalcCompileCache;
+typedef struct CalcStore CalcStore;
+
+typedef enum {
+    CALC_FORMAT_SHORTEST,       // Fewest digits that read back as the same double
+    CALC_FORMAT_FIXED,          // precision digits after the point, like %.*f
+    CALC_FORMAT_SCIENTIFIC      // precision digits after the point, like %.*e
+} CalcFormat;
+
+// Buffer size that always suffices for CALC_FORMAT_SHORTEST
+#define CALC_FORMAT_SHORTEST_SIZE 32
+
+typedef enum {
+    CALC_OK,
+    CALC_ERROR_DIVISION_BY_ZERO,
+    CALC_ERROR_MODULO_BY_ZERO,
+    CALC_ERROR_NEGATIVE_SQRT,
+    CALC_ERROR_NON_POSITIVE_LOG,
+    CALC_ERROR_UNEXPECTED_END,
+    CALC_ERROR_UNEXPECTED_CHARACTER,
+    CALC_ERROR_UNEXPECTED_TOKEN,
+    CALC_ERROR_EXPECTED_RPAREN,
+    CALC_ERROR_TRAILING_TOKENS,
+    CALC_ERROR_UNKNOWN_IDENTIFIER,
+    CALC_ERROR_OUT_OF_MEMORY,
+    CALC_ERROR_READ_FAILED,
+    CALC_ERROR_READ_ONLY            // Assignment to ans, a constant or a function
+} CalcErrorCode;
+
+// Errors are reported as a code plus the span of source text they refer
+// to, so failing costs no string formatting. Math errors and running out
+// of memory have no position and an empty span.
+typedef struct {
+    CalcErrorCode code;
+    size_t offset;      // Byte offset of the offending text
+    size_t length;
+} CalcError;
+
+// Short static description of code, such as "Division by zero"
+const char *calc_error_string(CalcErrorCode code);
+
+// Renders error as a message for the expression it came from, naming the
+// offending text where there is one ("Unexpected token: )"). expression
+// may be NULL when the source was streamed, and the text is then left
+// out. Returns the length of the message with the same meaning as
+// snprintf().
+size_t calc_error_format(const CalcError *error, const char *expression, char *buffer, size_t size);
+
+// Contexts hold per-caller state such as the outcome of the last call.
+// calc_context_new() returns NULL when out of memory.
+CalcContext *calc_context_new(void);
+void calc_context_free(CalcContext *ctx);
+
+// Parses and evaluates an expression in one step. On failure error->code
+// is set and 0 is returned; otherwise it is CALC_OK. Identifiers name the
+// context's variables and functions, and "name = expression" also stores
+// the result in name, creating it if need be. Every result is kept in ans.
+// "name(a, b) = expression" instead defines a function of one to three
+// parameters, returning 0 and leaving ans alone.
+double calc_evaluate(CalcContext *ctx, const char *expression, CalcError *error);
+
+// calc_evaluate() on the first length bytes of expression, which need not
+// be NUL-terminated, so a line can be evaluated where it sits in a larger
+// buffer. The byte at expression[length] must still be readable and be a
+// NUL or whitespace, such as the newline that ends the line. A NUL among
+// the length bytes is an unexpected character.
+double calc_evaluate_length(CalcContext *ctx, const char *expression, size_t length, CalcError *error);
+
+// Variables of a context, for binding inputs without writing them into
+// the text. Names are letters only and not a built-in name; ans can be
+// read but not set. Each name is resolved once per parse, so expressions
+// read variables by slot. calc_set_variable() returns 0 for an invalid
+// name or when out of memory, and calc_get_variable() returns 0 for an
+// unknown name. calc_clear_variables() drops them all and sets ans to 0.
+int calc_set_variable(CalcContext *ctx, const char *name, double value);
+int calc_get_variable(const CalcContext *ctx, const char *name, double *value);
+void calc_clear_variables(CalcContext *ctx);
+
+// User functions of a context. A body may use its parameters, built-ins
+// and functions defined before it; redefining a name leaves functions
+// built on the old body as they were. Small bodies are inlined into each
+// call, so calling them costs nothing at run time, and larger ones are
+// compiled once and shared. calc_defined_function() names the function
+// the last calc_evaluate() defined, or returns NULL if it defined none;
+// calc_clear_functions() drops them all.
+const char *calc_defined_function(const CalcContext *ctx);
+void calc_clear_functions(CalcContext *ctx);
+
+// calc_save_functions() marks the functions defined so far, such as a
+// library loaded at startup, and calc_restore_functions() undoes every
+// definition made since, putting redefined ones back. A restore costs
+// what changed since the save, not the size of the library.
+// calc_save_functions() returns 0 when out of memory.
+int calc_save_functions(CalcContext *ctx);
+void calc_restore_functions(CalcContext *ctx);
+
+// Counters for a cache. bytes is the memory it holds, which eviction
+// keeps at or under max_bytes.
+typedef struct {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t entries;
+    size_t bytes;
+    size_t max_bytes;
+    double seconds_saved;   // Compile time hits avoided; compile cache only
+} CalcCacheStats;
+
+// Lets calc_evaluate() on ctx reuse results, least recently used first
+// out once max_bytes is reached; 0 turns the cache off and frees it.
+// Expressions are matched by their tokens, so spacing and the spelling of
+// literals do not matter ("2*1.50" hits after "2 * 1.5"). Results and
+// math errors are cached; syntax errors never are, since their spans
+// depend on the exact text. Off by default.
+void calc_set_result_cache(CalcContext *ctx, size_t max_bytes);
+void calc_result_cache_stats(const CalcContext *ctx, CalcCacheStats *stats);
+
+// Parses an expression once so it can be evaluated repeatedly with
+// calc_eval(). Identifiers that are not built-in become variables,
+// numbered in order of first appearance. Returns NULL and fills error on
+// a syntax error.
+CompiledExpr *calc_compile(const char *expression, CalcError *error);
+
+// Supplies source text to calc_compile_stream(): stores up to size bytes
+// in buffer and returns how many, 0 at the end of the source, or -1 if
+// reading failed.
+typedef long (*CalcReader)(void *state, char *buffer, size_t size);
+
+// Compiles a source of any length that is read piece by piece through
+// reader, such as a multi-megabyte formula in a file or a chain of
+// buffers. The text is parsed in one pass and not kept: memory grows with
+// the compiled expression and the longest token, not with the source.
+CompiledExpr *calc_compile_stream(CalcReader reader, void *state, CalcError *error);
+
+// A CalcReader for file descriptors; state points to the int descriptor
+long calc_read_fd(void *state, char *buffer, size_t size);
+
+// Evaluates a compiled expression without touching the lexer or parser.
+// vars holds one value per variable slot and may be NULL when the
+// expression has none. On a math error *error is set and 0 is returned;
+// otherwise *error is CALC_OK.
+double calc_eval(const CompiledExpr *expr, const double *vars, CalcErrorCode *error);
+
+// Evaluates expr for n rows at once. x[slot] points to the column of
+// values for each variable slot and out receives one result per row.
+// Rows that hit a math error are set to NaN; the number of such rows is
+// returned, or (size_t)-1 if the scratch space cannot be allocated.
+size_t calc_eval_batch(const CompiledExpr *expr, const double *const x[], size_t n, double *out);
+
+// Generates native code for expr and switches calc_eval() over to it.
+// Returns 1 on success and 0 when the host refuses executable memory.
+// Must not run while other threads are evaluating expr.
+int calc_jit(CompiledExpr *expr);
+
+// Releases expr. Expressions from calc_compile_cached() are shared, and
+// only the last release frees them.
+void calc_free(CompiledExpr *expr);
+
+// A cache of compiled expressions keyed by their exact source text, for
+// servers and pipelines that see the same formulas over and over. It may
+// be used from any number of threads at once. max_bytes caps the memory
+// of the entries, including their code, least recently used first out;
+// with jit set, expressions are given native code before being cached.
+// Syntax errors are not cached. Returns NULL when out of memory.
+CalcCompileCache *calc_compile_cache_new(size_t max_bytes, int jit);
+void calc_compile_cache_free(CalcCompileCache *cache);
+
+// Like calc_compile(), but returns the cached expression for text seen
+// before. The caller owns one reference and releases it with calc_free();
+// the expression stays valid after eviction or calc_compile_cache_free().
+// Cached expressions are shared, so calc_jit() must not be called on them.
+CompiledExpr *calc_compile_cached(CalcCompileCache *cache, const char *expression, CalcError *error);
+void calc_compile_cache_stats(CalcCompileCache *cache, CalcCacheStats *stats);
+
+// A file of compiled expressions keyed by their exact source text, so
+// that later runs of a program skip compiling what earlier runs did. Any
+// number of processes and threads may share it. The file is created with
+// room for capacity bytes (an existing one keeps its size) and is emptied
+// when full. Damaged entries, and files written by a different build of
+// the library, are detected and ignored. Returns NULL if path cannot be
+// opened or mapped.
+CalcStore *calc_store_open(const char *path, size_t capacity);
+void calc_store_close(CalcStore *store);
+
+// Like calc_compile(), but takes the expression from store when its text
+// is there and adds it otherwise
+CompiledExpr *calc_compile_stored(CalcStore *store, const char *expression, CalcError *error);
+
+// Makes calc_evaluate() on ctx look in store before parsing and add what
+// it compiles; NULL stops it. A store may serve many contexts and must
+// outlive them.
+void calc_set_store(CalcContext *ctx, CalcStore *store);
+
+// Hits and misses are this process's; entries, bytes and max_bytes describe
+// the file, and evictions count entries dropped when it was emptied
+void calc_store_stats(CalcStore *store, CalcCacheStats *stats);
+
+// Variable slots of a compiled expression, and how many parse nodes
+// the optimizer removed from it. calc_variable_slot() finds the slot
+// to bind a name to, or returns -1 if the expression does not read it.
+int calc_variable_count(const CompiledExpr *expr);
+const char *calc_variable_name(const CompiledExpr *expr, int slot);
+int calc_variable_slot(const CompiledExpr *expr, const char *name);
+int calc_nodes_eliminated(const CompiledExpr *expr);
+
+// Writes value as text into buffer without stdio and returns the length
+// of the text. As with snprintf(), a result of size or more means the
+// buffer was too small and its contents should not be used. Shortest
+// mode switches to scientific notation below 1e-4 or from 1e16 on, and
+// never needs more than CALC_FORMAT_SHORTEST_SIZE bytes.
+size_t calc_format(double value, CalcFormat format, int precision, char *buffer, size_t size);
+
+#endif
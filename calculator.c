@@ -1,422 +1,65 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
-#include <math.h>
-
-#define MAX_TOKEN_LEN 256
-#define MAX_EXPR_LEN 1024
-
-typedef enum {
-    TOKEN_NUMBER,
-    TOKEN_PLUS,
-    TOKEN_MINUS,
-    TOKEN_MULTIPLY,
-    TOKEN_DIVIDE,
-    TOKEN_MODULO,
-    TOKEN_POWER,
-    TOKEN_LPAREN,
-    TOKEN_RPAREN,
-    TOKEN_SIN,
-    TOKEN_COS,
-    TOKEN_TAN,
-    TOKEN_SQRT,
-    TOKEN_LOG,
-    TOKEN_EXP,
-    TOKEN_ABS,
-    TOKEN_PI,
-    TOKEN_E,
-    TOKEN_EOF,
-    TOKEN_ERROR
-} TokenType;
-
-typedef struct {
-    TokenType type;
-    double value;
-    char text[MAX_TOKEN_LEN];
-} Token;
-
-typedef struct {
-    const char *input;
-    int position;
-    Token current;
-} Lexer;
-
-void lexer_init(Lexer *lexer, const char *input) {
-    lexer->input = input;
-    lexer->position = 0;
-    lexer->current.type = TOKEN_EOF;
-}
-
-void lexer_skip_whitespace(Lexer *lexer) {
-    while (lexer->input[lexer->position] && isspace(lexer->input[lexer->position])) {
-        lexer->position++;
-    }
-}
-
-Token lexer_read_number(Lexer *lexer) {
-    Token token;
-    token.type = TOKEN_NUMBER;
-    
-    int start = lexer->position;
-    int has_dot = 0;
-    
-    while (lexer->input[lexer->position]) {
-        char c = lexer->input[lexer->position];
-        if (isdigit(c)) {
-            lexer->position++;
-        } else if (c == '.' && !has_dot) {
-            has_dot = 1;
-            lexer->position++;
-        } else {
-            break;
-        }
-    }
-    
-    int len = lexer->position - start;
-    if (len >= MAX_TOKEN_LEN) len = MAX_TOKEN_LEN - 1;
-    strncpy(token.text, lexer->input + start, len);
-    token.text[len] = '\0';
-    token.value = atof(token.text);
-    
-    return token;
-}
-
-Token lexer_read_identifier(Lexer *lexer) {
-    Token token;
-    int start = lexer->position;
-    
-    while (lexer->input[lexer->position] && isalpha(lexer->input[lexer->position])) {
-        lexer->position++;
-    }
-    
-    int len = lexer->position - start;
-    if (len >= MAX_TOKEN_LEN) len = MAX_TOKEN_LEN - 1;
-    strncpy(token.text, lexer->input + start, len);
-    token.text[len] = '\0';
-    
-    if (strcmp(token.text, "sin") == 0) token.type = TOKEN_SIN;
-    else if (strcmp(token.text, "cos") == 0) token.type = TOKEN_COS;
-    else if (strcmp(token.text, "tan") == 0) token.type = TOKEN_TAN;
-    else if (strcmp(token.text, "sqrt") == 0) token.type = TOKEN_SQRT;
-    else if (strcmp(token.text, "log") == 0) token.type = TOKEN_LOG;
-    else if (strcmp(token.text, "exp") == 0) token.type = TOKEN_EXP;
-    else if (strcmp(token.text, "abs") == 0) token.type = TOKEN_ABS;
-    else if (strcmp(token.text, "pi") == 0) {
-        token.type = TOKEN_PI;
-        token.value = M_PI;
-    }
-    else if (strcmp(token.text, "e") == 0) {
-        token.type = TOKEN_E;
-        token.value = M_E;
-    }
-    else {
-        token.type = TOKEN_ERROR;
-        sprintf(token.text, "Unknown identifier: %s", token.text);
-    }
-    
-    return token;
-}
-
-Token lexer_next_token(Lexer *lexer) {
-    lexer_skip_whitespace(lexer);
-    
-    Token token;
-    token.value = 0;
-    token.text[0] = '\0';
-    
-    if (!lexer->input[lexer->position]) {
-        token.type = TOKEN_EOF;
-        return token;
-    }
-    
-    char c = lexer->input[lexer->position];
-    
-    if (isdigit(c) || (c == '.' && isdigit(lexer->input[lexer->position + 1]))) {
-        return lexer_read_number(lexer);
-    }
-    
-    if (isalpha(c)) {
-        return lexer_read_identifier(lexer);
-    }
-    
-    lexer->position++;
-    
-    switch (c) {
-        case '+':
-            token.type = TOKEN_PLUS;
-            strcpy(token.text, "+");
-            break;
-        case '-':
-            token.type = TOKEN_MINUS;
-            strcpy(token.text, "-");
-            break;
-        case '*':
-            token.type = TOKEN_MULTIPLY;
-            strcpy(token.text, "*");
-            break;
-        case '/':
-            token.type = TOKEN_DIVIDE;
-            strcpy(token.text, "/");
-            break;
-        case '%':
-            token.type = TOKEN_MODULO;
-            strcpy(token.text, "%");
-            break;
-        case '^':
-            token.type = TOKEN_POWER;
-            strcpy(token.text, "^");
-            break;
-        case '(':
-            token.type = TOKEN_LPAREN;
-            strcpy(token.text, "(");
-            break;
-        case ')':
-            token.type = TOKEN_RPAREN;
-            strcpy(token.text, ")");
-            break;
-        default:
-            token.type = TOKEN_ERROR;
-            sprintf(token.text, "Unexpected character: %c", c);
-            break;
-    }
-    
-    return token;
-}
-
-void lexer_advance(Lexer *lexer) {
-    lexer->current = lexer_next_token(lexer);
-}
-
-typedef struct {
-    Lexer *lexer;
-    char error[256];
-    int has_error;
-} Parser;
-
-void parser_init(Parser *parser, Lexer *lexer) {
-    parser->lexer = lexer;
-    parser->has_error = 0;
-    parser->error[0] = '\0';
-    lexer_advance(lexer);
-}
-
-void parser_error(Parser *parser, const char *message) {
-    parser->has_error = 1;
-    strncpy(parser->error, message, 255);
-    parser->error[255] = '\0';
-}
-
-double parse_expression(Parser *parser);
-double parse_term(Parser *parser);
-double parse_factor(Parser *parser);
-double parse_power(Parser *parser);
-double parse_unary(Parser *parser);
-double parse_primary(Parser *parser);
-
-double parse_expression(Parser *parser) {
-    double left = parse_term(parser);
-    
-    while (!parser->has_error) {
-        TokenType type = parser->lexer->current.type;
-        if (type == TOKEN_PLUS) {
-            lexer_advance(parser->lexer);
-            double right = parse_term(parser);
-            left = left + right;
-        } else if (type == TOKEN_MINUS) {
-            lexer_advance(parser->lexer);
-            double right = parse_term(parser);
-            left = left - right;
-        } else {
-            break;
-        }
-    }
-    
-    return left;
-}
-
-double parse_term(Parser *parser) {
-    double left = parse_factor(parser);
-    
-    while (!parser->has_error) {
-        TokenType type = parser->lexer->current.type;
-        if (type == TOKEN_MULTIPLY) {
-            lexer_advance(parser->lexer);
-            double right = parse_factor(parser);
-            left = left * right;
-        } else if (type == TOKEN_DIVIDE) {
-            lexer_advance(parser->lexer);
-            double right = parse_factor(parser);
-            if (right == 0) {
-                parser_error(parser, "Division by zero");
+#include <limits.h>
+#include <stdint.h>
+
+#include "calc.h"
+#include "batch.h"
+
+// Reads one line of any length into *line, growing it as needed, and
+// strips the newline. Returns 0 at the end of input or when out of memory.
+int read_line(char **line, size_t *capacity, FILE *file) {
+    size_t length = 0;
+    
+    for (;;) {
+        if (*capacity - length < 2) {
+            size_t grown = *capacity ? *capacity * 2 : 1024;
+            char *buffer = realloc(*line, grown);
+            if (!buffer) {
                 return 0;
             }
-            left = left / right;
-        } else if (type == TOKEN_MODULO) {
-            lexer_advance(parser->lexer);
-            double right = parse_factor(parser);
-            if (right == 0) {
-                parser_error(parser, "Modulo by zero");
-                return 0;
-            }
-            left = fmod(left, right);
-        } else {
-            break;
+            *line = buffer;
+            *capacity = grown;
         }
-    }
-    
-    return left;
-}
-
-double parse_factor(Parser *parser) {
-    double left = parse_power(parser);
-    
-    // Check for implicit multiplication patterns
-    // Examples: 2pi, 2sin(x), 2(3+4), (2)(3)
-    while (!parser->has_error) {
-        TokenType next = parser->lexer->current.type;
         
-        // Number or closing paren followed by: constant, function, or opening paren
-        if (next == TOKEN_PI || next == TOKEN_E || 
-            next == TOKEN_LPAREN ||
-            next == TOKEN_SIN || next == TOKEN_COS || next == TOKEN_TAN ||
-            next == TOKEN_SQRT || next == TOKEN_LOG || next == TOKEN_EXP ||
-            next == TOKEN_ABS || next == TOKEN_NUMBER) {
-            
-            // Implicitly multiply by the next factor
-            double right = parse_power(parser);
-            left = left * right;
-        } else {
-            break;
+        size_t room = *capacity - length;
+        if (!fgets(*line + length, room > INT_MAX ? INT_MAX : (int)room, file)) {
+            return length > 0;
         }
-    }
-    
-    return left;
-}
-
-double parse_power(Parser *parser) {
-    double left = parse_unary(parser);
-    
-    if (!parser->has_error && parser->lexer->current.type == TOKEN_POWER) {
-        lexer_advance(parser->lexer);
-        double right = parse_power(parser);
-        return pow(left, right);
-    }
-    
-    return left;
-}
-
-double parse_unary(Parser *parser) {
-    TokenType type = parser->lexer->current.type;
-    
-    if (type == TOKEN_MINUS) {
-        lexer_advance(parser->lexer);
-        return -parse_unary(parser);
-    } else if (type == TOKEN_PLUS) {
-        lexer_advance(parser->lexer);
-        return parse_unary(parser);
-    }
-    
-    if (type == TOKEN_SIN) {
-        lexer_advance(parser->lexer);
-        return sin(parse_primary(parser));
-    } else if (type == TOKEN_COS) {
-        lexer_advance(parser->lexer);
-        return cos(parse_primary(parser));
-    } else if (type == TOKEN_TAN) {
-        lexer_advance(parser->lexer);
-        return tan(parse_primary(parser));
-    } else if (type == TOKEN_SQRT) {
-        lexer_advance(parser->lexer);
-        double value = parse_primary(parser);
-        if (value < 0) {
-            parser_error(parser, "Square root of negative number");
-            return 0;
-        }
-        return sqrt(value);
-    } else if (type == TOKEN_LOG) {
-        lexer_advance(parser->lexer);
-        double value = parse_primary(parser);
-        if (value <= 0) {
-            parser_error(parser, "Logarithm of non-positive number");
-            return 0;
+        length += strlen(*line + length);
+        
+        if (length > 0 && (*line)[length - 1] == '\n') {
+            (*line)[length - 1] = '\0';
+            return 1;
         }
-        return log(value);
-    } else if (type == TOKEN_EXP) {
-        lexer_advance(parser->lexer);
-        return exp(parse_primary(parser));
-    } else if (type == TOKEN_ABS) {
-        lexer_advance(parser->lexer);
-        return fabs(parse_primary(parser));
     }
-    
-    return parse_primary(parser);
 }
 
-double parse_primary(Parser *parser) {
-    Token token = parser->lexer->current;
-    
-    if (token.type == TOKEN_NUMBER) {
-        lexer_advance(parser->lexer);
-        return token.value;
-    }
+// Parses a byte count with an optional K, M or G suffix
+int parse_size(const char *text, size_t *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    int shift = 0;
     
-    if (token.type == TOKEN_PI) {
-        lexer_advance(parser->lexer);
-        return token.value;
-    }
-    
-    if (token.type == TOKEN_E) {
-        lexer_advance(parser->lexer);
-        return token.value;
-    }
-    
-    if (token.type == TOKEN_LPAREN) {
-        lexer_advance(parser->lexer);
-        double value = parse_expression(parser);
-        
-        if (parser->lexer->current.type != TOKEN_RPAREN) {
-            parser_error(parser, "Expected closing parenthesis");
-            return 0;
-        }
-        lexer_advance(parser->lexer);
-        return value;
+    if (end == text || *text == '-') {
+        return 0;
     }
-    
-    if (token.type == TOKEN_EOF) {
-        parser_error(parser, "Unexpected end of expression");
-    } else if (token.type == TOKEN_ERROR) {
-        parser_error(parser, token.text);
-    } else {
-        char error_msg[256];
-        sprintf(error_msg, "Unexpected token: %s", token.text);
-        parser_error(parser, error_msg);
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
     }
-    
-    return 0;
-}
-
-double evaluate(const char *expression, int *error) {
-    Lexer lexer;
-    Parser parser;
-    
-    lexer_init(&lexer, expression);
-    parser_init(&parser, &lexer);
-    
-    double result = parse_expression(&parser);
-    
-    if (!parser.has_error && parser.lexer->current.type != TOKEN_EOF) {
-        parser_error(&parser, "Unexpected tokens after expression");
+    if (shift) {
+        end++;
     }
-    
-    if (parser.has_error) {
-        *error = 1;
-        printf("Error: %s\n", parser.error);
+    if (*end != '\0' || value > (SIZE_MAX >> shift)) {
         return 0;
     }
-    
-    *error = 0;
-    return result;
+    *size = (size_t)value << shift;
+    return 1;
 }
 
 void print_help() {
@@ -429,16 +72,29 @@ void print_help() {
     printf("  %%  Modulo\n");
     printf("  ^  Power\n");
     printf("\nFunctions:\n");
-    printf("  sin(x)   Sine\n");
-    printf("  cos(x)   Cosine\n");
-    printf("  tan(x)   Tangent\n");
-    printf("  sqrt(x)  Square root\n");
-    printf("  log(x)   Natural logarithm\n");
-    printf("  exp(x)   Exponential (e^x)\n");
-    printf("  abs(x)   Absolute value\n");
+    printf("  sin(x)           Sine\n");
+    printf("  cos(x)           Cosine\n");
+    printf("  tan(x)           Tangent\n");
+    printf("  sqrt(x)          Square root\n");
+    printf("  log(x)           Natural logarithm\n");
+    printf("  exp(x)           Exponential (e^x)\n");
+    printf("  abs(x)           Absolute value\n");
+    printf("  atan2(y, x)      Angle of the point (x, y)\n");
+    printf("  hypot(x, y)      Length of (x, y)\n");
+    printf("  min(a, b)        Smaller of a and b\n");
+    printf("  max(a, b)        Larger of a and b\n");
+    printf("  clamp(x, lo, hi) x limited to [lo, hi]\n");
+    printf("  fma(a, b, c)     a*b + c, rounded once\n");
+    printf("  pow(x, y)        x^y\n");
+    printf("  logb(x, b)       Logarithm of x to base b\n");
     printf("\nConstants:\n");
     printf("  pi       π (3.14159...)\n");
     printf("  e        Euler's number (2.71828...)\n");
+    printf("\nVariables:\n");
+    printf("  x = expr Store a result in x\n");
+    printf("  ans      The last result\n");
+    printf("\nUser functions:\n");
+    printf("  f(x, y) = expr  Define f of up to three parameters\n");
     printf("\nCommands:\n");
     printf("  help     Show this help\n");
     printf("  quit     Exit calculator\n");
@@ -450,6 +106,10 @@ void print_help() {
     printf("  sqrt(16) + log(e)\n");
     printf("  2^8\n");
     printf("  (5 + 3) * 2\n");
+    printf("  r = 2.5\n");
+    printf("  pi * r^2\n");
+    printf("  area(r) = pi * r^2\n");
+    printf("  area(2) + area(3)\n");
     printf("====================\n\n");
 }
 
@@ -461,9 +121,66 @@ void clear_screen() {
     #endif
 }
 
-int main() {
-    char input[MAX_EXPR_LEN];
-    int error;
+int main(int argc, char **argv) {
+    char *input = NULL;
+    size_t input_capacity = 0;
+    CalcError error;
+    const char *batch = NULL;
+    BatchOptions options = {0, 0, NULL, NULL};
+    int batch_only = 0;     // Options that only apply with --batch
+    int usage = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *end;
+            long count = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || end == argv[i] || count < 0 || count > INT_MAX) {
+                usage = 1;
+            }
+            options.threads = (int)count;
+            batch_only = 1;
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            if (!parse_size(argv[++i], &options.cache_bytes)) {
+                usage = 1;
+            }
+            batch_only = 1;
+        } else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) {
+            options.store_path = argv[++i];
+            batch_only = 1;
+        } else if (strcmp(argv[i], "--functions") == 0 && i + 1 < argc) {
+            options.functions_path = argv[++i];
+        } else {
+            usage = 1;
+        }
+    }
+    
+    if (usage || (batch_only && !batch)) {
+        fprintf(stderr, "Usage: %s [--functions FILE] [--batch file|- [--threads N] [--cache-size BYTES[K|M|G]] "
+                "[--store FILE]]\n", argv[0]);
+        return 2;
+    }
+    if (batch) {
+        return batch_run(batch, &options);
+    }
+    
+    char *definitions = NULL;
+    if (options.functions_path) {
+        definitions = batch_read_functions(options.functions_path);
+        if (!definitions) {
+            return 1;
+        }
+    }
+    
+    CalcContext *ctx = calc_context_new();
+    if (!ctx || (definitions && !batch_define_functions(ctx, definitions))) {
+        fprintf(stderr, "Out of memory\n");
+        calc_context_free(ctx);
+        free(definitions);
+        return 1;
+    }
+    free(definitions);
     
     printf("=== C Calculator ===\n");
     printf("Type 'help' for instructions or 'quit' to exit\n\n");
@@ -472,12 +189,10 @@ int main() {
         printf("> ");
         fflush(stdout);
         
-        if (!fgets(input, sizeof(input), stdin)) {
+        if (!read_line(&input, &input_capacity, stdin)) {
             break;
         }
         
-        input[strcspn(input, "\n")] = '\0';
-        
         if (strlen(input) == 0) {
             continue;
         }
@@ -499,12 +214,22 @@ int main() {
             continue;
         }
         
-        double result = evaluate(input, &error);
+        double result = calc_evaluate(ctx, input, &error);
         
-        if (!error) {
-            printf("= %.10g\n", result);
+        if (error.code != CALC_OK) {
+            char message[256];
+            calc_error_format(&error, input, message, sizeof(message));
+            printf("Error: %s\n", message);
+        } else if (calc_defined_function(ctx)) {
+            printf("Defined %s\n", calc_defined_function(ctx));
+        } else {
+            char text[CALC_FORMAT_SHORTEST_SIZE];
+            calc_format(result, CALC_FORMAT_SHORTEST, 0, text, sizeof(text));
+            printf("= %s\n", text);
         }
     }
     
+    free(input);
+    calc_context_free(ctx);
     return 0;
 }
\ No newline at end of file
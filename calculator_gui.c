@@ -1,44 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
-#include <math.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
 
-#define MAX_TOKEN_LEN 256
+#include "calc.h"
+
 #define MAX_EXPR_LEN 1024
 #define BUTTON_WIDTH 60
 #define BUTTON_HEIGHT 50
 #define DISPLAY_HEIGHT 60
 #define PADDING 5
 
-typedef enum {
-    TOKEN_NUMBER, TOKEN_PLUS, TOKEN_MINUS, TOKEN_MULTIPLY, TOKEN_DIVIDE,
-    TOKEN_MODULO, TOKEN_POWER, TOKEN_LPAREN, TOKEN_RPAREN,
-    TOKEN_SIN, TOKEN_COS, TOKEN_TAN, TOKEN_SQRT, TOKEN_LOG, TOKEN_EXP,
-    TOKEN_ABS, TOKEN_PI, TOKEN_E, TOKEN_EOF, TOKEN_ERROR
-} TokenType;
-
-typedef struct {
-    TokenType type;
-    double value;
-    char text[MAX_TOKEN_LEN];
-} Token;
-
-typedef struct {
-    const char *input;
-    int position;
-    Token current;
-} Lexer;
-
-typedef struct {
-    Lexer *lexer;
-    char error[256];
-    int has_error;
-} Parser;
-
 typedef struct {
     char label[16];
     int x, y;
@@ -55,323 +29,18 @@ typedef struct {
     int display_pos;
     Button *buttons;
     int button_count;
+    CalcContext *context;
 } Calculator;
 
 Calculator calc;
 
-void lexer_init(Lexer *lexer, const char *input) {
-    lexer->input = input;
-    lexer->position = 0;
-    lexer->current.type = TOKEN_EOF;
-}
-
-void lexer_skip_whitespace(Lexer *lexer) {
-    while (lexer->input[lexer->position] && isspace(lexer->input[lexer->position])) {
-        lexer->position++;
-    }
-}
-
-Token lexer_read_number(Lexer *lexer) {
-    Token token;
-    token.type = TOKEN_NUMBER;
-    int start = lexer->position;
-    int has_dot = 0;
-    
-    while (lexer->input[lexer->position]) {
-        char c = lexer->input[lexer->position];
-        if (isdigit(c)) {
-            lexer->position++;
-        } else if (c == '.' && !has_dot) {
-            has_dot = 1;
-            lexer->position++;
-        } else {
-            break;
-        }
-    }
-    
-    int len = lexer->position - start;
-    if (len >= MAX_TOKEN_LEN) len = MAX_TOKEN_LEN - 1;
-    strncpy(token.text, lexer->input + start, len);
-    token.text[len] = '\0';
-    token.value = atof(token.text);
-    return token;
-}
-
-Token lexer_read_identifier(Lexer *lexer) {
-    Token token;
-    int start = lexer->position;
-    
-    while (lexer->input[lexer->position] && isalpha(lexer->input[lexer->position])) {
-        lexer->position++;
-    }
-    
-    int len = lexer->position - start;
-    if (len >= MAX_TOKEN_LEN) len = MAX_TOKEN_LEN - 1;
-    strncpy(token.text, lexer->input + start, len);
-    token.text[len] = '\0';
-    
-    if (strcmp(token.text, "sin") == 0) token.type = TOKEN_SIN;
-    else if (strcmp(token.text, "cos") == 0) token.type = TOKEN_COS;
-    else if (strcmp(token.text, "tan") == 0) token.type = TOKEN_TAN;
-    else if (strcmp(token.text, "sqrt") == 0) token.type = TOKEN_SQRT;
-    else if (strcmp(token.text, "log") == 0) token.type = TOKEN_LOG;
-    else if (strcmp(token.text, "exp") == 0) token.type = TOKEN_EXP;
-    else if (strcmp(token.text, "abs") == 0) token.type = TOKEN_ABS;
-    else if (strcmp(token.text, "pi") == 0) {
-        token.type = TOKEN_PI;
-        token.value = M_PI;
-    }
-    else if (strcmp(token.text, "e") == 0) {
-        token.type = TOKEN_E;
-        token.value = M_E;
-    }
-    else {
-        token.type = TOKEN_ERROR;
-        sprintf(token.text, "Unknown: %s", token.text);
-    }
-    return token;
-}
-
-Token lexer_next_token(Lexer *lexer) {
-    lexer_skip_whitespace(lexer);
-    Token token;
-    token.value = 0;
-    token.text[0] = '\0';
-    
-    if (!lexer->input[lexer->position]) {
-        token.type = TOKEN_EOF;
-        return token;
-    }
-    
-    char c = lexer->input[lexer->position];
-    
-    if (isdigit(c) || (c == '.' && isdigit(lexer->input[lexer->position + 1]))) {
-        return lexer_read_number(lexer);
-    }
-    
-    if (isalpha(c)) {
-        return lexer_read_identifier(lexer);
-    }
-    
-    lexer->position++;
-    
-    switch (c) {
-        case '+': token.type = TOKEN_PLUS; strcpy(token.text, "+"); break;
-        case '-': token.type = TOKEN_MINUS; strcpy(token.text, "-"); break;
-        case '*': token.type = TOKEN_MULTIPLY; strcpy(token.text, "*"); break;
-        case '/': token.type = TOKEN_DIVIDE; strcpy(token.text, "/"); break;
-        case '%': token.type = TOKEN_MODULO; strcpy(token.text, "%"); break;
-        case '^': token.type = TOKEN_POWER; strcpy(token.text, "^"); break;
-        case '(': token.type = TOKEN_LPAREN; strcpy(token.text, "("); break;
-        case ')': token.type = TOKEN_RPAREN; strcpy(token.text, ")"); break;
-        default:
-            token.type = TOKEN_ERROR;
-            sprintf(token.text, "Unknown: %c", c);
-            break;
-    }
-    return token;
-}
-
-void lexer_advance(Lexer *lexer) {
-    lexer->current = lexer_next_token(lexer);
-}
-
-void parser_init(Parser *parser, Lexer *lexer) {
-    parser->lexer = lexer;
-    parser->has_error = 0;
-    parser->error[0] = '\0';
-    lexer_advance(lexer);
-}
-
-void parser_error(Parser *parser, const char *message) {
-    parser->has_error = 1;
-    strncpy(parser->error, message, 255);
-    parser->error[255] = '\0';
-}
-
-double parse_expression(Parser *parser);
-double parse_term(Parser *parser);
-double parse_factor(Parser *parser);
-double parse_power(Parser *parser);
-double parse_unary(Parser *parser);
-double parse_primary(Parser *parser);
-
-double parse_expression(Parser *parser) {
-    double left = parse_term(parser);
-    while (!parser->has_error) {
-        TokenType type = parser->lexer->current.type;
-        if (type == TOKEN_PLUS) {
-            lexer_advance(parser->lexer);
-            left = left + parse_term(parser);
-        } else if (type == TOKEN_MINUS) {
-            lexer_advance(parser->lexer);
-            left = left - parse_term(parser);
-        } else {
-            break;
-        }
-    }
-    return left;
-}
-
-double parse_term(Parser *parser) {
-    double left = parse_factor(parser);
-    while (!parser->has_error) {
-        TokenType type = parser->lexer->current.type;
-        if (type == TOKEN_MULTIPLY) {
-            lexer_advance(parser->lexer);
-            left = left * parse_factor(parser);
-        } else if (type == TOKEN_DIVIDE) {
-            lexer_advance(parser->lexer);
-            double right = parse_factor(parser);
-            if (right == 0) {
-                parser_error(parser, "Division by zero");
-                return 0;
-            }
-            left = left / right;
-        } else if (type == TOKEN_MODULO) {
-            lexer_advance(parser->lexer);
-            double right = parse_factor(parser);
-            if (right == 0) {
-                parser_error(parser, "Modulo by zero");
-                return 0;
-            }
-            left = fmod(left, right);
-        } else {
-            break;
-        }
-    }
-    return left;
-}
-
-double parse_factor(Parser *parser) {
-    double left = parse_power(parser);
-    
-    // Check for implicit multiplication patterns
-    // Examples: 2pi, 2sin(x), 2(3+4), (2)(3)
-    while (!parser->has_error) {
-        TokenType next = parser->lexer->current.type;
-        
-        // Number or closing paren followed by: constant, function, or opening paren
-        if (next == TOKEN_PI || next == TOKEN_E || 
-            next == TOKEN_LPAREN ||
-            next == TOKEN_SIN || next == TOKEN_COS || next == TOKEN_TAN ||
-            next == TOKEN_SQRT || next == TOKEN_LOG || next == TOKEN_EXP ||
-            next == TOKEN_ABS || next == TOKEN_NUMBER) {
-            
-            // Implicitly multiply by the next factor
-            double right = parse_power(parser);
-            left = left * right;
-        } else {
-            break;
-        }
-    }
-    
-    return left;
-}
-
-double parse_power(Parser *parser) {
-    double left = parse_unary(parser);
-    if (!parser->has_error && parser->lexer->current.type == TOKEN_POWER) {
-        lexer_advance(parser->lexer);
-        return pow(left, parse_power(parser));
-    }
-    return left;
-}
-
-double parse_unary(Parser *parser) {
-    TokenType type = parser->lexer->current.type;
-    
-    if (type == TOKEN_MINUS) {
-        lexer_advance(parser->lexer);
-        return -parse_unary(parser);
-    } else if (type == TOKEN_PLUS) {
-        lexer_advance(parser->lexer);
-        return parse_unary(parser);
-    }
-    
-    if (type == TOKEN_SIN) {
-        lexer_advance(parser->lexer);
-        return sin(parse_primary(parser));
-    } else if (type == TOKEN_COS) {
-        lexer_advance(parser->lexer);
-        return cos(parse_primary(parser));
-    } else if (type == TOKEN_TAN) {
-        lexer_advance(parser->lexer);
-        return tan(parse_primary(parser));
-    } else if (type == TOKEN_SQRT) {
-        lexer_advance(parser->lexer);
-        double value = parse_primary(parser);
-        if (value < 0) {
-            parser_error(parser, "Sqrt of negative");
-            return 0;
-        }
-        return sqrt(value);
-    } else if (type == TOKEN_LOG) {
-        lexer_advance(parser->lexer);
-        double value = parse_primary(parser);
-        if (value <= 0) {
-            parser_error(parser, "Log of non-positive");
-            return 0;
-        }
-        return log(value);
-    } else if (type == TOKEN_EXP) {
-        lexer_advance(parser->lexer);
-        return exp(parse_primary(parser));
-    } else if (type == TOKEN_ABS) {
-        lexer_advance(parser->lexer);
-        return fabs(parse_primary(parser));
-    }
-    
-    return parse_primary(parser);
-}
-
-double parse_primary(Parser *parser) {
-    Token token = parser->lexer->current;
-    
-    if (token.type == TOKEN_NUMBER || token.type == TOKEN_PI || token.type == TOKEN_E) {
-        lexer_advance(parser->lexer);
-        return token.value;
-    }
-    
-    if (token.type == TOKEN_LPAREN) {
-        lexer_advance(parser->lexer);
-        double value = parse_expression(parser);
-        if (parser->lexer->current.type != TOKEN_RPAREN) {
-            parser_error(parser, "Missing )");
-            return 0;
-        }
-        lexer_advance(parser->lexer);
-        return value;
-    }
-    
-    if (token.type == TOKEN_EOF) {
-        parser_error(parser, "Unexpected end");
-    } else if (token.type == TOKEN_ERROR) {
-        parser_error(parser, token.text);
-    } else {
-        char error_msg[256];
-        sprintf(error_msg, "Unexpected: %s", token.text);
-        parser_error(parser, error_msg);
-    }
-    return 0;
-}
-
 double evaluate(const char *expression, int *error) {
-    Lexer lexer;
-    Parser parser;
-    
-    lexer_init(&lexer, expression);
-    parser_init(&parser, &lexer);
-    
-    double result = parse_expression(&parser);
+    CalcError status;
+    double result = calc_evaluate(calc.context, expression, &status);
     
-    if (!parser.has_error && parser.lexer->current.type != TOKEN_EOF) {
-        parser_error(&parser, "Extra tokens");
-    }
-    
-    if (parser.has_error) {
+    if (status.code != CALC_OK) {
         *error = 1;
-        strcpy(calc.result_text, parser.error);
+        calc_error_format(&status, expression, calc.result_text, sizeof(calc.result_text));
         return 0;
     }
     
@@ -406,8 +75,12 @@ void calculate() {
     int error;
     double result = evaluate(calc.display_text, &error);
     
-    if (!error) {
-        sprintf(calc.result_text, "= %.10g", result);
+    if (!error && calc_defined_function(calc.context)) {
+        snprintf(calc.result_text, sizeof(calc.result_text), "Defined %s", calc_defined_function(calc.context));
+    } else if (!error) {
+        calc.result_text[0] = '=';
+        calc.result_text[1] = ' ';
+        calc_format(result, CALC_FORMAT_SHORTEST, 0, calc.result_text + 2, sizeof(calc.result_text) - 2);
     }
 }
 
@@ -501,6 +174,12 @@ Button* find_button(int x, int y) {
 }
 
 int main() {
+    calc.context = calc_context_new();
+    if (!calc.context) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    
     calc.display = XOpenDisplay(NULL);
     if (!calc.display) {
         fprintf(stderr, "Cannot open display\n");
@@ -565,6 +244,7 @@ int main() {
     XFreeGC(calc.display, calc.gc);
     XDestroyWindow(calc.display, calc.window);
     XCloseDisplay(calc.display);
+    calc_context_free(calc.context);
     
     return 0;
 }
\ No newline at end of file
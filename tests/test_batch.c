@@ -0,0 +1,237 @@
+// Checks the batch kernels against glibc: every function is swept through
+// calc_eval_batch() and compared row by row with calc_eval(), which calls
+// libm, and the worst error must stay within the bound documented with
+// the kernels in calc.c. Blocks that the kernels hand to libm (a trig
+// argument beyond 1e5, inf, NaN, an atan2 zero, a hypot that could
+// overflow) must match exactly.
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../calc.h"
+
+#define ROWS 256        // One block
+#define BLOCKS 4000
+
+static uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// A random double with a magnitude of about 2^min_exponent to
+// 2^max_exponent, negative too if sign is set
+static double random_value(int min_exponent, int max_exponent, int sign) {
+    uint64_t bits = next_random();
+    double mantissa = 1 + (double)(bits >> 12) / 4503599627370496.0;
+    int exponent = min_exponent + (int)(next_random() % (uint64_t)(max_exponent - min_exponent + 1));
+    double value = ldexp(mantissa, exponent);
+    return sign && (bits & 1) ? -value : value;
+}
+
+// Distance from got to want in units in the last place of want
+static double ulp_error(double got, double want) {
+    if (got == want || (isnan(got) && isnan(want))) {
+        return 0;
+    }
+    if (isnan(got) || isnan(want) || isinf(got) || isinf(want)) {
+        return INFINITY;
+    }
+    double ulp = fabs(nextafter(want, INFINITY) - want);
+    if (ulp == 0 || isinf(ulp)) {
+        ulp = fabs(want - nextafter(want, -INFINITY));
+    }
+    return fabs(got - want) / ulp;
+}
+
+typedef struct {
+    const char *expression;
+    int arity;
+    int min_exponent;
+    int max_exponent;
+    int sign;
+    double bound;       // ULP
+} Sweep;
+
+static const Sweep sweeps[] = {
+    {"sin(x)", 1, -30, 16, 1, 1},
+    {"cos(x)", 1, -30, 16, 1, 1},
+    {"tan(x)", 1, -30, 16, 1, 2},
+    {"exp(x)", 1, -40, 9, 1, 1},
+    {"log(x)", 1, -1074, 1023, 0, 1},
+    {"sqrt(x)", 1, -1074, 1023, 0, 0},
+    {"abs(x)", 1, -1074, 1023, 1, 0},
+    {"atan2(x, y)", 2, -500, 500, 1, 2},
+    {"hypot(x, y)", 2, -400, 400, 1, 1},
+    {"min(x, y)", 2, -100, 100, 1, 0},
+    {"max(x, y)", 2, -100, 100, 1, 0},
+    {"logb(x, y)", 2, -300, 300, 0, 3},
+    {"clamp(x, y, z)", 3, -100, 100, 1, 0},
+    {"fma(x, y, z)", 3, -100, 100, 1, 0}
+};
+
+// Arguments that the kernels leave to libm for the whole block
+static const struct {
+    const char *expression;
+    double value;
+} fallbacks[] = {
+    {"sin(x)", INFINITY}, {"sin(x)", -INFINITY}, {"sin(x)", NAN}, {"sin(x)", 2e5}, {"sin(x)", -1e300},
+    {"cos(x)", INFINITY}, {"cos(x)", -INFINITY}, {"cos(x)", NAN}, {"cos(x)", 2e5}, {"cos(x)", -1e300},
+    {"tan(x)", INFINITY}, {"tan(x)", -INFINITY}, {"tan(x)", NAN}, {"tan(x)", 2e5}, {"tan(x)", -1e300},
+    {"atan2(x, y)", 0.0}, {"atan2(x, y)", -0.0}, {"atan2(x, y)", INFINITY}, {"atan2(x, y)", 1e300},
+    {"hypot(x, y)", 1e300}, {"hypot(x, y)", 0x1.0000000000001p500}, {"hypot(x, y)", INFINITY}
+};
+
+static double columns[3][ROWS];
+static double out[ROWS];
+
+// Runs one block of expr and returns the worst error against calc_eval()
+// over it, or -1 if a row that should have failed did not or vice versa
+static double check_block(const CompiledExpr *expr, int arity, size_t *worst_row) {
+    const double *x[3] = {columns[0], columns[1], columns[2]};
+    size_t failed = calc_eval_batch(expr, x, ROWS, out);
+    size_t expected_failures = 0;
+    double worst = 0;
+    
+    for (size_t i = 0; i < ROWS; i++) {
+        double vars[3];
+        for (int j = 0; j < arity; j++) {
+            vars[j] = columns[j][i];
+        }
+        CalcErrorCode code;
+        double want = calc_eval(expr, vars, &code);
+        if (code != CALC_OK) {
+            expected_failures++;
+            if (!isnan(out[i])) {
+                *worst_row = i;
+                return -1;
+            }
+            continue;
+        }
+        double error = ulp_error(out[i], want);
+        if (error > worst) {
+            worst = error;
+            *worst_row = i;
+        }
+    }
+    return failed == expected_failures ? worst : -1;
+}
+
+static int report(const char *expression, const char *what, double error, double bound, int arity,
+                  size_t row) {
+    if (error >= 0 && error <= bound) {
+        return 0;
+    }
+    printf("FAIL %s (%s): ", expression, what);
+    if (error < 0) {
+        printf("math errors differ");
+    } else {
+        printf("%.2f ULP, bound %.0f", error, bound);
+    }
+    printf(" at");
+    for (int j = 0; j < arity; j++) {
+        printf(" %.17g", columns[j][row]);
+    }
+    printf("\n");
+    return 1;
+}
+
+// Fills the block from sweep, then plants value in its first row so that
+// the whole block takes the libm fallback
+static double fallback_block(const CompiledExpr *expr, const Sweep *sweep, double value, size_t *row) {
+    for (size_t i = 0; i < ROWS; i++) {
+        for (int j = 0; j < sweep->arity; j++) {
+            columns[j][i] = random_value(sweep->min_exponent, sweep->max_exponent, sweep->sign);
+        }
+    }
+    columns[0][0] = value;
+    return check_block(expr, sweep->arity, row);
+}
+
+int main(void) {
+    int failures = 0;
+    
+    for (size_t s = 0; s < sizeof(sweeps) / sizeof(sweeps[0]); s++) {
+        const Sweep *sweep = &sweeps[s];
+        CalcError error;
+        CompiledExpr *expr = calc_compile(sweep->expression, &error);
+        if (!expr) {
+            printf("FAIL %s: does not compile\n", sweep->expression);
+            failures++;
+            continue;
+        }
+        
+        double worst = 0;
+        for (int block = 0; block < BLOCKS; block++) {
+            for (size_t i = 0; i < ROWS; i++) {
+                for (int j = 0; j < sweep->arity; j++) {
+                    columns[j][i] = random_value(sweep->min_exponent, sweep->max_exponent, sweep->sign);
+                }
+            }
+            size_t row = 0;
+            double block_error = check_block(expr, sweep->arity, &row);
+            if (report(sweep->expression, "sweep", block_error, sweep->bound, sweep->arity, row)) {
+                failures++;
+                break;
+            }
+            if (block_error > worst) {
+                worst = block_error;
+            }
+        }
+        printf("%-16s %.2f ULP (bound %.0f)\n", sweep->expression, worst, sweep->bound);
+        
+        // Special values may take either path but must stay within bounds
+        static const double specials[] = {INFINITY, -INFINITY, NAN, 0.0, -0.0, 1e300, 5e-324};
+        for (size_t k = 0; k < sizeof(specials) / sizeof(specials[0]); k++) {
+            size_t row = 0;
+            double special_error = fallback_block(expr, sweep, specials[k], &row);
+            if (report(sweep->expression, "special", special_error, sweep->bound, sweep->arity, row)) {
+                failures++;
+            }
+        }
+        
+        // Values that send the block to libm, which must then agree exactly
+        for (size_t k = 0; k < sizeof(fallbacks) / sizeof(fallbacks[0]); k++) {
+            if (strcmp(fallbacks[k].expression, sweep->expression) != 0) {
+                continue;
+            }
+            size_t row = 0;
+            double fallback_error = fallback_block(expr, sweep, fallbacks[k].value, &row);
+            if (report(sweep->expression, "fallback", fallback_error, 0, sweep->arity, row)) {
+                failures++;
+            }
+        }
+        
+        calc_free(expr);
+    }
+    
+    // The trig cutoff: up to 1e5 the kernels run, past it the whole block
+    // goes to libm
+    static const char *const trig[] = {"sin(x)", "cos(x)", "tan(x)"};
+    static const double cutoffs[][2] = {{1e5, 2}, {100000.00000000001, 0}, {-2e5, 0}, {1e22, 0}};
+    for (size_t t = 0; t < 3; t++) {
+        CalcError error;
+        CompiledExpr *expr = calc_compile(trig[t], &error);
+        for (size_t c = 0; c < sizeof(cutoffs) / sizeof(cutoffs[0]); c++) {
+            for (size_t i = 0; i < ROWS; i++) {
+                columns[0][i] = cutoffs[c][0] - (double)i * 0.37;
+            }
+            size_t row = 0;
+            double cutoff_error = check_block(expr, 1, &row);
+            if (report(trig[t], "cutoff", cutoff_error, cutoffs[c][1], 1, row)) {
+                failures++;
+            }
+        }
+        calc_free(expr);
+    }
+    
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
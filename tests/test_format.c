@@ -0,0 +1,144 @@
+// Checks CALC_FORMAT_SHORTEST: the output must read back as the same
+// double and no decimal with fewer significant digits may do so. This
+// includes calc.c to call grisu3() directly, so it can make sure that
+// values where Grisu3 gives up, and the exact fallback runs, are covered.
+#include "../calc.c"
+
+#include <float.h>
+#include <stdint.h>
+
+static int failures;
+static int fallbacks;
+
+static uint64_t state = 0xD1B54A32D192ED03ULL;
+
+static uint64_t next_random(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Whether the decimal mantissa * 10^exponent reads back as value
+static int reads_back(unsigned long long mantissa, int exponent, double value) {
+    char text[48];
+    snprintf(text, sizeof(text), "%llue%d", mantissa, exponent);
+    return strtod(text, NULL) == value;
+}
+
+static void check(double value) {
+    char buffer[CALC_FORMAT_SHORTEST_SIZE];
+    size_t length = calc_format(value, CALC_FORMAT_SHORTEST, 0, buffer, sizeof(buffer));
+    if (length >= sizeof(buffer)) {
+        printf("FAIL %a: needs %zu bytes\n", value, length);
+        failures++;
+        return;
+    }
+    
+    double read = strtod(buffer, NULL);
+    if (memcmp(&read, &value, sizeof(double)) != 0) {
+        printf("FAIL %a: %s reads back as %a\n", value, buffer, read);
+        failures++;
+        return;
+    }
+    
+    // Significant digits in the output
+    int digits = 0;
+    int zeros = 0;
+    for (const char *p = buffer; *p && *p != 'e'; p++) {
+        if (*p == '0') {
+            zeros += digits > 0;
+        } else if (*p >= '1' && *p <= '9') {
+            digits += zeros + 1;
+            zeros = 0;
+        }
+    }
+    if (digits <= 1) {
+        return;
+    }
+    
+    // Any shorter decimal that reads back lies on the same side of value
+    // as one of the nearest ones with digits - 1 digits, so those suffice
+    char shorter[32];
+    snprintf(shorter, sizeof(shorter), "%.*e", digits - 2, fabs(value));
+    unsigned long long mantissa = 0;
+    for (const char *p = shorter; *p != 'e'; p++) {
+        if (*p != '.') {
+            mantissa = mantissa * 10 + (unsigned long long)(*p - '0');
+        }
+    }
+    int exponent = atoi(strchr(shorter, 'e') + 1) - (digits - 2);
+    double magnitude = fabs(value);
+    if (reads_back(mantissa - 1, exponent, magnitude) || reads_back(mantissa, exponent, magnitude) ||
+        reads_back(mantissa + 1, exponent, magnitude)) {
+        printf("FAIL %a: %s is not the shortest\n", value, buffer);
+        failures++;
+    }
+}
+
+// Checks value and counts it if Grisu3 cannot settle it
+static void check_counting(double value) {
+    char digits[FORMAT_MAX_DIGITS + 1];
+    int length;
+    int point;
+    if (value != 0 && isfinite(value) && !grisu3(fabs(value), digits, &length, &point)) {
+        fallbacks++;
+    }
+    check(value);
+}
+
+static const double values[] = {
+    0.0, -0.0, 5e-324, -5e-324, 1e-323, 2.2250738585072009e-308, 2.2250738585072014e-308,
+    1e23, 9007199254740993.0, 0.1, 0.3, 1.0 / 3, 100, 123456, 1e15, 1e16, 1e21, 1e22, 2e-5,
+    5e-5, DBL_MAX, -DBL_MAX, 1.7976931348623155e308
+};
+
+// Grisu3 cannot settle these
+static const double grisu3_failures[] = {
+    6.178e-310, 9.05e-271, 1.373e-229, 1.249e-188, 4.75e-148, 1.57e-107, 2.75e-66, 1.265e-24,
+    5.9031e20, 1.47e59, 1.1923e102, 5.67e141
+};
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        check_counting(values[i]);
+    }
+    for (size_t i = 0; i < sizeof(grisu3_failures) / sizeof(grisu3_failures[0]); i++) {
+        int before = fallbacks;
+        check_counting(grisu3_failures[i]);
+        if (fallbacks == before) {
+            printf("FAIL %.17g: expected Grisu3 to give up\n", grisu3_failures[i]);
+            failures++;
+        }
+    }
+    
+    // Random bit patterns, then subnormals
+    int found = fallbacks;
+    for (int i = 0; i < 1000000; i++) {
+        uint64_t bits = next_random();
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        if (isfinite(value)) {
+            check_counting(value);
+        }
+    }
+    for (int i = 0; i < 200000; i++) {
+        uint64_t bits = next_random() & 0x800FFFFFFFFFFFFFULL;
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        check_counting(value);
+    }
+    
+    // Without these the test would not reach dragon_shortest()
+    if (fallbacks - found < 100) {
+        printf("FAIL only %d random values needed the exact fallback\n", fallbacks - found);
+        failures++;
+    }
+    
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("format round trip ok, %d values through the exact fallback\n", fallbacks);
+    return 0;
+}
@@ -0,0 +1,169 @@
+// Differential test of the JIT: random expressions are compiled twice,
+// one copy goes through calc_jit(), and both must give the same bits and
+// the same error code as the interpreter for every set of variables,
+// including the exits for division by zero and the domain errors.
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../calc.h"
+
+#define EXPRESSIONS 20000
+#define MAX_DEPTH 5
+
+static uint64_t state = 0x94D049BB133111EBULL;
+
+static uint64_t next_random(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static unsigned pick(unsigned n) {
+    return (unsigned)(next_random() % n);
+}
+
+static const struct {
+    const char *name;
+    int arity;
+} functions[] = {
+    {"sin", 1}, {"cos", 1}, {"tan", 1}, {"sqrt", 1}, {"log", 1}, {"exp", 1}, {"abs", 1},
+    {"pow", 2}, {"atan2", 2}, {"hypot", 2}, {"min", 2}, {"max", 2}, {"logb", 2},
+    {"clamp", 3}, {"fma", 3}
+};
+
+static const char *const leaves[] = {
+    "a", "b", "c", "d", "0", "1", "2", "0.5", "3", "-1", "1e300", "pi", "e"
+};
+
+static const char operators[] = "+-*/%^";
+
+// Appends a random expression of at most depth levels to text
+static void generate(char *text, size_t size, int depth) {
+    size_t length = strlen(text);
+    unsigned kind = depth == 0 ? 0 : pick(5);
+    
+    if (kind == 0) {
+        snprintf(text + length, size - length, "%s", leaves[pick(sizeof(leaves) / sizeof(leaves[0]))]);
+    } else if (kind == 1) {
+        snprintf(text + length, size - length, "-(");
+        generate(text, size, depth - 1);
+        strncat(text, ")", size - strlen(text) - 1);
+    } else if (kind == 2) {
+        unsigned f = pick(sizeof(functions) / sizeof(functions[0]));
+        snprintf(text + length, size - length, "%s(", functions[f].name);
+        for (int i = 0; i < functions[f].arity; i++) {
+            if (i > 0) {
+                strncat(text, ", ", size - strlen(text) - 1);
+            }
+            generate(text, size, depth - 1);
+        }
+        strncat(text, ")", size - strlen(text) - 1);
+    } else {
+        strncat(text, "(", size - length - 1);
+        generate(text, size, depth - 1);
+        length = strlen(text);
+        snprintf(text + length, size - length, " %c ", operators[pick(sizeof(operators) - 1)]);
+        generate(text, size, depth - 1);
+        strncat(text, ")", size - strlen(text) - 1);
+    }
+}
+
+static const double var_sets[][4] = {
+    {1.5, -2.25, 0, 3},
+    {0, 0, 0, 0},
+    {-1, 2, -0.5, 1e-300},
+    {1e300, -1e300, 7, -7},
+    {0.25, 4, -3, 100},
+    {-0.0, 1, 2, 0.5}
+};
+
+static int compared;
+static int mismatches;
+static int exits[CALC_ERROR_NON_POSITIVE_LOG + 1];
+
+// Compiles text twice, JITs one copy and compares the two on every
+// variable set. Returns 0 when the host refuses executable memory.
+static int compare(const char *text) {
+    CalcError error;
+    CompiledExpr *interpreted = calc_compile(text, &error);
+    CompiledExpr *jitted = calc_compile(text, &error);
+    if (!interpreted || !jitted) {
+        printf("FAIL %s: does not compile\n", text);
+        mismatches++;
+        calc_free(interpreted);
+        calc_free(jitted);
+        return 1;
+    }
+    if (!calc_jit(jitted)) {
+        calc_free(interpreted);
+        calc_free(jitted);
+        return 0;
+    }
+    
+    for (size_t v = 0; v < sizeof(var_sets) / sizeof(var_sets[0]); v++) {
+        CalcErrorCode want_code;
+        CalcErrorCode got_code;
+        double want = calc_eval(interpreted, var_sets[v], &want_code);
+        double got = calc_eval(jitted, var_sets[v], &got_code);
+        compared++;
+        if (want_code <= CALC_ERROR_NON_POSITIVE_LOG) {
+            exits[want_code]++;
+        }
+        if (got_code != want_code || memcmp(&got, &want, sizeof(double)) != 0) {
+            if (mismatches++ < 10) {
+                printf("FAIL %s with vars %zu: jit %a (%s), interpreter %a (%s)\n", text, v, got,
+                       calc_error_string(got_code), want, calc_error_string(want_code));
+            }
+        }
+    }
+    
+    calc_free(interpreted);
+    calc_free(jitted);
+    return 1;
+}
+
+int main(void) {
+    char text[8192];
+    
+    // Nested checked calls emit one error exit per argument, more than
+    // one per instruction
+    static const char *const nested[] = {"logb(%s, b)", "logb(a, %s)", "logb(%s, %s)"};
+    for (size_t n = 0; n < sizeof(nested) / sizeof(nested[0]); n++) {
+        strcpy(text, "a");
+        for (int depth = 0; depth < 12; depth++) {
+            char inner[sizeof(text)];
+            strcpy(inner, text);
+            if (snprintf(text, sizeof(text), nested[n], inner, inner) >= (int)sizeof(text)) {
+                break;
+            }
+            if (!compare(text)) {
+                printf("JIT unavailable, skipped\n");
+                return 0;
+            }
+        }
+    }
+    
+    for (int i = 0; i < EXPRESSIONS; i++) {
+        text[0] = '\0';
+        generate(text, sizeof(text), 1 + pick(MAX_DEPTH));
+        compare(text);
+    }
+    
+    // Every error exit must have been taken for the comparison to cover it
+    for (int code = CALC_ERROR_DIVISION_BY_ZERO; code <= CALC_ERROR_NON_POSITIVE_LOG; code++) {
+        if (exits[code] == 0) {
+            printf("FAIL no expression reached %s\n", calc_error_string((CalcErrorCode)code));
+            mismatches++;
+        }
+    }
+    
+    if (mismatches) {
+        printf("%d mismatches\n", mismatches);
+        return 1;
+    }
+    printf("jit ok, %d evaluations, %d errors\n", compared, compared - exits[CALC_OK]);
+    return 0;
+}
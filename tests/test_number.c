@@ -0,0 +1,174 @@
+// Checks the number lexer: decimal literals must round exactly like
+// strtod(), including the halfway cases that the fast path cannot settle,
+// and the lexer's own syntax (hex floats, digit separators, an exponent
+// that backs off to the constant e) must read as documented.
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../calc.h"
+
+static CalcContext *ctx;
+static int failures;
+
+static uint64_t state = 0x2545F4914F6CDD1DULL;
+
+static uint64_t next_random(void) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static int same(double a, double b) {
+    return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+static void expect(const char *text, double value, CalcErrorCode code) {
+    CalcError error;
+    double got = calc_evaluate(ctx, text, &error);
+    if (error.code != code || (code == CALC_OK && !same(got, value))) {
+        printf("FAIL %s: got %a (%s), want %a (%s)\n", text, got, calc_error_string(error.code), value,
+               calc_error_string(code));
+        failures++;
+    }
+}
+
+// Reads text with strtod() and expects calc to agree to the bit
+static void expect_strtod(const char *text) {
+    expect(text, strtod(text, NULL), CALC_OK);
+}
+
+// Syntax of the lexer beyond plain decimals
+static const struct {
+    const char *text;
+    double value;
+    CalcErrorCode code;
+} cases[] = {
+    {"0x1.8p1", 3, CALC_OK},
+    {"0x10", 16, CALC_OK},
+    {"0xff", 255, CALC_OK},
+    {"0x.8", 0.5, CALC_OK},
+    {"0x1p-1074", 0x1p-1074, CALC_OK},
+    {"0x1.fffffffffffffp1023", DBL_MAX, CALC_OK},
+    {"0x1.fffffffffffff8p1023", INFINITY, CALC_OK},
+    {"0x1.00000000000008p0", 1, CALC_OK},
+    {"0x1.00000000000018p0", 0x1.0000000000002p0, CALC_OK},
+    {"0x1_0", 16, CALC_OK},
+    {"1_000.5", 1000.5, CALC_OK},
+    {"1_000_000", 1000000, CALC_OK},
+    {"0.000_001", 1e-6, CALC_OK},
+    {"1e1_0", 1e10, CALC_OK},
+    {"1__0", 0, CALC_ERROR_TRAILING_TOKENS},
+    {"1_", 0, CALC_ERROR_TRAILING_TOKENS},
+    {"1_e3", 0, CALC_ERROR_TRAILING_TOKENS},
+    {"1e", M_E, CALC_OK},
+    {"2e", 2 * M_E, CALC_OK},
+    {"1e+", 0, CALC_ERROR_UNEXPECTED_END},
+    {".5", 0.5, CALC_OK},
+    {"1.", 1, CALC_OK},
+    {"1e400", INFINITY, CALC_OK},
+    {"1e-400", 0, CALC_OK}
+};
+
+// Decimals that are hard to round: exact halfway points and their
+// neighbours are generated below
+static const char *const decimals[] = {
+    "1e23",
+    "8.5e-323",
+    "2.2250738585072011e-308",
+    "2.2250738585072012e-308",
+    "1.7976931348623157e308",
+    "1.7976931348623158e308",
+    "9007199254740993",
+    "9007199254740993.0000000000000000000001",
+    "9007199254740995",
+    "9007199254740992.9999999999999999999999",
+    "2.4703282292062327e-324",
+    "2.4703282292062328e-324",
+    "0.1",
+    "0.30000000000000004",
+    "123456789012345678901234567890",
+    "4.9406564584124654e-324",
+    "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704342711559699508093042880177904174409601"
+};
+
+// Values whose exact halfway points to the next double up must round to
+// even, and one digit either side must round away from them
+static const long double halfway_bases[][2] = {
+    {0, 0x1p-1074L},
+    {0x1p-1074L, 0x1p-1074L},
+    {0x1p-1023L, 0x1p-1074L},
+    {0x1p-1022L - 0x1p-1074L, 0x1p-1074L},
+    {0x1p53L, 2},
+    {0x1p53L + 2, 2},
+    {1, 0x1p-52L},
+    {DBL_MAX, 0x1p971L}
+};
+
+static void check_halfway(long double base, long double ulp) {
+    char exact[1300];
+    char text[1300];
+    snprintf(exact, sizeof(exact), "%.1100Le", base + ulp / 2);
+    expect_strtod(exact);
+    
+    // Trailing zeros off, then one more significant digit below and above
+    char *e = strchr(exact, 'e');
+    char *end = e;
+    while (end[-1] == '0') {
+        end--;
+    }
+    snprintf(text, sizeof(text), "%.*s%s", (int)(end - exact - 1), exact, e);
+    expect_strtod(text);
+    snprintf(text, sizeof(text), "%.*s1%s", (int)(end - exact), exact, e);
+    expect_strtod(text);
+}
+
+int main(void) {
+    ctx = calc_context_new();
+    
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        expect(cases[i].text, cases[i].value, cases[i].code);
+    }
+    for (size_t i = 0; i < sizeof(decimals) / sizeof(decimals[0]); i++) {
+        expect_strtod(decimals[i]);
+    }
+    for (size_t i = 0; i < sizeof(halfway_bases) / sizeof(halfway_bases[0]); i++) {
+        check_halfway(halfway_bases[i][0], halfway_bases[i][1]);
+    }
+    
+    // Random doubles printed to between 1 and 25 significant digits
+    char text[64];
+    for (int i = 0; i < 200000; i++) {
+        uint64_t bits = next_random() & 0x7FFFFFFFFFFFFFFFULL;
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        if (!isfinite(value)) {
+            continue;
+        }
+        snprintf(text, sizeof(text), "%.*e", (int)(next_random() % 25), value);
+        expect_strtod(text);
+    }
+    
+    // Random digit strings with exponents around the ends of the range
+    for (int i = 0; i < 200000; i++) {
+        int digits = 1 + (int)(next_random() % 40);
+        size_t length = 0;
+        for (int j = 0; j < digits; j++) {
+            text[length++] = (char)('0' + next_random() % 10);
+        }
+        snprintf(text + length, sizeof(text) - length, "e%d", (int)(next_random() % 700) - 360);
+        expect_strtod(text);
+    }
+    
+    calc_context_free(ctx);
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("number parsing ok\n");
+    return 0;
+}